@@ -54,6 +54,19 @@ uint32_t 		utf8_strnlen		(const char* string, uint32_t end);
 uint32_t		utf8_to_unicode		(const char* character); //UTF8 to Unicode.
 const char* 	unicode_to_utf8		(uint32_t codepoint); //Unicode to UTF8.
 
+// Bulk decoding. `out` must have room for `length` code points; invalid sequences
+// are replaced with U+FFFD and clear *valid (which may be NULL). Returns the
+// number of code points written.
+enum {
+	UTF8_DECODE_AUTO,
+	UTF8_DECODE_SCALAR,
+	UTF8_DECODE_SSE2,
+	UTF8_DECODE_AVX2,
+};
+
+uint32_t		utf8_decode			(const char* string, uint32_t length, uint32_t* out, uint8_t* valid);
+uint32_t		utf8_decodeEx		(const char* string, uint32_t length, uint32_t* out, uint8_t* valid, uint8_t path); //path is one of UTF8_DECODE_*, falling back to the best supported one.
+
 // Internal use / Advanced use.
 uint8_t			utf8_charsize		(const char* character); //calculate the number of bytes a UTF8 character occupies in a string.
 uint8_t			unicode_charsize	(uint32_t codepoint); //calculates the number of bytes occupied by a Unicode character in UTF8.
@@ -0,0 +1,192 @@
+/*
+Bulk UTF8 to UTF32 decoding for the Minimalist UTF8 Iterator.
+
+Whole strings are validated and transcoded in one pass. Runs of ASCII are
+widened 16 (SSE2) or 32 (AVX2) bytes at a time and everything else goes
+through a scalar decoder that follows the well-formed byte sequences of
+table 3-7 in the Unicode standard.
+*/
+
+#include "UTF8.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define UTF8_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#define REPLACEMENT_CHARACTER 0xFFFD
+
+//Converts the ASCII prefix of s to UTF32 and returns its length.
+typedef uint32_t (*ascii_decoder)(const uint8_t* s, uint32_t length, uint32_t* out);
+
+static uint32_t ascii_scalar(const uint8_t* s, uint32_t length, uint32_t* out) {
+	uint32_t i = 0;
+	while (i < length && s[i] < 0x80) {
+		out[i] = s[i];
+		i++;
+	}
+	return i;
+}
+
+#ifdef UTF8_HAVE_X86
+
+//Each block is widened and stored before it is checked: bytes past the ASCII
+//prefix are overwritten later, and the block never extends past the input, so
+//the output never goes past `length` code points either.
+
+__attribute__((target("sse2")))
+static uint32_t ascii_sse2(const uint8_t* s, uint32_t length, uint32_t* out) {
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t i = 0;
+
+	while (i + 16 <= length) {
+		const __m128i v 	= _mm_loadu_si128((const __m128i*)(s + i));
+		const __m128i lo 	= _mm_unpacklo_epi8(v, zero);
+		const __m128i hi 	= _mm_unpackhi_epi8(v, zero);
+
+		_mm_storeu_si128((__m128i*)(out + i), 		_mm_unpacklo_epi16(lo, zero));
+		_mm_storeu_si128((__m128i*)(out + i + 4), 	_mm_unpackhi_epi16(lo, zero));
+		_mm_storeu_si128((__m128i*)(out + i + 8), 	_mm_unpacklo_epi16(hi, zero));
+		_mm_storeu_si128((__m128i*)(out + i + 12), 	_mm_unpackhi_epi16(hi, zero));
+
+		const int mask = _mm_movemask_epi8(v);
+		if (mask) return i + __builtin_ctz(mask);
+
+		i += 16;
+	}
+
+	return i + ascii_scalar(s + i, length - i, out + i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t ascii_avx2(const uint8_t* s, uint32_t length, uint32_t* out) {
+	uint32_t i = 0;
+
+	while (i + 32 <= length) {
+		const __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+
+		for (uint32_t j = 0; j < 32; j += 8) {
+			const __m128i bytes = _mm_loadl_epi64((const __m128i*)(s + i + j));
+			_mm256_storeu_si256((__m256i*)(out + i + j), _mm256_cvtepu8_epi32(bytes));
+		}
+
+		const uint32_t mask = (uint32_t)_mm256_movemask_epi8(v);
+		if (mask) return i + __builtin_ctz(mask);
+
+		i += 32;
+	}
+
+	return i + ascii_sse2(s + i, length - i, out + i);
+}
+
+#endif
+
+//Decodes the sequence starting at a non-ASCII byte. On error the maximal
+//subpart of the sequence is consumed and replaced with U+FFFD.
+static uint32_t decode_sequence(const uint8_t* s, uint32_t length, uint32_t* out, uint8_t* valid) {
+	const uint8_t 	lead 	= s[0];
+	uint8_t 		lo 		= 0x80;
+	uint8_t 		hi 		= 0xBF;
+	uint32_t		need;
+	uint32_t		codepoint;
+
+	if (lead >= 0xC2 && lead <= 0xDF) {
+		need 		= 1;
+		codepoint 	= lead & 0x1F;
+	}
+	else if (lead >= 0xE0 && lead <= 0xEF) {
+		need 		= 2;
+		codepoint 	= lead & 0x0F;
+		if (lead == 0xE0) lo = 0xA0; //overlong
+		if (lead == 0xED) hi = 0x9F; //surrogates
+	}
+	else if (lead >= 0xF0 && lead <= 0xF4) {
+		need 		= 3;
+		codepoint 	= lead & 0x07;
+		if (lead == 0xF0) lo = 0x90; //overlong
+		if (lead == 0xF4) hi = 0x8F; //past U+10FFFF
+	}
+	else {
+		*out 	= REPLACEMENT_CHARACTER;
+		*valid 	= 0;
+		return 1;
+	}
+
+	for (uint32_t i = 1; i <= need; i++) {
+		if (i >= length || s[i] < lo || s[i] > hi) {
+			*out 	= REPLACEMENT_CHARACTER;
+			*valid 	= 0;
+			return i;
+		}
+
+		codepoint 	= (codepoint << 6) | (s[i] & 0x3F);
+		lo 			= 0x80;
+		hi 			= 0xBF;
+	}
+
+	*out = codepoint;
+	return need + 1;
+}
+
+static ascii_decoder select_decoder(uint8_t path) {
+#ifdef UTF8_HAVE_X86
+	__builtin_cpu_init();
+
+	switch (path) {
+	case UTF8_DECODE_AUTO:
+	case UTF8_DECODE_AVX2:
+		if (__builtin_cpu_supports("avx2")) return ascii_avx2;
+		//fall through
+	case UTF8_DECODE_SSE2:
+		if (__builtin_cpu_supports("sse2")) return ascii_sse2;
+		break;
+	default:
+		break;
+	}
+#else
+	(void)path;
+#endif
+	return ascii_scalar;
+}
+
+uint32_t utf8_decodeEx(const char* string, uint32_t length, uint32_t* out, uint8_t* valid, uint8_t path) {
+
+	static ascii_decoder best = NULL;
+	ascii_decoder ascii;
+
+	if (path == UTF8_DECODE_AUTO) {
+		if (best == NULL) best = select_decoder(UTF8_DECODE_AUTO);
+		ascii = best;
+	}
+	else {
+		ascii = select_decoder(path);
+	}
+
+	const uint8_t* s 	= (const uint8_t*)string;
+	uint32_t i 			= 0;
+	uint32_t count 		= 0;
+	uint8_t ok 			= 1;
+
+	if (s == NULL) length = 0;
+
+	while (i < length) {
+		//out never runs ahead of the input, so the ASCII decoder can use the
+		//same offset into both
+		const uint32_t n = ascii(s + i, length - i, out + count);
+		i 		+= n;
+		count 	+= n;
+
+		while (i < length && s[i] >= 0x80) {
+			i += decode_sequence(s + i, length - i, out + count, &ok);
+			count++;
+		}
+	}
+
+	if (valid) *valid = ok;
+
+	return count;
+}
+
+uint32_t utf8_decode(const char* string, uint32_t length, uint32_t* out, uint8_t* valid) {
+	return utf8_decodeEx(string, length, out, valid, UTF8_DECODE_AUTO);
+}
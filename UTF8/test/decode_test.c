@@ -0,0 +1,186 @@
+/*
+Checks the bulk decoder's scalar, SSE2 and AVX2 paths against each other, and
+the scalar path against known results for malformed input. Paths the CPU
+doesn't support fall back to the best one it does, so they are still run but
+only compared with themselves.
+
+Run with "make test". Exits with a non-zero status on the first mismatch.
+*/
+
+#include "../UTF8.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LENGTH 		300
+#define GUARD 			40
+#define SENTINEL 		0xDEADBEEF
+#define RANDOM_INPUTS 	20000
+
+static const uint8_t paths[] = {
+	UTF8_DECODE_SCALAR, UTF8_DECODE_SSE2, UTF8_DECODE_AVX2, UTF8_DECODE_AUTO,
+};
+
+static const char* path_names[] = { "scalar", "sse2", "avx2", "auto" };
+
+static uint32_t failures = 0;
+
+static void dump(const char* label, const uint8_t* s, uint32_t length) {
+	fprintf(stderr, "%s:", label);
+	for (uint32_t i = 0; i < length; i++) fprintf(stderr, " %02X", s[i]);
+	fprintf(stderr, "\n");
+}
+
+//Decodes s with every path and checks that they agree and that none writes
+//past the room it was given. Returns the scalar result in out.
+static uint32_t check(const uint8_t* s, uint32_t length, uint32_t* out, uint8_t* valid) {
+	static uint32_t results[sizeof(paths)][MAX_LENGTH + GUARD];
+	uint32_t counts[sizeof(paths)];
+	uint8_t oks[sizeof(paths)];
+
+	for (uint32_t p = 0; p < sizeof(paths); p++) {
+		for (uint32_t i = 0; i < MAX_LENGTH + GUARD; i++) results[p][i] = SENTINEL;
+
+		counts[p] = utf8_decodeEx((const char*)s, length, results[p], &oks[p], paths[p]);
+
+		for (uint32_t i = length; i < MAX_LENGTH + GUARD; i++) {
+			if (results[p][i] != SENTINEL) {
+				fprintf(stderr, "%s wrote past the output at %u\n", path_names[p], i);
+				dump("input", s, length);
+				failures++;
+				break;
+			}
+		}
+
+		if (p == 0) continue;
+
+		if (counts[p] != counts[0] || oks[p] != oks[0] ||
+				memcmp(results[p], results[0], counts[0] * sizeof(uint32_t))) {
+			fprintf(stderr, "%s disagrees with scalar\n", path_names[p]);
+			dump("input", s, length);
+			failures++;
+		}
+	}
+
+	memcpy(out, results[0], counts[0] * sizeof(uint32_t));
+	*valid = oks[0];
+	return counts[0];
+}
+
+static void expect(const char* input, const uint32_t* expected, uint32_t expected_count, uint8_t expected_valid) {
+	const uint32_t length = strlen(input);
+	uint32_t out[MAX_LENGTH];
+	uint8_t valid;
+	const uint32_t count = check((const uint8_t*)input, length, out, &valid);
+
+	if (count != expected_count || valid != expected_valid ||
+			memcmp(out, expected, count * sizeof(uint32_t))) {
+		fprintf(stderr, "unexpected result\n");
+		dump("input", (const uint8_t*)input, length);
+		failures++;
+	}
+}
+
+#define EXPECT(input, valid, ...) do { \
+	const uint32_t expected[] = { __VA_ARGS__ }; \
+	expect(input, expected, sizeof(expected) / sizeof(expected[0]), valid); \
+} while (0)
+
+#define R 0xFFFD
+
+//Maximal subparts are replaced as recommended in chapter 3 of the standard
+static void known_inputs(void) {
+	EXPECT("a", 1, 'a');
+	EXPECT("\xC3\xA9", 1, 0xE9);
+	EXPECT("\xE2\x82\xAC", 1, 0x20AC);
+	EXPECT("\xF0\x9F\x8E\xB5", 1, 0x1F3B5);
+	EXPECT("\xF4\x8F\xBF\xBF", 1, 0x10FFFF);
+	EXPECT("\x80", 0, R);
+	EXPECT("\xC0\xAF", 0, R, R);
+	EXPECT("\xC1\xBF", 0, R, R);
+	EXPECT("\xE0\x80\xAF", 0, R, R, R);
+	EXPECT("\xED\xA0\x80", 0, R, R, R);
+	EXPECT("\xF0\x80\x80\xAF", 0, R, R, R, R);
+	EXPECT("\xF4\x90\x80\x80", 0, R, R, R, R);
+	EXPECT("\xF5\x80", 0, R, R);
+	EXPECT("\xFF", 0, R);
+	EXPECT("\xE1\x80" "a", 0, R, 'a');
+	EXPECT("\xF0\x9F\x8E" "a", 0, R, 'a');
+	EXPECT("\xF0\x9F\x8E", 0, R);
+	EXPECT("a\xC3", 0, 'a', R);
+}
+
+//Small deterministic generator so failures can be reproduced
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t next_random(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+//Long ASCII runs broken up by well-formed and malformed sequences, so that
+//the vector paths hand over to the scalar decoder at every offset
+static uint32_t random_input(uint8_t* s) {
+	static const char* sequences[] = {
+		"\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x8E\xB5", "\xED\x9F\xBF",
+		"\x80", "\xC0\xAF", "\xED\xA0\x80", "\xF4\x90\x80\x80", "\xE1\x80",
+		"\xF0\x9F\x8E", "\xFF",
+	};
+	const uint32_t length = next_random() % MAX_LENGTH;
+	uint32_t i = 0;
+
+	while (i < length) {
+		const uint32_t kind = next_random() % 8;
+
+		if (kind < 5) {
+			uint32_t run = next_random() % 70;
+			while (run-- && i < length) s[i++] = 0x20 + next_random() % 0x5F;
+		}
+		else if (kind < 7) {
+			const char* seq = sequences[next_random() % (sizeof(sequences) / sizeof(sequences[0]))];
+			while (*seq && i < length) s[i++] = (uint8_t)*seq++;
+		}
+		else {
+			s[i++] = (uint8_t)next_random();
+		}
+	}
+
+	return length;
+}
+
+int main(void) {
+	uint8_t s[MAX_LENGTH];
+	uint32_t out[MAX_LENGTH];
+	uint8_t valid;
+
+	known_inputs();
+
+	//A single non-ASCII byte at every position of every length around the
+	//16 and 32 byte blocks
+	for (uint32_t length = 0; length <= 100; length++) {
+		memset(s, 'x', length);
+		check(s, length, out, &valid);
+
+		for (uint32_t at = 0; at < length; at++) {
+			memset(s, 'x', length);
+			s[at] = 0xC3;
+			check(s, length, out, &valid);
+		}
+	}
+
+	for (uint32_t n = 0; n < RANDOM_INPUTS; n++) {
+		const uint32_t length = random_input(s);
+		check(s, length, out, &valid);
+	}
+
+	if (failures) {
+		fprintf(stderr, "decode: %u failures\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("decode: all paths agree\n");
+	return EXIT_SUCCESS;
+}
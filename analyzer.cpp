@@ -0,0 +1,220 @@
+#include "analyzer.hpp"
+#include "event.hpp"
+#include "loudness.hpp"
+#include "player.hpp"
+#include <vlc/vlc.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <pthread.h>
+#include <sched.h>
+
+// Decode to float at the meter's rate and hand the samples to the callbacks
+// below without waiting for the clock
+#define ANALYZER_SOUT \
+	":sout=#transcode{acodec=fl32,channels=2,samplerate=48000}" \
+	":smem{audio-prerender-callback=%lld,audio-postrender-callback=%lld," \
+	"audio-data=%lld,time-sync=false}"
+
+struct Job {
+	LoudnessMeter meter;
+	std::vector<uint8_t> buffer;
+	size_t frames;
+	bool done;
+	bool ok;
+};
+
+static std::vector<std::thread> g_workers;
+static std::mutex g_mutex;
+static std::condition_variable g_cond;
+static std::deque<std::pair<AnalyzerJob, std::string>> g_jobs;
+static size_t g_idle = 0; // Workers waiting for a job
+static bool g_quit = false;
+static std::deque<AnalyzerResult> g_results;
+
+static void Finish(Job *job, bool ok)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	if (job->done)
+		return;
+	job->done = true;
+	job->ok = ok;
+	g_cond.notify_all();
+}
+
+// Smem asks for a buffer for each block of decoded audio and then passes it
+// back filled in
+static void Prerender(void *data, uint8_t **buffer, size_t size)
+{
+	Job *job = (Job *)data;
+	job->buffer.resize(size);
+	*buffer = job->buffer.data();
+}
+
+static void Postrender(void *data, uint8_t *buffer, unsigned channels,
+		unsigned rate, unsigned samples, unsigned bits, size_t, int64_t)
+{
+	Job *job = (Job *)data;
+	if (channels != LOUDNESS_CHANNELS || rate != LOUDNESS_RATE || bits != 32) {
+		Finish(job, false);
+		return;
+	}
+	job->meter.Add((const float *)buffer, samples);
+	job->frames += samples;
+}
+
+static void EndReached(const libvlc_event_t *, void *data)
+{
+	Finish((Job *)data, true);
+}
+
+static void EncounteredError(const libvlc_event_t *, void *data)
+{
+	Finish((Job *)data, false);
+}
+
+static bool Analyze(libvlc_media_player_t *player, const std::string &path,
+		AnalyzerResult &result)
+{
+	libvlc_media_t *media = libvlc_media_new_path(PlayerInstance(), path.c_str());
+	if (!media)
+		return false;
+
+	Job job;
+	job.frames = 0;
+	job.done = false;
+	job.ok = false;
+
+	char sout[512];
+	snprintf(sout, sizeof(sout), ANALYZER_SOUT,
+			(long long)(intptr_t)Prerender, (long long)(intptr_t)Postrender,
+			(long long)(intptr_t)&job);
+	libvlc_media_add_option(media, sout);
+	libvlc_media_add_option(media, ":no-sout-video");
+
+	libvlc_media_player_set_media(player, media);
+	libvlc_media_release(media);
+
+	libvlc_event_manager_t *em = libvlc_media_player_event_manager(player);
+	libvlc_event_attach(em, libvlc_MediaPlayerEndReached, EndReached, &job);
+	libvlc_event_attach(em, libvlc_MediaPlayerEncounteredError,
+			EncounteredError, &job);
+
+	if (libvlc_media_player_play(player) == 0) {
+		std::unique_lock<std::mutex> lock(g_mutex);
+		g_cond.wait(lock, [&job] { return job.done || g_quit; });
+	}
+
+	// Stopping joins the decoder, so the job is no longer touched after this
+	libvlc_media_player_stop(player);
+	libvlc_event_detach(em, libvlc_MediaPlayerEndReached, EndReached, &job);
+	libvlc_event_detach(em, libvlc_MediaPlayerEncounteredError,
+			EncounteredError, &job);
+
+	// A file that ends without any audio wasn't decoded properly
+	if (!job.done || !job.ok || !job.frames)
+		return false;
+
+	result.loudness = job.meter.Integrated();
+	result.peak = job.meter.Peak();
+	return true;
+}
+
+static void Work()
+{
+	// Libvlc's decoder threads inherit the policy, so the whole analysis only
+	// uses time nothing else wants
+	struct sched_param param = {};
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	libvlc_media_player_t *player = libvlc_media_player_new(PlayerInstance());
+	if (!player)
+		return;
+
+	while (1) {
+		AnalyzerResult result;
+
+		{
+			// Workers stay around once the queue is empty, since the
+			// library can grow at any time
+			std::unique_lock<std::mutex> lock(g_mutex);
+			g_idle++;
+			g_cond.wait(lock, [] { return g_jobs.size() || g_quit; });
+			g_idle--;
+			if (g_quit)
+				break;
+			result.job = g_jobs.front().first;
+			result.path = std::move(g_jobs.front().second);
+			g_jobs.pop_front();
+		}
+
+		if (result.job == AnalyzerJob::SeekIndex) {
+			result.ok = BuildSeekIndex(result.path, result.points, result.size);
+		} else {
+			result.ok = Analyze(player, result.path, result);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(g_mutex);
+			if (g_quit)
+				break;
+			g_results.push_back(result);
+		}
+
+		EventWake();
+	}
+
+	libvlc_media_player_release(player);
+}
+
+void AnalyzerGlobalInit(const std::vector<std::string> &loudness,
+		const std::vector<std::string> &seek_index)
+{
+	g_jobs.clear();
+	g_quit = false;
+
+	for (const std::string &path : seek_index)
+		AnalyzerAdd(AnalyzerJob::SeekIndex, path);
+	for (const std::string &path : loudness)
+		AnalyzerAdd(AnalyzerJob::Loudness, path);
+}
+
+void AnalyzerGlobalDestroy()
+{
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+		g_quit = true;
+		g_cond.notify_all();
+	}
+
+	for (std::thread &t : g_workers)
+		t.join();
+	g_workers.clear();
+}
+
+// Workers are started as jobs arrive that no idle one can take, up to one per
+// core, so a library with nothing to analyse costs no threads
+void AnalyzerAdd(AnalyzerJob job, const std::string &path)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	g_jobs.emplace_back(job, path);
+	if (g_jobs.size() > g_idle && g_workers.size() <
+			std::max(std::thread::hardware_concurrency(), 1u))
+		g_workers.emplace_back(Work);
+	g_cond.notify_all();
+}
+
+bool AnalyzerPoll(std::vector<AnalyzerResult> &results)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	results.clear();
+	for (AnalyzerResult &result : g_results)
+		results.push_back(std::move(result));
+	g_results.clear();
+	return results.size();
+}
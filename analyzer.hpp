@@ -0,0 +1,37 @@
+#pragma once
+
+#include "seekindex.hpp"
+#include <string>
+#include <vector>
+
+// Loudness analysis runs in the background on a pool of idle priority
+// threads, one per core. Each decodes files with its own libvlc player as fast
+// as it can and measures them; results are picked up by the UI thread, which
+// is woken with EventWake() when one is ready. The same threads build seek
+// indexes, which only read the files and so go first. Files that turn up
+// later are queued behind whatever is left.
+
+enum class AnalyzerJob {
+	Loudness,
+	SeekIndex,
+};
+
+struct AnalyzerResult {
+	AnalyzerJob job;
+	std::string path;
+	bool ok;
+	double loudness; // LUFS
+	double peak; // Linear
+	uint64_t size; // Seek index audio size in bytes
+	std::vector<SeekPoint> points;
+};
+
+void AnalyzerGlobalInit(const std::vector<std::string> &loudness,
+		const std::vector<std::string> &seek_index);
+void AnalyzerGlobalDestroy();
+
+// Queue a file that was added or has changed since the analyzer started
+void AnalyzerAdd(AnalyzerJob job, const std::string &path);
+
+// Take every finished file, returning false if there are none
+bool AnalyzerPoll(std::vector<AnalyzerResult> &results);
@@ -0,0 +1,248 @@
+#include "cli.hpp"
+#include "config.hpp"
+#include "control.hpp"
+#include "library.hpp"
+#include "player.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock Clock;
+
+struct Command {
+	const char *name;
+	int (*run)(Config &cfg, const std::vector<std::string> &args, bool json);
+	const char *usage;
+};
+
+static void WriteJsonString(const std::string &s)
+{
+	putchar('"');
+	for (const unsigned char ch : s) {
+		if (ch == '"' || ch == '\\')
+			printf("\\%c", ch);
+		else if (ch < 0x20)
+			printf("\\u%04x", ch);
+		else
+			putchar(ch);
+	}
+	putchar('"');
+}
+
+static void WriteJsonNumber(double n)
+{
+	if (std::isnan(n))
+		fputs("null", stdout);
+	else
+		printf("%.2f", n);
+}
+
+// Paths are stored relative to the library directory
+static std::string FullPath(const std::string &dir, const std::string &path)
+{
+	return path.compare(0, 2, "./") ? path : dir + path.substr(1);
+}
+
+static int Scan(Config &cfg, const std::vector<std::string> &args, bool json)
+{
+	const bool full = args.size() == 1 && args[0] == "--full";
+	if (args.size() && !full)
+		return -1;
+
+	const std::string &dir = cfg.Get("directory");
+	if (chdir(dir.c_str())) {
+		fprintf(stderr, "Can't enter library directory \"%s\"\n", dir.c_str());
+		return 1;
+	}
+
+	const Clock::time_point start = Clock::now();
+
+	PlayerGlobalInit();
+	Library library;
+	library.Open(cfg.Get("database"));
+	library.Scan(full);
+	PlayerGlobalDestroy();
+
+	if (!library.Complete())
+		fprintf(stderr, "Library scan couldn't read every directory\n");
+
+	const LibraryStats stats = library.Stats();
+	const double secs = std::chrono::duration<double>(
+			Clock::now() - start).count();
+	if (json) {
+		printf("{\"songs\":%u,\"failed\":%u,\"seconds\":%.3f,"
+				"\"complete\":%s}\n", stats.songs, stats.failed, secs,
+				library.Complete() ? "true" : "false");
+	} else {
+		printf("Scanned %u songs in %.1f seconds, %u files unreadable\n",
+				stats.songs, secs, stats.failed);
+	}
+
+	// Songs under an unreadable directory were kept as they were, so a
+	// script shouldn't take the library as up to date
+	return library.Complete() ? 0 : 2;
+}
+
+// Rows are written as they are read, so memory use doesn't grow with the
+// number of results. Output is flushed after the first row so a reader sees
+// something straight away even through a pipe.
+static int Search(Config &cfg, const std::vector<std::string> &args, bool json)
+{
+	if (args.size() != 1)
+		return -1;
+
+	// Searches without wildcards of their own match anywhere in the title
+	std::string pattern = args[0];
+	if (pattern.find_first_of("%_") == std::string::npos)
+		pattern = "%" + pattern + "%";
+
+	char cwd[4096];
+	const std::string &dir = cfg.Get("directory");
+	const std::string base = !chdir(dir.c_str()) && getcwd(cwd, sizeof(cwd)) ?
+		cwd : dir;
+
+	Library library;
+	library.Open(cfg.Get("database"));
+	SongCursor cursor = library.Search(pattern);
+
+	Song s;
+	size_t n = 0;
+	while (cursor.Next(s)) {
+		const std::string path = FullPath(base, s.path);
+
+		if (json) {
+			printf("{\"id\":%u,\"title\":", s.id);
+			WriteJsonString(s.title);
+			fputs(",\"artist\":", stdout);
+			WriteJsonString(s.artist);
+			fputs(",\"album\":", stdout);
+			WriteJsonString(s.album);
+			printf(",\"track\":%u,\"length\":%u,\"loudness\":", s.track,
+					s.length);
+			WriteJsonNumber(s.loudness);
+			fputs(",\"path\":", stdout);
+			WriteJsonString(path);
+			fputs("}\n", stdout);
+		} else {
+			printf("%u\t%s\t%s\t%s\t%u\t%u\t%s\n", s.id, s.title.c_str(),
+					s.artist.c_str(), s.album.c_str(), s.track, s.length,
+					path.c_str());
+		}
+
+		if (++n == 1)
+			fflush(stdout);
+	}
+
+	return 0;
+}
+
+static int Stats(Config &cfg, const std::vector<std::string> &args, bool json)
+{
+	if (args.size())
+		return -1;
+
+	Library library;
+	library.Open(cfg.Get("database"));
+	const LibraryStats stats = library.Stats();
+
+	if (json) {
+		printf("{\"songs\":%u,\"artists\":%u,\"albums\":%u,\"length\":%lu,"
+				"\"analyzed\":%u,\"indexed\":%u,\"failed\":%u}\n",
+				stats.songs, stats.artists, stats.albums,
+				(unsigned long)stats.length, stats.analyzed, stats.indexed,
+				stats.failed);
+	} else {
+		printf("Songs:    %u\n", stats.songs);
+		printf("Artists:  %u\n", stats.artists);
+		printf("Albums:   %u\n", stats.albums);
+		printf("Length:   %lu:%02lu:%02lu\n",
+				(unsigned long)stats.length / 3600,
+				(unsigned long)stats.length / 60 % 60,
+				(unsigned long)stats.length % 60);
+		printf("Analyzed: %u\n", stats.analyzed);
+		printf("Indexed:  %u\n", stats.indexed);
+		printf("Failed:   %u\n", stats.failed);
+	}
+
+	return 0;
+}
+
+static int Play(Config &cfg, const std::vector<std::string> &args, bool json)
+{
+	if (args.size() != 1)
+		return -1;
+
+	std::vector<std::string> replies;
+	if (!ControlRequest(cfg.Get("socket"), { "play " + args[0] }, replies)) {
+		fprintf(stderr, "Juke isn't running; start it with \"juke --daemon\"\n");
+		return 1;
+	}
+
+	if (replies.empty() || replies[0].compare(0, 2, "ok")) {
+		fprintf(stderr, "Couldn't play %s: %s\n", args[0].c_str(),
+				replies.size() && replies[0].size() > 4 ?
+				replies[0].c_str() + 4 : "No reply");
+		return 1;
+	}
+
+	return 0;
+}
+
+static const Command g_commands[] = {
+	{ "scan", Scan, "scan [--full] [--json]" },
+	{ "search", Search, "search <query> [--json]" },
+	{ "stats", Stats, "stats [--json]" },
+	{ "play", Play, "play <id>" },
+};
+
+static const Command *FindCommand(const char *name)
+{
+	for (const Command &c : g_commands) {
+		if (!strcmp(c.name, name))
+			return &c;
+	}
+	return nullptr;
+}
+
+bool IsCommand(const char *name)
+{
+	return FindCommand(name);
+}
+
+void PrintUsage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [--daemon]\n", argv0);
+	for (const Command &c : g_commands)
+		fprintf(stderr, "       %s %s\n", argv0, c.usage);
+}
+
+int RunCommand(int argc, char **argv)
+{
+	const Command *command = FindCommand(argv[1]);
+	std::vector<std::string> args;
+	bool json = false;
+
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "--json"))
+			json = true;
+		else
+			args.push_back(argv[i]);
+	}
+
+	try {
+		Config cfg;
+		const int status = command->run(cfg, args, json);
+		if (status >= 0)
+			return status;
+	} catch (const char *const s) {
+		fprintf(stderr, "Juke: %s\n", s);
+		return 1;
+	}
+
+	fprintf(stderr, "Usage: %s %s\n", argv[0], command->usage);
+	return 1;
+}
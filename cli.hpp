@@ -0,0 +1,14 @@
+#pragma once
+
+// Subcommands for scripting, run instead of the interactive player when the
+// first argument names one. They work on the library database directly, and
+// only scanning starts libvlc. Commands that control playback go through the
+// control socket of a running juke.
+
+// Whether name is a subcommand
+bool IsCommand(const char *name);
+
+void PrintUsage(const char *argv0);
+
+// Run the subcommand in argv[1], returning the exit status
+int RunCommand(int argc, char **argv);
@@ -1,5 +1,6 @@
 #include "config.hpp"
 #include "INIReader.h"
+#include <cstdlib>
 #include <unistd.h>
 #include <sys/types.h>
 #include <pwd.h>
@@ -15,5 +16,19 @@ Config::Config()
 		INIReader reader(home + CONFIG_FILE);
 
 		m_map["directory"] = reader.Get("juke", "directory", "~/Music");
+		m_map["fps"] = reader.Get("juke", "fps", "60");
+		m_map["frame_log"] = reader.Get("juke", "frame_log", "");
+		m_map["latency_log"] = reader.Get("juke", "latency_log", "");
+		m_map["crossfade"] = reader.Get("juke", "crossfade", "0");
+		m_map["wav_output"] = reader.Get("juke", "wav_output", "");
+		m_map["database"] = reader.Get("juke", "database", home + "/.juke.db");
+		m_map["replaygain"] = reader.Get("juke", "replaygain", "track");
+		m_map["queue"] = reader.Get("juke", "queue", home + "/.juke.queue");
+		m_map["seek_index"] = reader.Get("juke", "seek_index", "on");
+		m_map["watch"] = reader.Get("juke", "watch", "on");
+
+		const char *const runtime = getenv("XDG_RUNTIME_DIR");
+		m_map["socket"] = reader.Get("juke", "socket", runtime && *runtime ?
+				std::string(runtime) + "/juke.sock" : home + "/.juke.sock");
 	} catch (...) {}
 }
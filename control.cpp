@@ -0,0 +1,352 @@
+#include "control.hpp"
+#include "event.hpp"
+#include <cerrno>
+#include <cstring>
+#include <unordered_map>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define MAX_EVENTS 16
+#define READ_SIZE 65536
+#define MAX_REQUEST 4096 // Longer lines close the connection
+// Requests are left unread while a client has this much it hasn't read back
+#define MAX_PENDING_REPLIES (1 << 20)
+
+struct Client {
+	std::string in;
+	std::string out;
+	uint32_t events;
+	bool eof;
+};
+
+static int g_listen = -1;
+static int g_epoll = -1; // Clients and the listener, watched by the event loop
+static std::string g_path;
+static ControlHandler g_handler = nullptr;
+static std::unordered_map<int, Client> g_clients;
+
+static void Watch(int fd, Client &c, uint32_t events)
+{
+	if (c.events == events)
+		return;
+
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(g_epoll, EPOLL_CTL_MOD, fd, &ev))
+		throw "Couldn't watch control client";
+	c.events = events;
+}
+
+static void Close(int fd)
+{
+	epoll_ctl(g_epoll, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	g_clients.erase(fd);
+}
+
+static void Accept()
+{
+	while (1) {
+		// Failures other than running out of clients are retried when the
+		// listener is next reported
+		const int fd = accept4(g_listen, nullptr, nullptr,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+
+		if (epoll_ctl(g_epoll, EPOLL_CTL_ADD, fd, &ev)) {
+			close(fd);
+			continue;
+		}
+
+		g_clients[fd] = Client{ "", "", EPOLLIN, false };
+	}
+}
+
+// Run the complete requests that have arrived and queue their replies,
+// returning how many were run
+static size_t Answer(Client &c)
+{
+	size_t start = 0;
+	size_t end;
+	size_t n = 0;
+
+	while (c.out.size() < MAX_PENDING_REPLIES &&
+			(end = c.in.find('\n', start)) != std::string::npos) {
+		std::string line = c.in.substr(start, end - start);
+		start = end + 1;
+
+		if (line.size() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty())
+			continue;
+
+		const size_t space = line.find(' ');
+		const std::string verb = line.substr(0, space);
+		const std::string arg = space == std::string::npos ?
+			"" : line.substr(space + 1);
+
+		std::string reply;
+		const bool ok = g_handler(verb, arg, reply);
+		for (char &ch : reply) {
+			if (ch == '\n')
+				ch = ' ';
+		}
+
+		c.out += ok ? "ok" : "err";
+		if (reply.size()) {
+			c.out += ' ';
+			c.out += reply;
+		}
+		c.out += '\n';
+		n++;
+	}
+
+	c.in.erase(0, start);
+	return n;
+}
+
+// Send as much of the queued replies as the socket takes, returning false if
+// the connection has failed
+static bool Flush(int fd, Client &c)
+{
+	size_t done = 0;
+
+	while (done < c.out.size()) {
+		const ssize_t n = send(fd, c.out.data() + done, c.out.size() - done,
+				MSG_NOSIGNAL);
+		if (n >= 0)
+			done += n;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+		else if (errno != EINTR)
+			return false;
+	}
+
+	c.out.erase(0, done);
+	return true;
+}
+
+// Read, answer and reply until the socket runs dry or the client falls
+// behind, returning false once the connection should be closed. A client that
+// shuts down its side still gets the replies to everything it sent.
+static bool Service(int fd, Client &c, size_t &handled)
+{
+	char buf[READ_SIZE];
+
+	while (1) {
+		handled += Answer(c);
+		if (!Flush(fd, c))
+			return false;
+
+		if (c.out.size()) {
+			Watch(fd, c, EPOLLOUT);
+			return true;
+		}
+
+		if (c.in.find('\n') != std::string::npos)
+			continue;
+		if (c.eof || c.in.size() > MAX_REQUEST)
+			return false;
+
+		const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n > 0) {
+			c.in.append(buf, n);
+		} else if (n == 0) {
+			c.eof = true;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			Watch(fd, c, EPOLLIN);
+			return true;
+		} else if (errno != EINTR) {
+			return false;
+		}
+	}
+}
+
+static struct sockaddr_un Address(const std::string &path)
+{
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw "Control socket path is too long";
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	return addr;
+}
+
+// Whether something is accepting connections on the socket at addr
+static bool IsListening(const struct sockaddr_un &addr)
+{
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	const bool listening = !connect(fd, (const struct sockaddr *)&addr,
+			sizeof(addr));
+	close(fd);
+	return listening;
+}
+
+bool ControlGlobalInit(const std::string &path, ControlHandler handler)
+{
+	const struct sockaddr_un addr = Address(path);
+
+	if ((g_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+					0)) < 0)
+		throw "Couldn't create control socket";
+
+	// Only the owner may connect
+	const mode_t mask = umask(0077);
+	int r = bind(g_listen, (const struct sockaddr *)&addr, sizeof(addr));
+	if (r && errno == EADDRINUSE) {
+		if (IsListening(addr)) {
+			umask(mask);
+			close(g_listen);
+			g_listen = -1;
+			return false;
+		}
+		unlink(path.c_str());
+		r = bind(g_listen, (const struct sockaddr *)&addr, sizeof(addr));
+	}
+	umask(mask);
+
+	if (r || listen(g_listen, SOMAXCONN))
+		throw "Couldn't listen on control socket";
+
+	if ((g_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		throw "Couldn't create control event set";
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = g_listen;
+	if (epoll_ctl(g_epoll, EPOLL_CTL_ADD, g_listen, &ev))
+		throw "Couldn't watch control socket";
+
+	g_path = path;
+	g_handler = handler;
+	EventWatchControl(g_epoll);
+
+	return true;
+}
+
+void ControlGlobalDestroy()
+{
+	if (g_listen < 0)
+		return;
+
+	for (auto &it : g_clients)
+		close(it.first);
+	g_clients.clear();
+
+	close(g_epoll);
+	close(g_listen);
+	unlink(g_path.c_str());
+	g_epoll = g_listen = -1;
+}
+
+bool ControlRequest(const std::string &path,
+		const std::vector<std::string> &requests,
+		std::vector<std::string> &replies)
+{
+	const struct sockaddr_un addr = Address(path);
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw "Couldn't create control socket";
+
+	if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return false;
+	}
+
+	std::string out;
+	for (const std::string &r : requests)
+		out += r + '\n';
+
+	// Replies are read while the batch is still being written: the server
+	// stops reading requests once enough replies are waiting, so a large
+	// batch would otherwise fill both directions and stall. Shutting down our
+	// side tells the server there is nothing more to answer once it has
+	// replied to the batch.
+	std::string in;
+	char buf[READ_SIZE];
+	size_t done = 0;
+	bool open = true;
+
+	if (out.empty())
+		shutdown(fd, SHUT_WR);
+
+	while (open) {
+		struct pollfd pfd = { fd, (short)(POLLIN |
+				(done < out.size() ? POLLOUT : 0)), 0 };
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			throw "Couldn't wait for control socket";
+		}
+
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			const ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (n > 0)
+				in.append(buf, n);
+			else if (!n || (errno != EINTR && errno != EAGAIN))
+				open = false;
+		}
+
+		if (open && done < out.size() && (pfd.revents & POLLOUT)) {
+			const ssize_t n = send(fd, out.data() + done, out.size() - done,
+					MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (n < 0 && errno != EINTR && errno != EAGAIN) {
+				close(fd);
+				throw "Couldn't send control requests";
+			}
+			done += n > 0 ? n : 0;
+			if (done == out.size())
+				shutdown(fd, SHUT_WR);
+		}
+	}
+	close(fd);
+
+	size_t start = 0;
+	size_t end;
+	while ((end = in.find('\n', start)) != std::string::npos) {
+		replies.push_back(in.substr(start, end - start));
+		start = end + 1;
+	}
+
+	return true;
+}
+
+bool ControlPoll()
+{
+	struct epoll_event evs[MAX_EVENTS];
+	size_t handled = 0;
+	int n;
+
+	do {
+		n = epoll_wait(g_epoll, evs, MAX_EVENTS, 0);
+
+		for (int i = 0; i < n; i++) {
+			const int fd = evs[i].data.fd;
+			if (fd == g_listen) {
+				Accept();
+				continue;
+			}
+
+			auto it = g_clients.find(fd);
+			if (it != g_clients.end() && !Service(fd, it->second, handled))
+				Close(fd);
+		}
+	} while (n == MAX_EVENTS);
+
+	return handled;
+}
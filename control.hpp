@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Local control of a running juke over a Unix socket. A request is a line of
+// text, "verb [argument]", and each one gets exactly one reply line, "ok
+// [result]" or "err message", in the order the requests arrived. Blank lines
+// are ignored. Clients can send any number of requests without waiting for
+// replies, so a batch costs one write and one read. The socket is served from
+// the main event loop, which reports it as EVENT_CONTROL.
+
+// Run one request, setting reply to its result or to an error message.
+// Returns false on error.
+typedef bool (*ControlHandler)(const std::string &verb, const std::string &arg,
+		std::string &reply);
+
+// Listen on the socket at path. Returns false if another process is already
+// listening there; a socket left behind by one that died is replaced.
+bool ControlGlobalInit(const std::string &path, ControlHandler handler);
+void ControlGlobalDestroy();
+
+// Accept new clients and answer every complete request that has arrived,
+// returning true if there were any
+bool ControlPoll();
+
+// Send a batch of requests to the process listening at path and wait for the
+// reply lines. Returns false if nothing is listening there.
+bool ControlRequest(const std::string &path,
+		const std::vector<std::string> &requests,
+		std::vector<std::string> &replies);
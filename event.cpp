@@ -0,0 +1,117 @@
+#include "event.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#define MAX_EVENTS 8
+
+static int g_epoll = -1;
+static int g_wake = -1;
+static int g_tick = -1;
+static unsigned g_tick_ms = 0;
+
+static void Watch(int fd, unsigned tag)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u32 = tag;
+
+	if (epoll_ctl(g_epoll, EPOLL_CTL_ADD, fd, &ev))
+		throw "Couldn't add file descriptor to event loop";
+}
+
+static void Drain(int fd)
+{
+	uint64_t n;
+	while (read(fd, &n, sizeof(n)) > 0)
+		;
+}
+
+void EventGlobalInit()
+{
+	if ((g_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		throw "Couldn't create event loop";
+
+	if ((g_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		throw "Couldn't create wake event";
+
+	if ((g_tick = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		throw "Couldn't create tick timer";
+
+	Watch(g_wake, EVENT_WAKE);
+	Watch(g_tick, EVENT_TICK);
+}
+
+void EventGlobalDestroy()
+{
+	close(g_tick);
+	close(g_wake);
+	close(g_epoll);
+	g_tick = g_wake = g_epoll = -1;
+}
+
+void EventWatchInput(int fd)
+{
+	Watch(fd, EVENT_INPUT);
+}
+
+void EventWatchControl(int fd)
+{
+	Watch(fd, EVENT_CONTROL);
+}
+
+void EventWatchLibrary(int fd)
+{
+	Watch(fd, EVENT_LIBRARY);
+}
+
+void EventWake()
+{
+	const uint64_t one = 1;
+	if (write(g_wake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		throw "Couldn't signal wake event";
+}
+
+void EventSetTick(unsigned ms)
+{
+	if (ms == g_tick_ms)
+		return;
+
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = ms / 1000;
+	spec.it_interval.tv_nsec = (ms % 1000) * 1000000;
+	spec.it_value = spec.it_interval;
+
+	if (timerfd_settime(g_tick, 0, &spec, nullptr))
+		throw "Couldn't set tick timer";
+
+	g_tick_ms = ms;
+}
+
+unsigned EventWait(int timeout)
+{
+	struct epoll_event evs[MAX_EVENTS];
+	int n;
+
+	do {
+		n = epoll_wait(g_epoll, evs, MAX_EVENTS, timeout);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		throw "Couldn't wait for events";
+
+	unsigned mask = 0;
+	for (int i = 0; i < n; i++) {
+		mask |= evs[i].data.u32;
+		if (evs[i].data.u32 == EVENT_WAKE)
+			Drain(g_wake);
+		else if (evs[i].data.u32 == EVENT_TICK)
+			Drain(g_tick);
+	}
+
+	return mask;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+// Bits returned by EventWait()
+#define EVENT_INPUT 0x1 // Terminal input or resize pending
+#define EVENT_WAKE  0x2 // EventWake() was called
+#define EVENT_TICK  0x4 // The tick timer expired
+#define EVENT_CONTROL 0x8 // The control socket has something to handle
+#define EVENT_LIBRARY 0x10 // The library watcher has something to handle
+
+void EventGlobalInit();
+void EventGlobalDestroy();
+
+// Add a file descriptor that reports EVENT_INPUT when it becomes readable
+void EventWatchInput(int fd);
+
+// Add a file descriptor that reports EVENT_CONTROL when it becomes readable
+void EventWatchControl(int fd);
+
+// Add a file descriptor that reports EVENT_LIBRARY when it becomes readable
+void EventWatchLibrary(int fd);
+
+// Wake up EventWait(); safe to call from any thread
+void EventWake();
+
+// Arm the tick timer to fire every `ms` milliseconds, or disarm it if 0
+void EventSetTick(unsigned ms);
+
+// Block for up to `timeout` milliseconds (forever if negative) and return a
+// mask of the EVENT_* bits that fired
+unsigned EventWait(int timeout);
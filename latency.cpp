@@ -0,0 +1,192 @@
+#include "latency.hpp"
+#include "event.hpp"
+#include "stats.hpp"
+#include "util.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <sys/stat.h>
+
+#define SUMMARY_GROUPS 4
+
+typedef std::chrono::steady_clock Clock;
+
+struct LatencyGroup {
+	Histogram stages[PLAY_STAGES];
+};
+
+static const char *const g_stage_names[PLAY_STAGES] = {
+	"key", "open", "opened", "parsed", "play", "playing", "audio",
+};
+
+// Stamps of the current trace in microseconds since the clock's epoch, or 0
+// for stages that haven't been reached
+static std::atomic<uint64_t> g_marks[PLAY_STAGES];
+static std::atomic<bool> g_armed(false);
+static PlayStage g_final = PlayStage::Playing;
+static std::string g_path;
+
+static std::map<std::string, LatencyGroup> g_groups;
+static std::unordered_map<dev_t, std::string> g_mounts;
+static std::string g_last_group;
+static int64_t g_last[PLAY_STAGES];
+static FILE *g_log = nullptr;
+
+static uint64_t Now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			Clock::now().time_since_epoch()).count();
+}
+
+void LatencyOpenLog(const std::string &path)
+{
+	if (!(g_log = fopen(path.c_str(), "a")))
+		throw "Couldn't open latency log";
+	setvbuf(g_log, nullptr, _IOLBF, 0);
+}
+
+void LatencyBegin(const std::string &path, bool audio)
+{
+	g_armed.store(false);
+
+	for (std::atomic<uint64_t> &m : g_marks)
+		m.store(0, std::memory_order_relaxed);
+
+	g_path = path;
+	g_final = audio ? PlayStage::FirstAudio : PlayStage::Playing;
+	g_marks[(int)PlayStage::Key].store(Now(), std::memory_order_relaxed);
+
+	g_armed.store(true, std::memory_order_release);
+}
+
+void LatencyCancel()
+{
+	g_armed.store(false);
+}
+
+void LatencyMark(PlayStage stage)
+{
+	if (!g_armed.load(std::memory_order_acquire))
+		return;
+
+	// Callbacks from the track that was playing before can still arrive, so
+	// libvlc's reports only count once this track has been started
+	if (stage > PlayStage::PlayIssued &&
+			!g_marks[(int)PlayStage::PlayIssued].load(std::memory_order_relaxed))
+		return;
+
+	uint64_t expected = 0;
+	if (g_marks[(int)stage].compare_exchange_strong(expected, Now()) &&
+			stage == g_final)
+		EventWake();
+}
+
+// The directory the file system holding path is mounted on, found by walking
+// up until the device changes
+static const std::string &MountPoint(const std::string &path)
+{
+	static const std::string unknown("?");
+
+	const fs::path abs = fs::absolute(path);
+	struct stat st;
+	if (stat(abs.c_str(), &st))
+		return unknown;
+
+	auto it = g_mounts.find(st.st_dev);
+	if (it != g_mounts.end())
+		return it->second;
+
+	fs::path mount = abs.parent_path();
+	while (mount != mount.root_path()) {
+		struct stat parent;
+		if (stat(mount.parent_path().c_str(), &parent) ||
+				parent.st_dev != st.st_dev)
+			break;
+		mount = mount.parent_path();
+	}
+
+	return g_mounts[st.st_dev] = mount.string();
+}
+
+static std::string Format(const std::string &path)
+{
+	std::string ext = fs::path(path).extension().string();
+	if (ext.size())
+		ext.erase(0, 1);
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	return ext.size() ? ext : "?";
+}
+
+bool LatencyCollect()
+{
+	if (!g_armed.load(std::memory_order_acquire) ||
+			!g_marks[(int)g_final].load(std::memory_order_acquire))
+		return false;
+
+	g_armed.store(false);
+
+	const std::string group = Format(g_path) + " " + MountPoint(g_path);
+	LatencyGroup &g = g_groups[group];
+	const uint64_t key = g_marks[(int)PlayStage::Key];
+
+	for (int i = 0; i < PLAY_STAGES; i++) {
+		const uint64_t m = g_marks[i];
+		g_last[i] = m ? m - key : -1;
+		if (m)
+			g.stages[i].Add(m - key);
+	}
+
+	g_last_group = group;
+
+	if (g_log) {
+		fprintf(g_log, "format=%s location=%s", Format(g_path).c_str(),
+				MountPoint(g_path).c_str());
+		for (int i = 1; i < PLAY_STAGES; i++)
+			fprintf(g_log, " %s_us=%ld", g_stage_names[i], (long)g_last[i]);
+		fprintf(g_log, "\n");
+	}
+
+	return true;
+}
+
+static std::string Ms(int64_t us)
+{
+	char buf[16];
+	if (us < 0)
+		return "-";
+	snprintf(buf, sizeof(buf), "%.1f", us / 1000.0);
+	return buf;
+}
+
+void LatencySummary(std::vector<std::string> &out)
+{
+	if (g_groups.empty())
+		return;
+
+	const int final = g_last[(int)PlayStage::FirstAudio] >= 0 ?
+		(int)PlayStage::FirstAudio : (int)PlayStage::Playing;
+
+	out.push_back("Start    " + Ms(g_last[final]) + " ms  " + g_last_group);
+	out.push_back("  open " + Ms(g_last[(int)PlayStage::OpenStart]) +
+			"  opened " + Ms(g_last[(int)PlayStage::OpenEnd]) +
+			"  parsed " + Ms(g_last[(int)PlayStage::Parsed]));
+	out.push_back("  play " + Ms(g_last[(int)PlayStage::PlayIssued]) +
+			"  playing " + Ms(g_last[(int)PlayStage::Playing]) +
+			"  audio " + Ms(g_last[(int)PlayStage::FirstAudio]));
+
+	size_t n = 0;
+	for (const auto &it : g_groups) {
+		if (n++ == SUMMARY_GROUPS)
+			break;
+
+		const Histogram &h = it.second.stages[final];
+		char buf[96];
+		snprintf(buf, sizeof(buf), "  %lux p50 %s p99 %s  ",
+				(unsigned long)h.Count(), Ms(h.Percentile(50)).c_str(),
+				Ms(h.Percentile(99)).c_str());
+		out.push_back(buf + it.first);
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Time from pressing play to hearing the track, split into the stages it goes
+// through. A trace starts at the key press and every stage is stamped the first
+// time it is reached, from whichever thread reaches it. Finished traces are
+// grouped by file format and the mount point the file is on.
+
+enum class PlayStage {
+	Key, // Key event handled by the UI
+	OpenStart, // Player::Open called on the player thread
+	OpenEnd, // Media loaded into a deck
+	Parsed, // Libvlc finished parsing the media
+	PlayIssued, // libvlc_media_player_play called
+	Playing, // Libvlc reported the player as playing
+	FirstAudio, // First decoded buffer reached the mixer
+};
+
+#define PLAY_STAGES 7
+
+// Append a line per finished trace to the file at path
+void LatencyOpenLog(const std::string &path);
+
+// Start a trace. Without the mixer there is no way to see audio, so the trace
+// ends when libvlc reports that it is playing.
+void LatencyBegin(const std::string &path, bool audio);
+
+// Drop the current trace, as when the play it was started for never happened
+void LatencyCancel();
+
+// Stamp a stage of the current trace; safe to call from any thread and cheap
+// when there is no trace
+void LatencyMark(PlayStage stage);
+
+// Add the current trace to the statistics if it has finished, returning true
+// if it did. Only the UI thread may call this and LatencySummary().
+bool LatencyCollect();
+
+// Human readable summary, one line per entry
+void LatencySummary(std::vector<std::string> &out);
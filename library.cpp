@@ -1,81 +1,655 @@
 #include "library.hpp"
+#include "parser.hpp"
 #include "util.hpp"
+#include "walker.hpp"
+#include <chrono>
 #include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/stat.h>
+
+#define PARSE_IN_FLIGHT 8
+#define PARSE_TIMEOUT_MS 5000
+// Directories modified this recently aren't trusted to stay unchanged, as a
+// coarse clock may not move their mtime for a second change
+#define DIR_SETTLE_MS 2000
+// Long enough to wait out another process's short writes, short enough not
+// to stall the interface behind a scan's transaction
+#define DB_BUSY_TIMEOUT_MS 1000
+
+#define SONG_COLUMNS \
+	"path, title, artist, album, track, length, loudness, peak, album_loudness, " \
+	"album_peak, rowid"
 
 Library::Library()
+	: m_db(nullptr)
+	, m_generation(0)
+	, m_full(false)
+	, m_complete(true)
+	, m_index_generation(0)
+{}
+
+Library::~Library()
 {
-	if (sqlite3_open_v2(":memory:", &m_db,
+	sqlite3_close(m_db);
+}
+
+static sqlite3_stmt *Prepare(sqlite3 *db, const char *sql, const char *error)
+{
+	sqlite3_stmt *query;
+	if (sqlite3_prepare_v2(db, sql, -1, &query, nullptr))
+		throw error;
+	return query;
+}
+
+static void Step(sqlite3_stmt *query, const char *error)
+{
+	if (sqlite3_step(query) != SQLITE_DONE)
+		throw error;
+	if (sqlite3_reset(query) != SQLITE_OK)
+		throw error;
+}
+
+// The database is kept between runs so that loudness analysis is only done
+// once per file
+void Library::Open(const std::string &path)
+{
+	if (sqlite3_open_v2(path.c_str(), &m_db,
 			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
 		throw "Couldn't open database";
 
-	SimpleQuery("CREATE TABLE songs ("
+	// The interface and the command line share the database, and with a
+	// write-ahead log neither has to wait for the other to read
+	sqlite3_busy_timeout(m_db, DB_BUSY_TIMEOUT_MS);
+	SimpleQuery("PRAGMA journal_mode=WAL;");
+
+	// Ids count up and are never handed out again, so a song removed from
+	// the library can't come back as a different one under its old id
+	SimpleQuery("CREATE TABLE IF NOT EXISTS songs ("
+				"id INTEGER PRIMARY KEY AUTOINCREMENT, "
 				"path TEXT UNIQUE NOT NULL, "
 				"title TEXT, "
 				"artist TEXT, "
 				"album TEXT, "
 				"track INTEGER, "
-				"length INTEGER);");
+				"length INTEGER, "
+				"loudness REAL, "
+				"peak REAL, "
+				"album_loudness REAL, "
+				"album_peak REAL, "
+				"mtime INTEGER, "
+				"size INTEGER);");
+
+	// Lets sorted lists be read in order instead of sorted per query
+	SimpleQuery("CREATE INDEX IF NOT EXISTS songs_order ON songs "
+				"(artist, album, track, title);");
+
+	SimpleQuery("CREATE TABLE IF NOT EXISTS seek_index ("
+				"path TEXT PRIMARY KEY, "
+				"size INTEGER, "
+				"points BLOB);");
+
+	// Files that couldn't be read, which are skipped until they change
+	SimpleQuery("CREATE TABLE IF NOT EXISTS scan_failures ("
+				"path TEXT PRIMARY KEY, "
+				"reason TEXT, "
+				"mtime INTEGER, "
+				"size INTEGER);");
+
+	// Directories as the last scan saw them, which later ones skip if their
+	// mtime hasn't moved. A null mtime is never trusted.
+	SimpleQuery("CREATE TABLE IF NOT EXISTS dirs ("
+				"path TEXT PRIMARY KEY, "
+				"parent TEXT NOT NULL, "
+				"mtime INTEGER);");
+	SimpleQuery("CREATE INDEX IF NOT EXISTS dirs_parent ON dirs (parent);");
+
+	SimpleQuery("CREATE TABLE IF NOT EXISTS state ("
+				"key TEXT PRIMARY KEY, "
+				"value INTEGER);");
 }
 
-Library::~Library()
+static void ReadSong(sqlite3_stmt *query, Song &s)
 {
-	sqlite3_close(m_db);
+	s.path = (const char *)sqlite3_column_text(query, 0);
+	s.title = (const char *)sqlite3_column_text(query, 1);
+	s.artist = (const char *)sqlite3_column_text(query, 2);
+	s.album = (const char *)sqlite3_column_text(query, 3);
+	s.track = sqlite3_column_int(query, 4);
+	s.length = sqlite3_column_int(query, 5);
+
+	const int t = SQLITE_NULL;
+	s.loudness = sqlite3_column_type(query, 6) == t ? NAN :
+		sqlite3_column_double(query, 6);
+	s.peak = sqlite3_column_type(query, 7) == t ? NAN :
+		sqlite3_column_double(query, 7);
+	s.album_loudness = sqlite3_column_type(query, 8) == t ? NAN :
+		sqlite3_column_double(query, 8);
+	s.album_peak = sqlite3_column_type(query, 9) == t ? NAN :
+		sqlite3_column_double(query, 9);
+	s.id = sqlite3_column_int(query, 10);
 }
 
 Library::Library(Library &&l)
 {
 	m_db = l.m_db;
+	m_generation = l.m_generation;
+	m_full = l.m_full;
+	m_complete = l.m_complete;
+	m_index_generation = m_generation - 1;
 	l.m_db = nullptr;
 }
 
-void Library::Scan()
-{
+struct ScanQueries {
 	sqlite3_stmt *inserter;
-	if (sqlite3_prepare_v2(m_db,
-				"INSERT INTO songs (path, title, artist, album, track, length) "
-				"VALUES (?, ?, ?, ?, ?, ?);", 4096, &inserter, nullptr))
-		throw "Couldn't create song inserter query";
+	sqlite3_stmt *remover;
+	sqlite3_stmt *failer;
+	sqlite3_stmt *unfailer;
+	sqlite3_stmt *unindexer;
+	std::vector<std::string> *changed; // Songs added, changed or removed
+	std::vector<std::string> *stored; // Songs added or changed
+};
 
-	for(const auto &p : fs::recursive_directory_iterator(".")) {
-		const fs::path path = p.path();
-		if (!IsAudioPath(path))
-			continue;
+// A row of songs or scan_failures, as read by a scan
+struct KnownFile {
+	std::string path;
+	int64_t mtime;
+	int64_t size;
+	bool valid; // False past the last row
+};
+
+static void BindPath(sqlite3_stmt *query, const std::string &path)
+{
+	if (sqlite3_bind_text(query, 1, path.c_str(), path.size(),
+				SQLITE_TRANSIENT) != SQLITE_OK)
+		throw "Cannot bind path query data";
+}
+
+static void StatFile(const std::string &path, int64_t &mtime, int64_t &size)
+{
+	struct stat st;
+	const bool stated = !stat(path.c_str(), &st);
+	mtime = stated ? st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec : -1;
+	size = stated ? st.st_size : -1;
+}
+
+// Read the next row that is root or lies under it. The query's range also
+// takes in paths that merely start with root, such as "a b" for "a".
+static void ReadKnown(sqlite3_stmt *query, const std::string &root,
+		KnownFile &k)
+{
+	while (1) {
+		const int r = sqlite3_step(query);
+		if (r != SQLITE_ROW && r != SQLITE_DONE)
+			throw "Couldn't read library files";
 
-		const Song s(path.string());
+		k.valid = r == SQLITE_ROW;
+		if (!k.valid)
+			return;
 
-		if (sqlite3_bind_text(inserter, 1, s.path.c_str(), s.path.size(),
-					SQLITE_TRANSIENT) != SQLITE_OK)
-			throw "Cannot bind path query data";
-		if (sqlite3_bind_text(inserter, 2, s.title.c_str(), s.title.size(),
-					SQLITE_TRANSIENT) != SQLITE_OK)
-			throw "Cannot bind title query data";
-		if (sqlite3_bind_text(inserter, 3, s.artist.c_str(), s.artist.size(),
-					SQLITE_TRANSIENT) != SQLITE_OK)
-			throw "Cannot bind artist query data";
-		if (sqlite3_bind_text(inserter, 4, s.album.c_str(), s.album.size(),
-					SQLITE_TRANSIENT) != SQLITE_OK)
-			throw "Cannot bind album query data";
-		if (sqlite3_bind_int(inserter, 5, s.track) != SQLITE_OK)
-			throw "Cannot bind track query data";
-		if (sqlite3_bind_int(inserter, 6, s.length) != SQLITE_OK)
-			throw "Cannot bind length query data";
+		k.path = (const char *)sqlite3_column_text(query, 0);
+		k.mtime = sqlite3_column_int64(query, 1);
+		k.size = sqlite3_column_int64(query, 2);
 
-		if (sqlite3_step(inserter) != SQLITE_DONE)
-			throw "Cannot insert song into database";
-		if (sqlite3_reset(inserter) != SQLITE_OK)
-			throw "Cannot reset insertion query";
+		if (k.path.size() == root.size() || k.path[root.size()] == '/')
+			return;
 	}
+}
 
-	sqlite3_finalize(inserter);
+// Start a query over the rows for root and everything under it, in path order
+static void FindKnown(sqlite3_stmt *query, const std::string &root)
+{
+	const std::string end = root + "0"; // "/" + 1
+	sqlite3_reset(query);
+	if (sqlite3_bind_text(query, 1, root.c_str(), root.size(),
+				SQLITE_TRANSIENT) != SQLITE_OK ||
+			sqlite3_bind_text(query, 2, end.c_str(), end.size(),
+				SQLITE_TRANSIENT) != SQLITE_OK)
+		throw "Cannot bind path query data";
+}
 
-	LoadFullList();
+// The next file the library could hold
+static bool NextAudioFile(Walker &walker, std::string &path)
+{
+	while (walker.Next(path)) {
+		if (IsAudioPath(path))
+			return true;
+	}
+	return false;
+}
+
+static void RemoveSong(ScanQueries &q, const std::string &path)
+{
+	BindPath(q.remover, path);
+	Step(q.remover, "Cannot remove song from database");
+	if (q.changed && sqlite3_changes(sqlite3_db_handle(q.remover)))
+		q.changed->push_back(path);
+	BindPath(q.unindexer, path);
+	Step(q.unindexer, "Cannot remove seek index");
+}
+
+static void RecordFailure(ScanQueries &q, const std::string &path,
+		const char *reason, int64_t mtime, int64_t size)
+{
+	RemoveSong(q, path);
+
+	BindPath(q.failer, path);
+	if (sqlite3_bind_text(q.failer, 2, reason, -1,
+				SQLITE_TRANSIENT) != SQLITE_OK ||
+			sqlite3_bind_int64(q.failer, 3, mtime) != SQLITE_OK ||
+			sqlite3_bind_int64(q.failer, 4, size) != SQLITE_OK)
+		throw "Cannot bind scan failure query data";
+	Step(q.failer, "Cannot record scan failure");
+}
+
+// Store a parsed file, or record why it couldn't be. Its seek index is
+// dropped either way, since the file has changed.
+static void StoreParsed(ScanQueries &q, const ParseResult &r, int64_t mtime,
+		int64_t size)
+{
+	Song s;
+	const char *reason = r.error;
+	if (!reason) {
+		try {
+			s = Song(r.path, r.tags);
+		} catch (const char *const e) {
+			reason = e;
+		}
+	}
+
+	if (reason) {
+		RecordFailure(q, r.path, reason, mtime, size);
+		return;
+	}
+
+	BindPath(q.unfailer, s.path);
+	Step(q.unfailer, "Cannot clear scan failure");
+	BindPath(q.unindexer, s.path);
+	Step(q.unindexer, "Cannot remove seek index");
+
+	BindPath(q.inserter, s.path);
+	if (sqlite3_bind_text(q.inserter, 2, s.title.c_str(), s.title.size(),
+				SQLITE_TRANSIENT) != SQLITE_OK)
+		throw "Cannot bind title query data";
+	if (sqlite3_bind_text(q.inserter, 3, s.artist.c_str(), s.artist.size(),
+				SQLITE_TRANSIENT) != SQLITE_OK)
+		throw "Cannot bind artist query data";
+	if (sqlite3_bind_text(q.inserter, 4, s.album.c_str(), s.album.size(),
+				SQLITE_TRANSIENT) != SQLITE_OK)
+		throw "Cannot bind album query data";
+	if (sqlite3_bind_int(q.inserter, 5, s.track) != SQLITE_OK)
+		throw "Cannot bind track query data";
+	if (sqlite3_bind_int(q.inserter, 6, s.length) != SQLITE_OK)
+		throw "Cannot bind length query data";
+	if (sqlite3_bind_int64(q.inserter, 7, mtime) != SQLITE_OK ||
+			sqlite3_bind_int64(q.inserter, 8, size) != SQLITE_OK)
+		throw "Cannot bind file stamp query data";
+
+	Step(q.inserter, "Cannot insert song into database");
+	if (q.changed)
+		q.changed->push_back(s.path);
+	if (q.stored)
+		q.stored->push_back(s.path);
+}
+
+// Take parsed files and store them, waiting for one if wait is set
+static void StoreParses(ScanQueries &q, Parser &parser,
+		std::unordered_map<std::string, std::pair<int64_t, int64_t>> &stamps,
+		bool wait)
+{
+	ParseResult r;
+	while (parser.Next(r, wait)) {
+		auto it = stamps.find(r.path);
+		StoreParsed(q, r, it->second.first, it->second.second);
+		stamps.erase(it);
+		wait = false;
+	}
+}
+
+// Directory records kept in the dirs table. Those that can't be trusted are
+// still stored, without an mtime, so that their parents list them.
+class StoredDirectories : public DirectoryRecords {
+private:
+	sqlite3_stmt *m_finder;
+	sqlite3_stmt *m_lister;
+	sqlite3_stmt *m_recorder;
+	sqlite3_stmt *m_forgetter;
+	int64_t m_settled; // Later mtimes aren't trusted
+	bool m_trusted; // Whether directories may be skipped at all
+
+	void List(const std::string &dir, std::vector<std::string> &subdirs)
+	{
+		BindPath(m_lister, dir);
+		int r;
+		while ((r = sqlite3_step(m_lister)) == SQLITE_ROW) {
+			const char *const path =
+				(const char *)sqlite3_column_text(m_lister, 0);
+			subdirs.push_back(path + dir.size() + 1);
+		}
+		if (r != SQLITE_DONE || sqlite3_reset(m_lister) != SQLITE_OK)
+			throw "Couldn't read directory records";
+	}
+
+public:
+	StoredDirectories(sqlite3 *db, bool trusted)
+		: m_trusted(trusted)
+	{
+		m_finder = Prepare(db,
+				"SELECT mtime FROM dirs WHERE path = ?;",
+				"Couldn't create directory query");
+		m_lister = Prepare(db,
+				"SELECT path FROM dirs WHERE parent = ?;",
+				"Couldn't create subdirectory query");
+		m_recorder = Prepare(db,
+				"INSERT OR REPLACE INTO dirs (path, parent, mtime) "
+				"VALUES (?, ?, ?);",
+				"Couldn't create directory update query");
+		m_forgetter = Prepare(db,
+				"DELETE FROM dirs WHERE path = ?1 OR "
+				"(path >= ?1 || '/' AND path < ?1 || '0');",
+				"Couldn't create directory removal query");
+
+		const auto now = std::chrono::system_clock::now() -
+			std::chrono::milliseconds(DIR_SETTLE_MS);
+		m_settled = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				now.time_since_epoch()).count();
+	}
+
+	~StoredDirectories()
+	{
+		sqlite3_finalize(m_finder);
+		sqlite3_finalize(m_lister);
+		sqlite3_finalize(m_recorder);
+		sqlite3_finalize(m_forgetter);
+	}
+
+	bool Unchanged(const std::string &dir, int64_t mtime,
+			std::vector<std::string> &subdirs) override
+	{
+		if (!m_trusted)
+			return false;
+
+		BindPath(m_finder, dir);
+		const int r = sqlite3_step(m_finder);
+		const bool same = r == SQLITE_ROW &&
+			sqlite3_column_type(m_finder, 0) != SQLITE_NULL &&
+			sqlite3_column_int64(m_finder, 0) == mtime;
+		if ((r != SQLITE_ROW && r != SQLITE_DONE) ||
+				sqlite3_reset(m_finder) != SQLITE_OK)
+			throw "Couldn't read directory records";
+
+		if (same)
+			List(dir, subdirs);
+		return same;
+	}
+
+	void Record(const std::string &dir, int64_t mtime,
+			const std::vector<std::string> &subdirs) override
+	{
+		std::vector<std::string> before;
+		List(dir, before);
+		const std::unordered_set<std::string> now(subdirs.begin(),
+				subdirs.end());
+		for (const std::string &name : before) {
+			if (!now.count(name))
+				Forget(dir + "/" + name);
+		}
+
+		const size_t slash = dir.rfind('/');
+		const std::string parent = slash == std::string::npos ? "" :
+			dir.substr(0, slash);
+
+		BindPath(m_recorder, dir);
+		if (sqlite3_bind_text(m_recorder, 2, parent.c_str(), parent.size(),
+					SQLITE_TRANSIENT) != SQLITE_OK ||
+				(mtime < m_settled ?
+					sqlite3_bind_int64(m_recorder, 3, mtime) :
+					sqlite3_bind_null(m_recorder, 3)) != SQLITE_OK)
+			throw "Cannot bind directory query data";
+		Step(m_recorder, "Cannot record directory");
+	}
+
+	void Forget(const std::string &dir) override
+	{
+		BindPath(m_forgetter, dir);
+		Step(m_forgetter, "Cannot remove directory record");
+	}
+};
+
+// The walk and the rows of songs and scan_failures are read side by side in
+// path order, so each file is classified in one linear pass: a path only on
+// disk is added, one only in the database is removed, and one in both is
+// modified if its mtime or size differ and otherwise left alone. Unchanged
+// files cost a stat and no database work, and memory doesn't grow with the
+// size of the library.
+//
+// Tags are read by a Parser with several files in flight, and stored as they
+// finish while the walk carries on. Existing rows are updated in place so
+// their ids survive; a modified file loses its loudness analysis and seek
+// index. A file that can't be read is recorded in scan_failures with its mtime
+// and size instead of ending the scan, and isn't tried again until one of them
+// changes. Rows under a directory the walk couldn't read are kept.
+//
+// Directories are recorded with their mtimes, and unless full is set, one
+// whose mtime hasn't moved isn't read and its files aren't stated: a rescan
+// of an unchanged tree costs a stat per directory. The price is that a file
+// rewritten in place, which changes only its own mtime, is missed until a
+// full scan or the watcher reports it.
+size_t Library::Reconcile(const std::vector<std::string> &roots,
+		std::vector<std::string> *changed, std::vector<std::string> *stored,
+		bool full)
+{
+	// Roots under another are covered by it, and the rest don't overlap, so
+	// each one's rows are only written at or behind its cursors and don't
+	// disturb what they read next
+	const std::set<std::string> unique(roots.begin(), roots.end());
+	std::vector<std::string> tops;
+	for (const std::string &root : unique) {
+		bool covered = false;
+		for (size_t slash = root.rfind('/'); !covered && slash &&
+				slash != std::string::npos; slash = root.rfind('/', slash - 1))
+			covered = unique.count(root.substr(0, slash));
+		if (!covered)
+			tops.push_back(root);
+	}
+
+	SimpleQuery("BEGIN;");
+
+	ScanQueries q;
+	q.inserter = Prepare(m_db,
+			"INSERT INTO songs (path, title, artist, album, track, length, "
+			"mtime, size) VALUES (?, ?, ?, ?, ?, ?, ?, ?) "
+			"ON CONFLICT(path) DO UPDATE SET title = excluded.title, "
+			"artist = excluded.artist, album = excluded.album, "
+			"track = excluded.track, length = excluded.length, "
+			"loudness = NULL, "
+			"peak = NULL, "
+			"mtime = excluded.mtime, size = excluded.size;",
+			"Couldn't create song inserter query");
+	q.remover = Prepare(m_db,
+			"DELETE FROM songs WHERE path = ?;",
+			"Couldn't create song removal query");
+	q.failer = Prepare(m_db,
+			"INSERT OR REPLACE INTO scan_failures (path, reason, mtime, size) "
+			"VALUES (?, ?, ?, ?);",
+			"Couldn't create scan failure update query");
+	q.unfailer = Prepare(m_db,
+			"DELETE FROM scan_failures WHERE path = ?;",
+			"Couldn't create scan failure removal query");
+	q.unindexer = Prepare(m_db,
+			"DELETE FROM seek_index WHERE path = ?;",
+			"Couldn't create seek index removal query");
+	q.changed = changed;
+	q.stored = stored;
+
+	sqlite3_stmt *songs = Prepare(m_db,
+			"SELECT path, mtime, size FROM songs "
+			"WHERE path >= ? AND path < ? ORDER BY path;",
+			"Couldn't create library file query");
+	sqlite3_stmt *failures = Prepare(m_db,
+			"SELECT path, mtime, size FROM scan_failures "
+			"WHERE path >= ? AND path < ? ORDER BY path;",
+			"Couldn't create scan failure query");
+
+	StoredDirectories dirs(m_db, !full);
+	Parser parser(PARSE_IN_FLIGHT, PARSE_TIMEOUT_MS);
+	std::unordered_map<std::string, std::pair<int64_t, int64_t>> stamps;
+	size_t changes = 0;
+	bool complete = true;
+
+	for (const std::string &root : tops) {
+		KnownFile song, failure;
+		FindKnown(songs, root);
+		FindKnown(failures, root);
+		ReadKnown(songs, root, song);
+		ReadKnown(failures, root, failure);
+
+		Walker walker(root, &dirs);
+		std::string file;
+		bool walking = NextAudioFile(walker, file);
+
+		while (walking || song.valid || failure.valid) {
+			// A path is in at most one of the tables
+			const bool failed = failure.valid &&
+				(!song.valid || failure.path < song.path);
+			KnownFile &known = failed ? failure : song;
+			const int order = !known.valid ? -1 : !walking ? 1 :
+				file.compare(known.path);
+
+			if (order > 0) {
+				if (!walker.Unknown(known.path)) {
+					if (failed) {
+						BindPath(q.unfailer, known.path);
+						Step(q.unfailer, "Cannot clear scan failure");
+					} else {
+						RemoveSong(q, known.path);
+					}
+					changes++;
+				}
+				ReadKnown(failed ? failures : songs, root, known);
+				continue;
+			}
+
+			int64_t mtime, size;
+			StatFile(file, mtime, size);
+
+			if (order == 0) {
+				const bool same = known.mtime == mtime && known.size == size;
+				ReadKnown(failed ? failures : songs, root, known);
+				if (same) {
+					walking = NextAudioFile(walker, file);
+					continue;
+				}
+			}
+
+			if (mtime < 0) {
+				RecordFailure(q, file, "Cannot stat file", mtime, size);
+			} else {
+				// Waiting only while every slot is busy keeps the parser fed
+				// without queueing up the whole walk
+				StoreParses(q, parser, stamps, parser.Full());
+				stamps[file] = std::make_pair(mtime, size);
+				parser.Add(file);
+			}
+			changes++;
+			walking = NextAudioFile(walker, file);
+		}
+
+		complete &= walker.Complete();
+	}
+
+	while (stamps.size())
+		StoreParses(q, parser, stamps, true);
+
+	sqlite3_finalize(songs);
+	sqlite3_finalize(failures);
+	sqlite3_finalize(q.inserter);
+	sqlite3_finalize(q.remover);
+	sqlite3_finalize(q.failer);
+	sqlite3_finalize(q.unfailer);
+	sqlite3_finalize(q.unindexer);
+
+	SimpleQuery("COMMIT;");
+	m_complete = complete;
+
+	return changes;
+}
+
+void Library::Scan(bool full, std::vector<std::string> *stored)
+{
+	// A loaded list is only read again if there is something new in it
+	if (Reconcile({ "." }, nullptr, stored, full) && m_generation)
+		LoadFullList();
+}
+
+static bool SongOrder(const Song &a, const Song &b)
+{
+	return std::tie(a.artist, a.album, a.track, a.title, a.id) <
+		std::tie(b.artist, b.album, b.track, b.title, b.id);
+}
+
+// The loaded list is patched rather than read again: rows for changed songs
+// are dropped and their new versions merged back in the order LoadFullList()
+// uses. A search result only has the rows it already showed refreshed.
+bool Library::Update(const std::vector<std::string> &paths,
+		std::vector<std::string> *stored)
+{
+	std::vector<std::string> changed;
+	Reconcile(paths, &changed, stored, false);
+	if (changed.empty())
+		return false;
+
+	sqlite3_stmt *query = Prepare(m_db,
+			"SELECT " SONG_COLUMNS " FROM songs WHERE path = ?;",
+			"Couldn't create song query");
+
+	std::unordered_map<std::string, Song> fresh;
+	for (const std::string &path : changed) {
+		BindPath(query, path);
+		if (sqlite3_step(query) == SQLITE_ROW)
+			ReadSong(query, fresh[path]);
+		else
+			fresh.erase(path);
+		sqlite3_reset(query);
+	}
+	sqlite3_finalize(query);
+
+	const std::unordered_set<std::string> gone(changed.begin(), changed.end());
+	size_t kept = 0;
+	for (size_t i = 0; i < m_songs.size(); i++) {
+		if (gone.count(m_songs[i].path)) {
+			auto it = fresh.find(m_songs[i].path);
+			if (m_full || it == fresh.end())
+				continue;
+			m_songs[i] = it->second;
+		}
+		if (kept != i)
+			m_songs[kept] = std::move(m_songs[i]);
+		kept++;
+	}
+	m_songs.resize(kept);
+
+	if (m_full) {
+		for (auto &it : fresh)
+			m_songs.push_back(std::move(it.second));
+		std::sort(m_songs.begin() + kept, m_songs.end(), SongOrder);
+		std::inplace_merge(m_songs.begin(), m_songs.begin() + kept,
+				m_songs.end(), SongOrder);
+	}
+
+	m_generation++;
+	return true;
 }
 
 unsigned Library::QueryCount() const
 {
 	sqlite3_stmt *query;
 	if (sqlite3_prepare_v2(m_db, "SELECT count(*) FROM songs;",
-				128, &query, nullptr))
+				-1, &query, nullptr))
 		throw "Couldn't create count query";
 
 	if (sqlite3_step(query) != SQLITE_ROW)
@@ -88,34 +662,27 @@ unsigned Library::QueryCount() const
 	return count;
 }
 
-Song Library::WithId(unsigned id)
+bool Library::WithId(unsigned id, Song &s)
 {
 	sqlite3_stmt *query;
 	if (sqlite3_prepare_v2(m_db,
-				"SELECT path, title, artist, album, track, length "
-				"FROM songs WHERE rowid = ?;", 128, &query, nullptr))
+				"SELECT " SONG_COLUMNS " FROM songs WHERE rowid = ?;",
+				-1, &query, nullptr))
 		throw "Couldn't create song selection query";
 
 	if (sqlite3_bind_int(query, 1, (int)id) != SQLITE_OK)
 		throw "Cannot bind id query data";
 
 	const int result = sqlite3_step(query);
-	if (result == SQLITE_DONE)
-		throw "Invalid song index";
-	else if (result != SQLITE_ROW)
+	if (result != SQLITE_ROW && result != SQLITE_DONE)
 		throw "Cannot query database";
 
-	Song s;
-	s.path = (const char *)sqlite3_column_text(query, 0);
-	s.title = (const char *)sqlite3_column_text(query, 1);
-	s.artist = (const char *)sqlite3_column_text(query, 2);
-	s.album = (const char *)sqlite3_column_text(query, 3);
-	s.track = sqlite3_column_int(query, 4);
-	s.length = sqlite3_column_int(query, 5);
+	if (result == SQLITE_ROW)
+		ReadSong(query, s);
 
 	sqlite3_finalize(query);
 
-	return s;
+	return result == SQLITE_ROW;
 }
 
 void Library::SimpleQuery(const char *const query)
@@ -132,28 +699,17 @@ void Library::SimpleQuery(const char *const query)
 	}
 }
 
-void Library::LoadFullList()
+// Replace the song list with the rows of a prepared query
+void Library::LoadQuery(sqlite3_stmt *query)
 {
-	sqlite3_stmt *query;
-	if (sqlite3_prepare_v2(m_db,
-				"SELECT path, title, artist, album, track, length FROM songs "
-				"ORDER BY artist, album, track, title, rowid;",
-				128, &query, nullptr))
-		throw "Couldn't create song selection query";
-
 	m_songs.clear();
-	m_songs.reserve(QueryCount());
+	m_generation++;
 
 	while (1) {
 		const int result = sqlite3_step(query);
 		if (result == SQLITE_ROW) {
 			Song s;
-			s.path = (const char *)sqlite3_column_text(query, 0);
-			s.title = (const char *)sqlite3_column_text(query, 1);
-			s.artist = (const char *)sqlite3_column_text(query, 2);
-			s.album = (const char *)sqlite3_column_text(query, 3);
-			s.track = sqlite3_column_int(query, 4);
-			s.length = sqlite3_column_int(query, 5);
+			ReadSong(query, s);
 			m_songs.push_back(s);
 		} else if (result == SQLITE_DONE) {
 			break;
@@ -167,42 +723,450 @@ void Library::LoadFullList()
 	sqlite3_finalize(query);
 }
 
-void Library::LoadSearch(const std::string &search)
+// The song after id in the order of the full list, whatever is showing now.
+// Returns 0 at the end or if id has gone.
+unsigned Library::NextId(unsigned id)
+{
+	sqlite3_stmt *query;
+	if (sqlite3_prepare_v2(m_db,
+				"SELECT rowid FROM songs "
+				"WHERE (artist, album, track, title, rowid) > "
+				"(SELECT artist, album, track, title, rowid "
+				"FROM songs WHERE rowid = ?) "
+				"ORDER BY artist, album, track, title, rowid LIMIT 1;",
+				-1, &query, nullptr))
+		throw "Couldn't create next song query";
+
+	if (sqlite3_bind_int(query, 1, (int)id) != SQLITE_OK)
+		throw "Cannot bind id query data";
+
+	const unsigned next = sqlite3_step(query) == SQLITE_ROW ?
+		sqlite3_column_int(query, 0) : 0;
+
+	sqlite3_finalize(query);
+
+	return next;
+}
+
+// Rowids are dense unless songs have been removed, so they make a cheap range
+// to pick random songs from
+unsigned Library::MaxId()
+{
+	sqlite3_stmt *query;
+	if (sqlite3_prepare_v2(m_db, "SELECT max(rowid) FROM songs;",
+				-1, &query, nullptr))
+		throw "Couldn't create max id query";
+
+	const unsigned max = sqlite3_step(query) == SQLITE_ROW ?
+		sqlite3_column_int(query, 0) : 0;
+
+	sqlite3_finalize(query);
+
+	return max;
+}
+
+bool Library::HasId(unsigned id)
+{
+	sqlite3_stmt *query;
+	if (sqlite3_prepare_v2(m_db, "SELECT 1 FROM songs WHERE rowid = ?;",
+				-1, &query, nullptr))
+		throw "Couldn't create id query";
+
+	if (sqlite3_bind_int(query, 1, (int)id) != SQLITE_OK)
+		throw "Cannot bind id query data";
+
+	const bool found = sqlite3_step(query) == SQLITE_ROW;
+
+	sqlite3_finalize(query);
+
+	return found;
+}
+
+size_t Library::FirstId(const std::vector<unsigned> &ids)
+{
+	if (ids.empty())
+		return 0;
+
+	std::string sql = "SELECT rowid FROM songs WHERE rowid IN (?";
+	for (size_t i = 1; i < ids.size(); i++)
+		sql += ", ?";
+	sql += ");";
+
+	sqlite3_stmt *query = Prepare(m_db, sql.c_str(),
+			"Couldn't create id query");
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (sqlite3_bind_int(query, i + 1, (int)ids[i]) != SQLITE_OK)
+			throw "Cannot bind id query data";
+	}
+
+	std::unordered_set<unsigned> found;
+	while (sqlite3_step(query) == SQLITE_ROW)
+		found.insert(sqlite3_column_int(query, 0));
+
+	sqlite3_finalize(query);
+
+	size_t i = 0;
+	while (i < ids.size() && !found.count(ids[i]))
+		i++;
+	return i;
+}
+
+int64_t Library::GetState(const char *key, int64_t fallback)
+{
+	sqlite3_stmt *query;
+	if (sqlite3_prepare_v2(m_db, "SELECT value FROM state WHERE key = ?;",
+				-1, &query, nullptr))
+		throw "Couldn't create state query";
+
+	if (sqlite3_bind_text(query, 1, key, -1, SQLITE_STATIC) != SQLITE_OK)
+		throw "Cannot bind state query data";
+
+	const int64_t value = sqlite3_step(query) == SQLITE_ROW ?
+		sqlite3_column_int64(query, 0) : fallback;
+
+	sqlite3_finalize(query);
+
+	return value;
+}
+
+void Library::SetState(const char *key, int64_t value)
+{
+	sqlite3_stmt *query;
+	if (sqlite3_prepare_v2(m_db,
+				"INSERT OR REPLACE INTO state (key, value) VALUES (?, ?);",
+				-1, &query, nullptr))
+		throw "Couldn't create state update query";
+
+	if (sqlite3_bind_text(query, 1, key, -1, SQLITE_STATIC) != SQLITE_OK ||
+			sqlite3_bind_int64(query, 2, value) != SQLITE_OK)
+		throw "Cannot bind state query data";
+
+	if (sqlite3_step(query) != SQLITE_DONE)
+		throw "Cannot update state";
+
+	sqlite3_finalize(query);
+}
+
+void Library::LoadFullList()
 {
 	sqlite3_stmt *query;
 	if (sqlite3_prepare_v2(m_db,
-				"SELECT path, title, artist, album, track, length FROM songs "
+				"SELECT " SONG_COLUMNS " FROM songs "
+				"ORDER BY artist, album, track, title, rowid;",
+				-1, &query, nullptr))
+		throw "Couldn't create song selection query";
+
+	m_songs.reserve(QueryCount());
+	LoadQuery(query);
+	m_full = true;
+}
+
+static sqlite3_stmt *PrepareSearch(sqlite3 *db, const std::string &search)
+{
+	sqlite3_stmt *query;
+	if (sqlite3_prepare_v2(db,
+				"SELECT " SONG_COLUMNS " FROM songs "
 				"WHERE title LIKE  ? "
 				// "WHERE ((title+artist+album) LIKE  ?) "
 				"ORDER BY artist, album, track, title, rowid;",
-				128, &query, nullptr))
+				-1, &query, nullptr))
 		throw "Couldn't create song selection query";
 
 	if (sqlite3_bind_text(query, 1, search.c_str(), search.size(),
 				SQLITE_TRANSIENT) != SQLITE_OK)
 		throw "Can't bind search query";
 
-	m_songs.clear();
+	return query;
+}
 
-	while (1) {
-		const int result = sqlite3_step(query);
-		if (result == SQLITE_ROW) {
-			Song s;
-			s.path = (const char *)sqlite3_column_text(query, 0);
-			s.title = (const char *)sqlite3_column_text(query, 1);
-			s.artist = (const char *)sqlite3_column_text(query, 2);
-			s.album = (const char *)sqlite3_column_text(query, 3);
-			s.track = sqlite3_column_int(query, 4);
-			s.length = sqlite3_column_int(query, 5);
-			m_songs.push_back(s);
-		} else if (result == SQLITE_DONE) {
-			break;
-		} else {
-			fprintf(stderr, "SQL Step Error: %d: %s\n",
-					result, sqlite3_errmsg(m_db));
-			throw "SQL Step Error!";
+void Library::LoadSearch(const std::string &search)
+{
+	LoadQuery(PrepareSearch(m_db, search));
+	m_full = false;
+}
+
+SongCursor Library::Search(const std::string &search)
+{
+	return SongCursor(PrepareSearch(m_db, search));
+}
+
+// The distinct counts walk the songs_order index instead of sorting
+LibraryStats Library::Stats()
+{
+	sqlite3_stmt *query;
+	if (sqlite3_prepare_v2(m_db,
+				"SELECT count(*), total(length), count(loudness), "
+				"(SELECT count(DISTINCT artist) FROM songs), "
+				"(SELECT count(*) FROM "
+				"(SELECT 1 FROM songs GROUP BY artist, album)), "
+				"(SELECT count(*) FROM seek_index WHERE size > 0), "
+				"(SELECT count(*) FROM scan_failures) "
+				"FROM songs;", -1, &query, nullptr))
+		throw "Couldn't create statistics query";
+
+	if (sqlite3_step(query) != SQLITE_ROW)
+		throw "Couldn't query statistics";
+
+	LibraryStats stats;
+	stats.songs = sqlite3_column_int(query, 0);
+	stats.length = sqlite3_column_int64(query, 1);
+	stats.analyzed = sqlite3_column_int(query, 2);
+	stats.artists = sqlite3_column_int(query, 3);
+	stats.albums = sqlite3_column_int(query, 4);
+	stats.indexed = sqlite3_column_int(query, 5);
+	stats.failed = sqlite3_column_int(query, 6);
+
+	sqlite3_finalize(query);
+
+	return stats;
+}
+
+SongCursor::~SongCursor()
+{
+	sqlite3_finalize(m_query);
+}
+
+SongCursor::SongCursor(SongCursor &&c)
+{
+	m_query = c.m_query;
+	c.m_query = nullptr;
+}
+
+bool SongCursor::Next(Song &s)
+{
+	const int result = sqlite3_step(m_query);
+	if (result == SQLITE_ROW) {
+		ReadSong(m_query, s);
+		return true;
+	} else if (result != SQLITE_DONE) {
+		throw "SQL Step Error!";
+	}
+	return false;
+}
+
+std::vector<std::string> Library::Unanalyzed()
+{
+	sqlite3_stmt *query;
+	if (sqlite3_prepare_v2(m_db,
+				"SELECT path FROM songs WHERE loudness IS NULL "
+				"ORDER BY artist, album, track;", -1, &query, nullptr))
+		throw "Couldn't create analysis query";
+
+	std::vector<std::string> paths;
+	while (sqlite3_step(query) == SQLITE_ROW)
+		paths.push_back((const char *)sqlite3_column_text(query, 0));
+
+	sqlite3_finalize(query);
+
+	return paths;
+}
+
+// A batch of results is stored in one transaction with each statement
+// prepared once, and each album it touches is measured again once
+void Library::StoreAnalysis(const std::vector<AnalyzerResult> &results)
+{
+	sqlite3_stmt *indexer = Prepare(m_db,
+			"INSERT OR REPLACE INTO seek_index (path, size, points) "
+			"VALUES (?, ?, ?);",
+			"Couldn't create seek index update query");
+	sqlite3_stmt *measurer = Prepare(m_db,
+			"UPDATE songs SET loudness = ?2, peak = ?3 WHERE path = ?1;",
+			"Couldn't create loudness update query");
+	sqlite3_stmt *finder = Prepare(m_db,
+			"SELECT artist, album FROM songs WHERE path = ?;",
+			"Couldn't create song album query");
+
+	std::set<std::pair<std::string, std::string>> albums;
+	int result = SQLITE_DONE;
+
+	SimpleQuery("BEGIN;");
+
+	for (const AnalyzerResult &r : results) {
+		if (r.job == AnalyzerJob::SeekIndex) {
+			BindPath(indexer, r.path);
+			if (sqlite3_bind_int64(indexer, 2, r.size) != SQLITE_OK ||
+					sqlite3_bind_blob(indexer, 3, r.points.data(),
+						r.points.size() * sizeof(SeekPoint),
+						SQLITE_TRANSIENT) != SQLITE_OK)
+				throw "Cannot bind seek index query data";
+			result = sqlite3_step(indexer);
+			sqlite3_reset(indexer);
+		} else if (r.ok) {
+			BindPath(measurer, r.path);
+			if (sqlite3_bind_double(measurer, 2, r.loudness) != SQLITE_OK ||
+					sqlite3_bind_double(measurer, 3, r.peak) != SQLITE_OK)
+				throw "Cannot bind loudness query data";
+			result = sqlite3_step(measurer);
+			sqlite3_reset(measurer);
+
+			if (result == SQLITE_DONE) {
+				if (Song *s = Loaded(r.path)) {
+					s->loudness = r.loudness;
+					s->peak = r.peak;
+				}
+
+				// The song may not be loaded if the list is showing a search
+				BindPath(finder, r.path);
+				if (sqlite3_step(finder) == SQLITE_ROW)
+					albums.emplace(
+							(const char *)sqlite3_column_text(finder, 0),
+							(const char *)sqlite3_column_text(finder, 1));
+				sqlite3_reset(finder);
+			}
 		}
+
+		if (result != SQLITE_DONE)
+			break;
+	}
+
+	sqlite3_finalize(indexer);
+	sqlite3_finalize(measurer);
+	sqlite3_finalize(finder);
+
+	// Only the first write can find the database busy, so nothing has been
+	// stored. While a scan from another process holds it the batch is
+	// dropped, and its files are analysed again on the next run.
+	if (result == SQLITE_BUSY) {
+		SimpleQuery("ROLLBACK;");
+		return;
+	}
+	if (result != SQLITE_DONE)
+		throw "Cannot store analysis results";
+
+	sqlite3_stmt *tracks = Prepare(m_db,
+			"SELECT path, loudness, length, peak FROM songs "
+			"WHERE artist = ?1 AND album = ?2;",
+			"Couldn't create album tracks query");
+	sqlite3_stmt *updater = Prepare(m_db,
+			"UPDATE songs SET album_loudness = ?3, album_peak = ?4 "
+			"WHERE artist = ?1 AND album = ?2;",
+			"Couldn't create album loudness query");
+
+	for (const auto &album : albums)
+		UpdateAlbumLoudness(tracks, updater, album.first, album.second);
+
+	sqlite3_finalize(tracks);
+	sqlite3_finalize(updater);
+
+	SimpleQuery("COMMIT;");
+}
+
+// Only formats BuildSeekIndex() understands are listed
+std::vector<std::string> Library::Unindexed()
+{
+	sqlite3_stmt *query;
+	if (sqlite3_prepare_v2(m_db,
+				"SELECT path FROM songs "
+				"WHERE path NOT IN (SELECT path FROM seek_index) AND "
+				"(path LIKE '%.mp3' OR path LIKE '%.ogg' OR "
+				"path LIKE '%.oga' OR path LIKE '%.opus');",
+				-1, &query, nullptr))
+		throw "Couldn't create seek index query";
+
+	std::vector<std::string> paths;
+	while (sqlite3_step(query) == SQLITE_ROW)
+		paths.push_back((const char *)sqlite3_column_text(query, 0));
+
+	sqlite3_finalize(query);
+
+	return paths;
+}
+
+// Files that can't be indexed get an empty entry so they aren't tried again
+bool Library::GetSeekIndex(unsigned id, uint64_t &size,
+		std::vector<SeekPoint> &points)
+{
+	sqlite3_stmt *query;
+	if (sqlite3_prepare_v2(m_db,
+				"SELECT seek_index.size, seek_index.points FROM seek_index "
+				"JOIN songs ON songs.path = seek_index.path "
+				"WHERE songs.rowid = ?;", -1, &query, nullptr))
+		throw "Couldn't create seek index query";
+
+	if (sqlite3_bind_int(query, 1, (int)id) != SQLITE_OK)
+		throw "Cannot bind id query data";
+
+	points.clear();
+	size = 0;
+
+	if (sqlite3_step(query) == SQLITE_ROW) {
+		size = sqlite3_column_int64(query, 0);
+		const SeekPoint *p = (const SeekPoint *)sqlite3_column_blob(query, 1);
+		const size_t n = sqlite3_column_bytes(query, 1) / sizeof(SeekPoint);
+		if (p)
+			points.assign(p, p + n);
 	}
 
 	sqlite3_finalize(query);
+
+	return size && points.size();
+}
+
+// Album loudness is the power mean of the analysed tracks weighted by length,
+// which matches gating the whole album closely without keeping every block
+static void BindAlbum(sqlite3_stmt *query, const std::string &artist,
+		const std::string &album)
+{
+	if (sqlite3_bind_text(query, 1, artist.c_str(), artist.size(),
+				SQLITE_TRANSIENT) != SQLITE_OK ||
+			sqlite3_bind_text(query, 2, album.c_str(), album.size(),
+				SQLITE_TRANSIENT) != SQLITE_OK)
+		throw "Cannot bind album query data";
+}
+
+void Library::UpdateAlbumLoudness(sqlite3_stmt *tracks, sqlite3_stmt *updater,
+		const std::string &artist, const std::string &album)
+{
+	const int t = SQLITE_NULL;
+	std::vector<std::string> paths;
+	double power = 0;
+	double total = 0;
+	double peak = 0;
+
+	BindAlbum(tracks, artist, album);
+	while (sqlite3_step(tracks) == SQLITE_ROW) {
+		paths.push_back((const char *)sqlite3_column_text(tracks, 0));
+		if (sqlite3_column_type(tracks, 1) == t)
+			continue;
+
+		const int length = sqlite3_column_int(tracks, 2);
+		const double w = length ? length : 1;
+		power += w * std::pow(10.0, sqlite3_column_double(tracks, 1) / 10);
+		total += w;
+		peak = std::max(peak, sqlite3_column_double(tracks, 3));
+	}
+	sqlite3_reset(tracks);
+
+	if (!total)
+		return;
+
+	const double loudness = 10 * std::log10(power / total);
+
+	BindAlbum(updater, artist, album);
+	if (sqlite3_bind_double(updater, 3, loudness) != SQLITE_OK ||
+			sqlite3_bind_double(updater, 4, peak) != SQLITE_OK)
+		throw "Cannot bind album loudness query data";
+	Step(updater, "Cannot update album loudness");
+
+	for (const std::string &path : paths) {
+		if (Song *s = Loaded(path)) {
+			s->album_loudness = loudness;
+			s->album_peak = peak;
+		}
+	}
+}
+
+// The map is rebuilt once after each change to the list, rather than the list
+// being searched for every song
+Song *Library::Loaded(const std::string &path)
+{
+	if (m_index_generation != m_generation) {
+		m_index.clear();
+		for (size_t i = 0; i < m_songs.size(); i++)
+			m_index[m_songs[i].path] = i;
+		m_index_generation = m_generation;
+	}
+
+	auto it = m_index.find(path);
+	return it == m_index.end() ? nullptr : &m_songs[it->second];
 }
@@ -1,16 +1,61 @@
 #pragma once
 
+#include "analyzer.hpp"
+#include "seekindex.hpp"
 #include "song.hpp"
 #include "sqlite/sqlite3.h"
+#include <string>
+#include <unordered_map>
 #include <vector>
+#include <cstdint>
+
+struct LibraryStats {
+	unsigned songs;
+	unsigned artists;
+	unsigned albums;
+	uint64_t length; // Seconds
+	unsigned analyzed;
+	unsigned indexed;
+	unsigned failed; // Files the last scan couldn't read
+};
+
+// Steps through the rows of a query one at a time, for callers that shouldn't
+// hold the whole result in memory
+class SongCursor {
+private:
+	sqlite3_stmt *m_query;
+
+public:
+	SongCursor(sqlite3_stmt *query) : m_query(query) {}
+	~SongCursor();
+	SongCursor(SongCursor &&c);
+	SongCursor(const SongCursor &c) = delete;
+
+	// Returns false once there are no more rows
+	bool Next(Song &s);
+};
 
 class Library {
 private:
 	sqlite3 *m_db;
 	std::vector<Song> m_songs;
+	unsigned m_generation;
+	bool m_full; // The list holds every song rather than a search
+	bool m_complete; // The last scan read every directory
+	// Index into m_songs by path, as of m_index_generation
+	std::unordered_map<std::string, size_t> m_index;
+	unsigned m_index_generation;
 
 	void SimpleQuery(const char *const query);
 	unsigned QueryCount() const;
+	void LoadQuery(sqlite3_stmt *query);
+	size_t Reconcile(const std::vector<std::string> &roots,
+			std::vector<std::string> *changed,
+			std::vector<std::string> *stored, bool full);
+	void UpdateAlbumLoudness(sqlite3_stmt *tracks, sqlite3_stmt *updater,
+			const std::string &artist, const std::string &album);
+	// The loaded row for a path, or nullptr if it isn't in the list
+	Song *Loaded(const std::string &path);
 
 public:
 	Library();
@@ -18,14 +63,58 @@ public:
 	Library(Library &&l);
 	Library(const Library &l) = delete;
 
-	void Scan();
+	void Open(const std::string &path);
+
+	// Bring the database in line with the files under the current directory.
+	// Directories that haven't changed since the last scan are skipped unless
+	// full is set. A loaded list is reloaded if anything changed. The paths
+	// of songs added or modified, which need analysing, go in stored.
+	void Scan(bool full, std::vector<std::string> *stored = nullptr);
+
+	// Bring the rows for these files and directories up to date as Scan()
+	// does, and patch the loaded list in place. Returns whether any song
+	// changed.
+	bool Update(const std::vector<std::string> &paths,
+			std::vector<std::string> *stored = nullptr);
+
+	// Whether the last Scan() or Update() could read every directory. Songs
+	// under one it couldn't are kept as they were.
+	inline bool Complete() const { return m_complete; }
 
 	inline unsigned Count() const { return m_songs.size(); }
 
 	inline Song &At(unsigned idx) { return m_songs[idx]; }
 
-	Song WithId(unsigned id);
+	// Incremented whenever the list of songs is reloaded or patched
+	inline unsigned Generation() const { return m_generation; }
+
+	// Returns false if there is no such song, as when its file has gone
+	bool WithId(unsigned id, Song &s);
+	unsigned NextId(unsigned id);
+	unsigned MaxId();
+	bool HasId(unsigned id);
+	// Index of the first of ids that is a song, or ids.size() if none are
+	size_t FirstId(const std::vector<unsigned> &ids);
+
+	// Small values kept between runs
+	int64_t GetState(const char *key, int64_t fallback);
+	void SetState(const char *key, int64_t value);
 
 	void LoadFullList();
 	void LoadSearch(const std::string &search);
+
+	// The rows LoadSearch() would load, without loading them
+	SongCursor Search(const std::string &search);
+
+	LibraryStats Stats();
+
+	// Paths of songs that haven't had their loudness analysed
+	std::vector<std::string> Unanalyzed();
+
+	// Paths of songs in a format with seek indexes that haven't been indexed
+	std::vector<std::string> Unindexed();
+	// Store finished loudness analyses and seek indexes
+	void StoreAnalysis(const std::vector<AnalyzerResult> &results);
+	bool GetSeekIndex(unsigned id, uint64_t &size,
+			std::vector<SeekPoint> &points);
 };
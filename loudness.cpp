@@ -0,0 +1,133 @@
+#include "loudness.hpp"
+#include <cmath>
+#include <algorithm>
+
+#define STEP_FRAMES (LOUDNESS_RATE / 10)
+#define BLOCK_STEPS 4
+#define ABSOLUTE_GATE -70.0
+#define RELATIVE_GATE -10.0
+
+// Polyphase interpolation filter from BS.1770 annex 2. The last two phases
+// are the first two reversed.
+static const double g_peak_taps[2][LOUDNESS_PEAK_TAPS] = {
+	{
+		0.0017089843750, 0.0109863281250, -0.0196533203125, 0.0332031250000,
+		-0.0594482421875, 0.1373291015625, 0.9721679687500, -0.1022949218750,
+		0.0476074218750, -0.0266113281250, 0.0148925781250, -0.0083007812500,
+	},
+	{
+		-0.0291748046875, 0.0292968750000, -0.0517578125000, 0.0891113281250,
+		-0.1665039062500, 0.4650878906250, 0.7797851562500, -0.2003173828125,
+		0.1015625000000, -0.0582275390625, 0.0330810546875, -0.0189208984375,
+	},
+};
+
+static double BlockLoudness(double z)
+{
+	return -0.691 + 10 * std::log10(z);
+}
+
+// K-weighting: a high shelf for the head followed by a high-pass
+LoudnessMeter::LoudnessMeter()
+	: m_shelf{ 1.53512485958697, -2.69169618940638, 1.19839281085285,
+			-1.69065929318241, 0.73248077421585, {}, {} }
+	, m_highpass{ 1.0, -2.0, 1.0,
+			-1.99004745483398, 0.99007225036621, {}, {} }
+	, m_step_sum(0)
+	, m_step_frames(0)
+	, m_history{}
+	, m_history_pos(0)
+	, m_max{}
+	, m_min{}
+{}
+
+// Transposed direct form II
+inline LoudnessMeter::Lanes LoudnessMeter::Filter(Biquad &f, Lanes x)
+{
+	const Lanes y = f.b0 * x + f.z1;
+	f.z1 = f.b1 * x - f.a1 * y + f.z2;
+	f.z2 = f.b2 * x - f.a2 * y;
+	return y;
+}
+
+inline void LoudnessMeter::TruePeak(Lanes x)
+{
+	m_history_pos = m_history_pos ? m_history_pos - 1 : LOUDNESS_PEAK_TAPS - 1;
+	m_history[m_history_pos] = x;
+	m_history[m_history_pos + LOUDNESS_PEAK_TAPS] = x;
+
+	const Lanes *h = m_history + m_history_pos;
+	Lanes y[4] = {};
+
+	for (unsigned i = 0; i < LOUDNESS_PEAK_TAPS; i++) {
+		const unsigned r = LOUDNESS_PEAK_TAPS - 1 - i;
+		y[0] += g_peak_taps[0][i] * h[i];
+		y[1] += g_peak_taps[1][i] * h[i];
+		y[2] += g_peak_taps[1][r] * h[i];
+		y[3] += g_peak_taps[0][r] * h[i];
+	}
+
+	for (const Lanes &v : y) {
+		m_max = v > m_max ? v : m_max;
+		m_min = v < m_min ? v : m_min;
+	}
+}
+
+void LoudnessMeter::Add(const float *samples, size_t frames)
+{
+	for (size_t i = 0; i < frames; i++) {
+		const Lanes x = { samples[2 * i], samples[2 * i + 1] };
+
+		TruePeak(x);
+
+		const Lanes k = Filter(m_highpass, Filter(m_shelf, x));
+		const Lanes sq = k * k;
+		m_step_sum += sq[0] + sq[1];
+
+		if (++m_step_frames == STEP_FRAMES) {
+			m_steps.push_back(m_step_sum);
+			m_step_sum = 0;
+			m_step_frames = 0;
+		}
+	}
+}
+
+double LoudnessMeter::Integrated() const
+{
+	std::vector<double> blocks;
+
+	for (size_t i = 0; i + BLOCK_STEPS <= m_steps.size(); i++) {
+		double sum = 0;
+		for (size_t j = 0; j < BLOCK_STEPS; j++)
+			sum += m_steps[i + j];
+
+		const double z = sum / (BLOCK_STEPS * STEP_FRAMES);
+		if (z > 0 && BlockLoudness(z) > ABSOLUTE_GATE)
+			blocks.push_back(z);
+	}
+
+	if (blocks.empty())
+		return ABSOLUTE_GATE;
+
+	double total = 0;
+	for (double z : blocks)
+		total += z;
+
+	const double gate = BlockLoudness(total / blocks.size()) + RELATIVE_GATE;
+
+	double gated = 0;
+	size_t count = 0;
+	for (double z : blocks) {
+		if (BlockLoudness(z) > gate) {
+			gated += z;
+			count++;
+		}
+	}
+
+	return count ? BlockLoudness(gated / count) : ABSOLUTE_GATE;
+}
+
+double LoudnessMeter::Peak() const
+{
+	return std::max({ m_max[0], m_max[1], -m_min[0], -m_min[1] });
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#define LOUDNESS_RATE 48000
+#define LOUDNESS_CHANNELS 2
+#define LOUDNESS_PEAK_TAPS 12 // Taps per phase of the true peak filter
+
+// Measures integrated loudness and true peak as in ITU-R BS.1770 / EBU R128.
+// Input is interleaved stereo float at 48 kHz, which is what the filter
+// coefficients are designed for. Both channels are filtered together, one per
+// lane of a vector, so each biquad step is a couple of packed instructions.
+class LoudnessMeter {
+private:
+	typedef double Lanes __attribute__((vector_size(16)));
+
+	struct Biquad {
+		double b0, b1, b2, a1, a2;
+		Lanes z1, z2;
+	};
+
+	Biquad m_shelf;
+	Biquad m_highpass;
+
+	// Sum of squares over both channels for each 100 ms step; gating blocks
+	// are made of four consecutive steps
+	std::vector<double> m_steps;
+	double m_step_sum;
+	unsigned m_step_frames;
+
+	// Recent input, newest first, stored twice so the window never wraps
+	Lanes m_history[2 * LOUDNESS_PEAK_TAPS];
+	unsigned m_history_pos;
+	Lanes m_max;
+	Lanes m_min;
+
+	inline Lanes Filter(Biquad &f, Lanes x);
+	inline void TruePeak(Lanes x);
+
+public:
+	LoudnessMeter();
+
+	void Add(const float *samples, size_t frames);
+
+	// Gated loudness in LUFS, or the absolute gate for silence
+	double Integrated() const;
+	// Linear peak of the signal oversampled 4 times
+	double Peak() const;
+};
@@ -1,21 +1,52 @@
+#include "analyzer.hpp"
+#include "cli.hpp"
 #include "config.hpp"
+#include "control.hpp"
+#include "event.hpp"
+#include "latency.hpp"
 #include "library.hpp"
+#include "playback.hpp"
 #include "player.hpp"
+#include "queue.hpp"
+#include "shuffle.hpp"
+#include "stats.hpp"
 #include "status.hpp"
 #include "termbox/termbox.h"
-extern "C" {
-#include "UTF8/UTF8.h"
-}
+#include "text.hpp"
+#include "watcher.hpp"
+#include "width.hpp"
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
 #include <cstdio>
 #include <string>
 #include <unistd.h>
 #include <stdexcept>
 #include <climits>
+#include <chrono>
+#include <random>
+#include <cerrno>
+#include <cstring>
 #include <execinfo.h>
+#include <fcntl.h>
 #include <signal.h>
 
 #define COL_REVERSE (TB_DEFAULT | TB_REVERSE)
+#define PROGRESS_TICK_MS 1000
+#define ROW_CACHE_SIZE 4096
+#define PREFETCH_ROWS 1
+#define TARGET_LOUDNESS -18.0 // LUFS, as used by ReplayGain 2.0
+#define SEEK_STEP_MS 5000
+#define SHUFFLE_BATCH 64 // Shuffle positions checked per library query
+#define INCOMPLETE_SCAN "Library scan couldn't read every directory"
+
+typedef std::chrono::steady_clock Clock;
+
+enum class ReplayGain {
+	Off,
+	Track,
+	Album,
+};
 
 enum class Mode {
 	Browse,
@@ -23,48 +54,88 @@ enum class Mode {
 	Select,
 };
 
+// Decoded and measured text for a row in the song list. Rows are laid out the
+// first time they are drawn and reused until the library list is reloaded.
+struct RowLayout {
+	Text title;
+	Text artist;
+	Text album;
+	Text length;
+};
+
 static bool g_initialized = false;
 static bool g_exit = false;
+static volatile sig_atomic_t g_terminate = 0;
+static int g_ready = -1; // Pipe to the parent of a starting daemon
 static Mode g_mode = Mode::Browse;
 static std::string g_status("");
 static std::string g_edit("");
 static unsigned g_cursor = 0;
-static Player g_player;
 static Library g_library;
 static size_t g_scroll = 0;
+static long g_pending_scroll = 0;
 static size_t g_hover = 0;
 static size_t g_browse_rows = 0;
-static size_t g_playing = INT_MAX;
+static unsigned g_playing = 0; // Song id, 0 when nothing is playing
+static bool g_paused = false;
 static std::vector<size_t> g_selection;
-
-static inline void DrawString(size_t w, size_t start_x, size_t y,
-		const std::string &s, int fg = TB_DEFAULT, int bg = TB_DEFAULT,
-		bool fill_line = true)
+static std::unordered_map<size_t, RowLayout> g_rows;
+static unsigned g_rows_generation = 0;
+static std::vector<const RowLayout *> g_visible_rows;
+static FrameStats g_frame_stats;
+static bool g_overlay = false;
+static size_t g_status_y = 0;
+static size_t g_prefetched = INT_MAX;
+static unsigned g_prefetched_generation = 0;
+static ReplayGain g_replaygain = ReplayGain::Track;
+static Queue g_queue;
+// Queue entry the preloaded song was taken from, if any
+static QueueId g_preloaded = QUEUE_NONE;
+static Shuffle g_shuffle;
+static bool g_shuffling = false;
+static uint64_t g_shuffle_size = 0; // Taken up at the start of the next pass
+// Shuffle position of the preloaded song when it came from the shuffle
+static uint64_t g_preloaded_position = 0;
+static bool g_seek_indexes = true;
+// Seek index of the playing song, loaded on the first seek
+static unsigned g_seek_id = 0;
+static uint64_t g_seek_size = 0;
+static std::vector<SeekPoint> g_seek_points;
+// Target of the last seek and the position published when it was sent, so
+// that repeated seeks add up before the player thread catches up
+static long g_seek_target = -1;
+static size_t g_seek_from = 0;
+
+static void DrawText(size_t w, size_t start_x, size_t y, const Text &text,
+		int fg = TB_DEFAULT, int bg = TB_DEFAULT, bool fill_line = true)
 {
-	size_t i = 0;
-
-	if (s.size()) {
-		utf8_iterator iter;
-		utf8_init(&iter, s.c_str());
-
-		while (utf8_next(&iter)) {
-			const size_t x = start_x + i;
-			if (x >= w)
-				break;
-			i++;
-			uint32_t ch;
-			tb_utf8_char_to_unicode(&ch, utf8_getchar(&iter));
-			tb_change_cell(x, y, ch, fg, bg);
-		}
+	size_t x = start_x;
+
+	for (const Glyph &g : text) {
+		if (x + g.width > w)
+			break;
+		tb_change_cell(x, y, g.ch, fg, bg);
+		// Termbox marks the cells covered by a wide character with 0
+		for (size_t i = 1; i < g.width; i++)
+			tb_change_cell(x + i, y, 0, fg, bg);
+		x += g.width;
 	}
 
 	if (fill_line) {
-		i += start_x;
-		for ( ; i < w; i++)
-			tb_change_cell(i, y, ' ', fg, bg);
+		for ( ; x < w; x++)
+			tb_change_cell(x, y, ' ', fg, bg);
 	}
 }
 
+static inline void DrawString(size_t w, size_t start_x, size_t y,
+		const std::string &s, int fg = TB_DEFAULT, int bg = TB_DEFAULT,
+		bool fill_line = true)
+{
+	static Text text;
+	LayoutText(text, s);
+	DrawText(w, start_x, y, text, fg, bg, fill_line);
+}
+
 static void MakeLengthString(std::string &out, unsigned length)
 {
 	const size_t n = 6;
@@ -75,7 +146,60 @@ static void MakeLengthString(std::string &out, unsigned length)
 	out = buf;
 }
 
-static void DrawSongList(size_t w, size_t start_y, size_t end_y)
+static const RowLayout &GetRowLayout(size_t idx)
+{
+	auto it = g_rows.find(idx);
+	if (it != g_rows.end())
+		return it->second;
+
+	const Song &s = g_library.At(idx);
+	RowLayout &row = g_rows[idx];
+	std::string length;
+
+	MakeLengthString(length, s.length);
+
+	LayoutText(row.title, s.title);
+	LayoutText(row.artist, s.artist);
+	LayoutText(row.album, s.album);
+	LayoutText(row.length, length);
+
+	return row;
+}
+
+// Pull the hover and scroll back inside a list that may have shrunk
+static void KeepHoverInList()
+{
+	const size_t count = g_library.Count();
+	if (g_hover >= count)
+		g_hover = count ? count - 1 : 0;
+	if (g_scroll > g_hover)
+		g_scroll = g_hover;
+}
+
+// Work out which rows are visible and make sure they are laid out
+static void LayoutSongList(size_t start_y, size_t end_y)
+{
+	if (g_rows_generation != g_library.Generation() ||
+			g_rows.size() >= ROW_CACHE_SIZE) {
+		g_rows.clear();
+		g_rows_generation = g_library.Generation();
+	}
+
+	start_y += 1;
+
+	const size_t height = end_y - start_y;
+	const size_t total = g_library.Count();
+	const size_t count = total > g_scroll ? total - g_scroll : 0;
+	const size_t rows = height < count ? height : count;
+	// An empty list or search has no rows to show
+	g_browse_rows = rows ? rows - 1 : 0;
+
+	g_visible_rows.clear();
+	for (size_t i = 0; i < rows; i++)
+		g_visible_rows.push_back(&GetRowLayout(i + g_scroll));
+}
+
+static void DrawSongList(size_t w, size_t start_y)
 {
 	const size_t title_x = 0;
 	const size_t length_w = 6;
@@ -93,38 +217,115 @@ static void DrawSongList(size_t w, size_t start_y, size_t end_y)
 
 	start_y += 1;
 
-	const size_t height = end_y - start_y;
-	const size_t count = g_library.Count() - g_scroll;
-	g_browse_rows = (height < count ? height : count) - 1;
-
-	std::string length_string;
-	length_string.reserve(length_w);
-
-	for (size_t i = 0; i <= g_browse_rows; i++) {
+	for (size_t i = 0; i < g_visible_rows.size(); i++) {
 		const size_t idx = i + g_scroll;
-		const Song &s = g_library.At(idx);
+		const RowLayout &row = *g_visible_rows[i];
+		const bool playing = g_library.At(idx).id == g_playing;
 
 		int fg, bg;
-		if (idx == g_hover && idx == g_playing) {
+		if (idx == g_hover && playing) {
 			fg = TB_GREEN;
 			bg = COL_REVERSE;
 		} else if (idx == g_hover) {
 			fg = bg = COL_REVERSE;
-		} else if (idx == g_playing) {
+		} else if (playing) {
 			fg = TB_GREEN;
 			bg = TB_DEFAULT;
 		} else {
 			fg = bg = TB_DEFAULT;
 		}
 
+		DrawText(artist_x - 1, title_x, start_y + i, row.title, fg, bg);
+		DrawText(album_x - 1, artist_x, start_y + i, row.artist, fg, bg);
+		DrawText(length_x - 1, album_x, start_y + i, row.album, fg, bg);
+		DrawText(w, length_x, start_y + i, row.length, fg, bg);
+	}
+}
 
-		MakeLengthString(length_string, s.length);
-
-		DrawString(artist_x - 1, title_x, start_y + i, s.title, fg, bg);
-		DrawString(album_x - 1, artist_x, start_y + i, s.artist, fg, bg);
-		DrawString(length_x - 1, album_x, start_y + i, s.album, fg, bg);
-		DrawString(w, length_x, start_y + i, length_string, fg, bg);
+static void DrawOverlay(size_t w)
+{
+	static std::vector<std::string> lines;
+	const size_t overlay_w = 44;
+	const size_t x = w > overlay_w ? w - overlay_w : 0;
+
+	lines.clear();
+	g_frame_stats.Summary(lines);
+
+	size_t hits, misses;
+	PlaybackCacheStats(hits, misses);
+	char buf[64];
+	snprintf(buf, sizeof(buf), "Media    %lu hits  %lu misses  %.0f%%",
+			(unsigned long)hits, (unsigned long)misses,
+			hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+	lines.push_back(buf);
+
+	const double load = PlaybackMixerLoad();
+	if (load >= 0) {
+		snprintf(buf, sizeof(buf), "Mixer    %.3f%% of real time", 100 * load);
+		lines.push_back(buf);
 	}
+
+	LatencySummary(lines);
+
+	for (size_t i = 0; i < lines.size(); i++)
+		DrawString(w, x, i + 1, " " + lines[i], TB_BLACK, TB_YELLOW);
+}
+
+// Elapsed time, a bar and the remaining time, right-aligned on the status line.
+// Returns the x position it starts at, or w if nothing is playing.
+static size_t DrawProgress(size_t w, size_t y)
+{
+	const size_t progress_w = w / 3;
+	const size_t times_w = 14;
+
+	if (!g_playing || progress_w < times_w + 4)
+		return w;
+
+	const size_t x = w - progress_w;
+	const size_t bar_w = progress_w - times_w - 2;
+	const size_t length = PlaybackLength();
+	const size_t elapsed = std::min(PlaybackPosition(), length);
+	const size_t filled = length ? bar_w * elapsed / length : 0;
+
+	std::string elapsed_str, remaining_str;
+	MakeLengthString(elapsed_str, elapsed);
+	MakeLengthString(remaining_str, length - elapsed);
+
+	std::string line = " " + elapsed_str + " [";
+	line.append(filled, '=');
+	line.append(bar_w - filled, ' ');
+	line += "] -" + remaining_str;
+
+	DrawString(w, x, y, line, COL_REVERSE, COL_REVERSE);
+
+	return x;
+}
+
+static void DrawStatusLine(size_t w, size_t y)
+{
+	const size_t progress_x = DrawProgress(w, y);
+	DrawString(progress_x, 0, y, g_status, COL_REVERSE, COL_REVERSE);
+}
+
+static uint64_t Micros(Clock::duration d)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+static void RecordFrame(Clock::time_point start, Clock::time_point laid_out,
+		Clock::time_point drawn, Clock::time_point presented)
+{
+	struct tb_present_stats present;
+	tb_get_present_stats(&present);
+
+	FrameCost cost;
+	cost.layout_us = Micros(laid_out - start);
+	cost.cells_us = Micros(drawn - laid_out);
+	cost.present_us = Micros(presented - drawn);
+	cost.cells = present.cells;
+	cost.bytes = present.bytes;
+	cost.syscalls = present.syscalls;
+	g_frame_stats.Add(cost);
 }
 
 static void Draw()
@@ -132,12 +333,18 @@ static void Draw()
 	const size_t w = tb_width();
 	const size_t h = tb_height();
 
-	const size_t status_y = g_mode == Mode::Edit ? h - 2 : h - 1;
+	g_status_y = g_mode == Mode::Edit ? h - 2 : h - 1;
 	const size_t edit_y = h - 1;
 
+	const Clock::time_point start = Clock::now();
+
+	LayoutSongList(0, g_status_y);
+
+	const Clock::time_point laid_out = Clock::now();
+
 	tb_clear();
 
-	DrawString(w, 0, status_y, g_status, COL_REVERSE, COL_REVERSE);
+	DrawStatusLine(w, g_status_y);
 
 	if (g_mode == Mode::Edit) {
 		tb_set_cursor(2 + g_cursor, edit_y);
@@ -147,20 +354,137 @@ static void Draw()
 		tb_set_cursor(TB_HIDE_CURSOR, TB_HIDE_CURSOR);
 	}
 
-	DrawSongList(w, 0, status_y);
+	DrawSongList(w, 0);
+
+	if (g_overlay)
+		DrawOverlay(w);
+
+	const Clock::time_point drawn = Clock::now();
 
 	tb_present();
+
+	RecordFrame(start, laid_out, drawn, Clock::now());
+}
+
+// Repaint just the status line on a progress tick. The rest of the back buffer
+// still holds the last full frame, so only the bar's changed cells are sent.
+static void DrawProgressTick()
+{
+	const Clock::time_point start = Clock::now();
+
+	DrawStatusLine(tb_width(), g_status_y);
+
+	const Clock::time_point drawn = Clock::now();
+
+	tb_present_rows(g_status_y, g_status_y + 1);
+
+	RecordFrame(start, start, drawn, Clock::now());
+}
+
+// The shuffle is over the range of rowids, so some may not be songs any more.
+// Finds the first of count positions from first, going forwards or backwards,
+// that is still a song, checking them a batch to a query.
+static unsigned FindShuffled(uint64_t first, uint64_t count, bool forwards,
+		uint64_t &position)
+{
+	std::vector<unsigned> ids;
+
+	for (uint64_t done = 0; done < count; done += ids.size()) {
+		ids.clear();
+		for (uint64_t i = done; i < count && ids.size() < SHUFFLE_BATCH; i++) {
+			const uint64_t p = forwards ? first + i : first - i;
+			ids.push_back(g_shuffle.Permute(p) + 1);
+		}
+
+		const size_t hit = g_library.FirstId(ids);
+		if (hit < ids.size()) {
+			position = forwards ? first + done + hit : first - done - hit;
+			return ids[hit];
+		}
+	}
+	return 0;
+}
+
+static unsigned ShuffleSong(uint64_t &position)
+{
+	return FindShuffled(position, g_shuffle.Size(), true, position);
+}
+
+static void SaveShuffle()
+{
+	g_library.SetState("shuffle", g_shuffling);
+	g_library.SetState("shuffle_seed", g_shuffle.Seed());
+	g_library.SetState("shuffle_size", g_shuffle.Size());
+	g_library.SetState("shuffle_position", g_shuffle.Position());
+}
+
+// Move on to a shuffle position. A library that has changed size is only
+// shuffled to its new size from the start of a pass, so the songs left in the
+// current one come up in the order they would have.
+static void MoveShuffle(uint64_t position)
+{
+	const uint64_t size = g_shuffle.Size();
+	if (size != g_shuffle_size && (!size || position % size == 0)) {
+		g_shuffle.Reset(g_shuffle.Seed(), g_shuffle_size,
+				size ? position / size * g_shuffle_size : 0);
+	} else {
+		g_shuffle.SetPosition(position);
+	}
+	SaveShuffle();
+}
+
+// Carry on from where the last run, or the last change to the library, left
+// off. There is only a new order when there was none.
+static void LoadShuffle()
+{
+	g_shuffling = g_library.GetState("shuffle", 0);
+	g_shuffle_size = g_library.MaxId();
+
+	const uint64_t size = g_library.GetState("shuffle_size", 0);
+	if (size) {
+		g_shuffle.Reset(g_library.GetState("shuffle_seed", 0), size,
+				g_library.GetState("shuffle_position", 0));
+	} else {
+		std::random_device rd;
+		g_shuffle.Reset(((uint64_t)rd() << 32) | rd(), g_shuffle_size);
+	}
+	MoveShuffle(g_shuffle.Position());
+}
+
+// Songs added or modified after startup go to the analyzer, which only got
+// the ones the database was missing then
+static void Analyze(const std::vector<std::string> &paths)
+{
+	if (g_seek_indexes) {
+		for (const std::string &path : paths) {
+			if (SeekIndexable(path))
+				AnalyzerAdd(AnalyzerJob::SeekIndex, path);
+		}
+	}
+	for (const std::string &path : paths)
+		AnalyzerAdd(AnalyzerJob::Loudness, path);
 }
 
 static int Execute(const std::string &query)
 {
 	if (query == "exit" || query == "quit") {
 		g_exit = true;
+	} else if (query == "clear") {
+		g_queue.Clear();
+		SetStatus("Cleared the queue");
 	} else if (query == "scan") {
-		g_library.Scan();
-		SetStatus("Scanning library on filesystem...");
+		// Asked for by hand, so nothing is taken on trust
+		std::vector<std::string> stored;
+		g_library.Scan(true, &stored);
+		Analyze(stored);
+		LoadShuffle();
+		// The scan has finished by now, so say what it found
+		SetStatus(g_library.Complete() ? "Scanned library: " +
+				std::to_string(g_library.Stats().songs) + " songs" :
+				INCOMPLETE_SCAN);
 	} else {
 		g_library.LoadSearch(query);
+		KeepHoverInList();
 	}
 
 	return 0;
@@ -175,21 +499,394 @@ static void SubmitEdit()
 		SetStatus("Invalid query: \"" + query + "\"");
 }
 
-static void PlayLibraryIndex(size_t idx)
+// The song may have been removed from the library while it plays
+static void SetPlayingStatus()
 {
-	const Song &s = g_library.At(idx);
-	g_playing = idx;
-	g_player.Open(s.path);
-	g_player.Play();
+	Song s;
+	if (!g_library.WithId(g_playing, s))
+		return;
 	SetStatus(std::string("Playing: ") + s.title + " - " +
 			s.artist + " - " + s.album);
 }
 
+// Gain in dB that brings a song to the target loudness, limited so that its
+// peak doesn't clip. Songs that haven't been analysed are left alone.
+static float SongGain(const Song &s)
+{
+	double loudness = s.loudness;
+	double peak = s.peak;
+	if (g_replaygain == ReplayGain::Off)
+		return 0;
+	// The album's peak keeps the whole album at one gain
+	if (g_replaygain == ReplayGain::Album && !std::isnan(s.album_loudness)) {
+		loudness = s.album_loudness;
+		peak = s.album_peak;
+	}
+	if (std::isnan(loudness))
+		return 0;
+
+	double gain = TARGET_LOUDNESS - loudness;
+	if (peak > 0)
+		gain = std::min(gain, -20 * std::log10(peak));
+	return gain;
+}
+
+// The song to play after the current one: the front of the queue, or else the
+// next in the shuffle or in the full library. Sets entry to the queue entry it
+// came from and position to the shuffle position.
+static unsigned NextSong(QueueId &entry, uint64_t &position)
+{
+	// Entries for songs that have left the library are dropped as they come up
+	while ((entry = g_queue.Front()) != QUEUE_NONE &&
+			!g_library.HasId(g_queue.Song(entry)))
+		g_queue.Remove(entry);
+	if (entry != QUEUE_NONE)
+		return g_queue.Song(entry);
+
+	position = g_shuffle.Position();
+	if (g_shuffling)
+		return ShuffleSong(position);
+
+	return g_playing ? g_library.NextId(g_playing) : 0;
+}
+
+// Called when song id, which NextSong() returned as coming from entry or
+// position, starts playing. The player may have advanced to a song preloaded
+// before the latest PreloadNext(), so it is only taken from where it really
+// came from: a queue entry that a later one was put in front of is still
+// found, and the shuffle only moves on past its own position.
+static void TakeNextSong(QueueId entry, uint64_t position, unsigned id)
+{
+	if (entry != QUEUE_NONE && g_queue.Song(entry) != id) {
+		for (entry = g_queue.Front(); entry != QUEUE_NONE &&
+				g_queue.Song(entry) != id; entry = g_queue.Next(entry))
+			;
+	}
+
+	if (entry != QUEUE_NONE) {
+		g_queue.Remove(entry);
+	} else if (g_shuffling && position >= g_shuffle.Position() &&
+			g_shuffle.Permute(position) + 1 == id) {
+		MoveShuffle(position + 1);
+	}
+}
+
+// Get the track after the playing one ready so it starts without a gap. Called
+// again whenever the queue changes what that is.
+static void PreloadNext()
+{
+	if (!g_playing)
+		return;
+
+	const unsigned next = NextSong(g_preloaded, g_preloaded_position);
+	Song s;
+	if (next && g_library.WithId(next, s)) {
+		PlaybackPreload(next, s.path, SongGain(s));
+	} else {
+		PlaybackPreload(0, "", 0);
+	}
+}
+
+// Get the media for the hovered row and its neighbours created and parsed,
+// since that is usually what gets played next
+static void PrefetchAroundHover()
+{
+	if (g_hover == g_prefetched &&
+			g_library.Generation() == g_prefetched_generation)
+		return;
+
+	g_prefetched = g_hover;
+	g_prefetched_generation = g_library.Generation();
+
+	const size_t count = g_library.Count();
+	const size_t first = g_hover > PREFETCH_ROWS ? g_hover - PREFETCH_ROWS : 0;
+	const size_t last = std::min(g_hover + PREFETCH_ROWS + 1, count);
+
+	// Hovered row first so it is parsed first. If the player is too busy to
+	// take it, it is tried again next time round; the neighbours are dropped.
+	if (g_hover < count && !PlaybackPrefetch(g_library.At(g_hover).path)) {
+		g_prefetched = INT_MAX;
+		return;
+	}
+	for (size_t i = first; i < last; i++) {
+		if (i != g_hover && !PlaybackPrefetch(g_library.At(i).path))
+			break;
+	}
+}
+
+// Returns false if the player wasn't asked to open the song
+static bool PlaySong(unsigned id)
+{
+	Song s;
+	if (!g_library.WithId(id, s)) {
+		SetStatus("That song is no longer in the library");
+		return false;
+	}
+	g_playing = id;
+	g_paused = false;
+	g_seek_target = -1;
+	if (!PlaybackOpen(id, s.path, SongGain(s))) {
+		SetStatus("Player is busy");
+		return false;
+	}
+	PreloadNext();
+	return true;
+}
+
+// With an index the target is turned into a byte offset, which libvlc reaches
+// by jumping straight there instead of estimating from the average bitrate
+static void SeekTo(long ms)
+{
+	if (!g_playing)
+		return;
+
+	const size_t position = PlaybackPositionMs();
+	const long length = PlaybackLength() * 1000;
+	const long target = std::max(0L, std::min(ms, length));
+
+	if (g_seek_indexes && g_seek_id != g_playing) {
+		g_seek_id = g_playing;
+		g_library.GetSeekIndex(g_playing, g_seek_size, g_seek_points);
+	}
+
+	bool sent;
+	if (g_seek_indexes && g_seek_size && g_seek_points.size()) {
+		const uint64_t offset = SeekOffset(g_seek_points, g_seek_size, target);
+		sent = PlaybackSeekFraction((double)offset / g_seek_size);
+	} else {
+		sent = PlaybackSend(PlayerCommandType::Seek, target);
+	}
+
+	if (sent) {
+		g_seek_target = target;
+		g_seek_from = position;
+	}
+}
+
+static void SeekBy(long ms)
+{
+	const size_t position = PlaybackPositionMs();
+	SeekTo((position == g_seek_from && g_seek_target >= 0 ?
+				g_seek_target : (long)position) + ms);
+}
+
+// Played from the song list by the user, so the time until it is heard is
+// traced. A trace for a play that was never sent would be finished by
+// whatever plays next, so it is dropped.
+static void PlayLibraryIndex(size_t idx)
+{
+	if (idx >= g_library.Count())
+		return;
+
+	LatencyBegin(g_library.At(idx).path, PlaybackMixerLoad() >= 0);
+	if (!PlaySong(g_library.At(idx).id))
+		LatencyCancel();
+}
+
+// Add a song to the end of the queue, or to the front to play next
+static void QueueSong(const Song &s, bool next)
+{
+	if (next)
+		g_queue.Prepend(s.id);
+	else
+		g_queue.Append(s.id);
+
+	SetStatus("Queued: " + s.title + " (" +
+			std::to_string(g_queue.Count()) + " in queue)");
+
+	if (next || g_queue.Count() == 1)
+		PreloadNext();
+}
+
+static void QueueHovered(bool next)
+{
+	if (g_hover < g_library.Count())
+		QueueSong(g_library.At(g_hover), next);
+}
+
+static void SetShuffle(bool on)
+{
+	g_shuffling = on;
+	g_library.SetState("shuffle", g_shuffling);
+	SetStatus(g_shuffling ? "Shuffle on" : "Shuffle off");
+	PreloadNext();
+}
+
+// Go back to the song before the playing one in the shuffle. The playing song
+// is at the position before the current one.
+static void PlayPreviousShuffled()
+{
+	const uint64_t position = g_shuffle.Position();
+	if (position < 2)
+		return;
+
+	uint64_t previous;
+	const unsigned id = FindShuffled(position - 2, position - 1, false,
+			previous);
+	if (id) {
+		MoveShuffle(previous + 1);
+		PlaySong(id);
+	}
+}
+
+// Returns false if there is nothing to play next
+static bool PlayNext()
+{
+	QueueId entry;
+	uint64_t position;
+	const unsigned next = NextSong(entry, position);
+	TakeNextSong(entry, position, next);
+	if (next)
+		PlaySong(next);
+	else
+		g_playing = 0;
+	return next;
+}
+
+static void HandlePlayerEvent(const PlayerEvent &ev)
+{
+	switch (ev.type) {
+	case PlayerEventType::Started:
+		if (ev.id == g_playing)
+			SetPlayingStatus();
+		break;
+
+	case PlayerEventType::Advanced:
+		TakeNextSong(g_preloaded, g_preloaded_position, ev.id);
+		g_preloaded = QUEUE_NONE;
+		g_playing = ev.id;
+		g_paused = false;
+		g_seek_target = -1;
+		SetPlayingStatus();
+		PreloadNext();
+		break;
+
+	case PlayerEventType::Finished:
+		PlayNext();
+		break;
+
+	case PlayerEventType::Error:
+		if (ev.id == g_playing) {
+			g_playing = 0;
+			LatencyCancel();
+		}
+		SetStatus(std::string("Couldn't play track: ") + ev.error);
+		break;
+	}
+}
+
+static bool ParseId(const std::string &s, unsigned &id)
+{
+	char *end;
+	const unsigned long n = strtoul(s.c_str(), &end, 10);
+	id = n;
+	return s.size() && !*end && n && n == id && g_library.HasId(id);
+}
+
+// Requests from the control socket; see control.hpp for the protocol
+static bool HandleControl(const std::string &verb, const std::string &arg,
+		std::string &reply)
+{
+	unsigned id;
+	Song s;
+
+	if (verb == "ping") {
+		return true;
+	} else if (verb == "status") {
+		// State, song id, position and length in milliseconds
+		reply = std::string(!g_playing ? "stopped" :
+				g_paused ? "paused" : "playing") + " " +
+			std::to_string(g_playing) + " " +
+			std::to_string(g_playing ? PlaybackPositionMs() : 0) + " " +
+			std::to_string(g_playing ? PlaybackLength() * 1000 : 0);
+		return true;
+	} else if (verb == "song") {
+		if (!ParseId(arg, id) || !g_library.WithId(id, s)) {
+			reply = "No such song";
+			return false;
+		}
+		reply = std::to_string(s.id) + "\t" + s.title + "\t" + s.artist + "\t" +
+			s.album + "\t" + std::to_string(s.length);
+		return true;
+	} else if (verb == "play") {
+		if (!ParseId(arg, id)) {
+			reply = "No such song";
+			return false;
+		}
+		PlaySong(id);
+		return true;
+	} else if (verb == "append" || verb == "insert") {
+		if (!ParseId(arg, id) || !g_library.WithId(id, s)) {
+			reply = "No such song";
+			return false;
+		}
+		QueueSong(s, verb == "insert");
+		reply = std::to_string(g_queue.Count());
+		return true;
+	} else if (verb == "clear") {
+		g_queue.Clear();
+		PreloadNext();
+		return true;
+	} else if (verb == "next") {
+		if (!PlayNext())
+			PlaybackSend(PlayerCommandType::Stop);
+		return true;
+	} else if (verb == "pause") {
+		if (g_playing) {
+			PlaybackSend(PlayerCommandType::Pause);
+			g_paused = !g_paused;
+		}
+		return true;
+	} else if (verb == "stop") {
+		PlaybackSend(PlayerCommandType::Stop);
+		g_playing = 0;
+		return true;
+	} else if (verb == "seek") {
+		// Relative with a sign, otherwise absolute
+		char *end;
+		const long ms = strtol(arg.c_str(), &end, 10);
+		if (arg.empty() || *end) {
+			reply = "Invalid position";
+			return false;
+		}
+		if (arg[0] == '+' || arg[0] == '-')
+			SeekBy(ms);
+		else
+			SeekTo(ms);
+		return true;
+	} else if (verb == "volume") {
+		if (arg != "up" && arg != "down") {
+			reply = "Expected up or down";
+			return false;
+		}
+		PlaybackSend(arg == "up" ? PlayerCommandType::VolumeUp :
+				PlayerCommandType::VolumeDown);
+		return true;
+	} else if (verb == "shuffle") {
+		if (arg.size() && arg != "on" && arg != "off") {
+			reply = "Expected on or off";
+			return false;
+		}
+		SetShuffle(arg.empty() ? !g_shuffling : arg == "on");
+		reply = g_shuffling ? "on" : "off";
+		return true;
+	} else if (verb == "quit") {
+		g_exit = true;
+		return true;
+	}
+
+	reply = "Unknown request";
+	return false;
+}
+
 static void SelectScreenRow(int row, bool play)
 {
 	const int y_offs = 1;
 	int select = row - y_offs + g_scroll;
 
+	if (!g_library.Count())
+		return;
+
 	if (select < 0)
 		select = 0;
 
@@ -202,29 +899,48 @@ static void SelectScreenRow(int row, bool play)
 		PlayLibraryIndex(g_hover);
 }
 
-static void ScrollDown()
+// Move the hover by n rows in a single step, keeping it on screen
+static void ScrollBy(long n)
 {
-	g_hover++;
+	const size_t count = g_library.Count();
+	if (!count || !n)
+		return;
 
-	if (g_hover >= g_library.Count())
-		g_hover = g_library.Count() - 1;
+	if (n < 0 && (size_t)-n > g_hover)
+		g_hover = 0;
+	else if (n > 0 && g_hover + n >= count)
+		g_hover = count - 1;
+	else
+		g_hover += n;
+
+	if (g_hover < g_scroll)
+		g_scroll = g_hover;
 	else if (g_hover > g_scroll + g_browse_rows)
 		g_scroll = g_hover - g_browse_rows;
 }
 
-static void ScrollUp()
+// Scroll steps are accumulated while input is drained and applied once
+static void ScrollDown()
 {
-	if (g_hover == 0)
-		return;
+	g_pending_scroll++;
+}
 
-	g_hover--;
+static void ScrollUp()
+{
+	g_pending_scroll--;
+}
 
-	if (g_hover < g_scroll)
-		g_scroll = g_hover;
+static void FlushScroll()
+{
+	ScrollBy(g_pending_scroll);
+	g_pending_scroll = 0;
 }
 
 static void ScrollToEnd()
 {
+	if (!g_library.Count())
+		return;
+
 	if (g_hover == g_library.Count() - 1) {
 		g_hover = 0;
 		g_scroll = 0;
@@ -238,7 +954,8 @@ static void HandleKeyBrowse(const int key)
 {
 	switch (key) {
 	case TB_KEY_SPACE:
-		g_player.Pause();
+		PlaybackSend(PlayerCommandType::Pause);
+		g_paused = !g_paused;
 		break;
 
 	case TB_KEY_ENTER:
@@ -246,11 +963,19 @@ static void HandleKeyBrowse(const int key)
 		break;
 
 	case TB_KEY_ARROW_UP:
-		g_player.VolumeUp();
+		PlaybackSend(PlayerCommandType::VolumeUp);
 		break;
 
 	case TB_KEY_ARROW_DOWN:
-		g_player.VolumeDown();
+		PlaybackSend(PlayerCommandType::VolumeDown);
+		break;
+
+	case TB_KEY_ARROW_LEFT:
+		SeekBy(-SEEK_STEP_MS);
+		break;
+
+	case TB_KEY_ARROW_RIGHT:
+		SeekBy(SEEK_STEP_MS);
 		break;
 
 	default:
@@ -279,6 +1004,23 @@ static void HandleCharBrowse(const int ch)
 		ScrollToEnd();
 		break;
 
+	case 'a':
+		QueueHovered(false);
+		break;
+
+	case 'n':
+		QueueHovered(true);
+		break;
+
+	case 's':
+		SetShuffle(!g_shuffling);
+		break;
+
+	case 'p':
+		if (g_shuffling)
+			PlayPreviousShuffled();
+		break;
+
 	default:
 		break;
 	}
@@ -321,11 +1063,11 @@ static void HandleKeyEdit(const int key)
 		break;
 
 	case TB_KEY_ARROW_UP:
-		g_player.VolumeUp();
+		PlaybackSend(PlayerCommandType::VolumeUp);
 		break;
 
 	case TB_KEY_ARROW_DOWN:
-		g_player.VolumeDown();
+		PlaybackSend(PlayerCommandType::VolumeDown);
 		break;
 
 	case TB_KEY_ENTER:
@@ -345,6 +1087,12 @@ static void HandleCharEdit(const int ch)
 
 static void HandleInput(const int key, const int ch)
 {
+	if (key == TB_KEY_F12) {
+		g_overlay = !g_overlay;
+		g_frame_stats.Clear();
+		return;
+	}
+
 	if (g_mode == Mode::Browse) {
 		if (key)
 			HandleKeyBrowse(key);
@@ -358,10 +1106,93 @@ static void HandleInput(const int key, const int ch)
 	}
 }
 
+static bool IsScrollEvent(const struct tb_event &ev)
+{
+	if (ev.type == TB_EVENT_MOUSE)
+		return ev.key == TB_KEY_MOUSE_WHEEL_DOWN ||
+			ev.key == TB_KEY_MOUSE_WHEEL_UP;
+
+	return ev.type == TB_EVENT_KEY && g_mode == Mode::Browse && !ev.key &&
+		(ev.ch == 'j' || ev.ch == 'k');
+}
+
+// Drain every event termbox has pending; returns true if a redraw is needed
+static bool HandleEvents()
+{
+	struct tb_event ev;
+	bool dirty = false;
+
+	while (!g_exit && tb_peek_event(&ev, 0) > 0) {
+		if (!IsScrollEvent(ev))
+			FlushScroll();
+
+		switch (ev.type) {
+		case TB_EVENT_KEY:
+			if (ev.key == TB_KEY_CTRL_Q)
+				g_exit = true;
+			else
+				HandleInput(ev.key, ev.ch);
+			break;
+
+		case TB_EVENT_MOUSE:
+			if (ev.key == TB_KEY_MOUSE_WHEEL_DOWN) {
+				ScrollDown();
+			} else if (ev.key == TB_KEY_MOUSE_WHEEL_UP) {
+				ScrollUp();
+			} else if (ev.key == TB_KEY_MOUSE_LEFT) {
+				SelectScreenRow(ev.y, false);
+			} else if (ev.key == TB_KEY_MOUSE_RIGHT) {
+				SelectScreenRow(ev.y, true);
+			}
+			break;
+
+		case TB_EVENT_RESIZE:
+		default:
+			break;
+		}
+
+		dirty = true;
+	}
+
+	FlushScroll();
+
+	return dirty;
+}
+
+static Clock::duration FramePeriod(Config &cfg)
+{
+	const unsigned fps = strtoul(cfg.Get("fps").c_str(), nullptr, 10);
+	if (!fps)
+		return Clock::duration::zero();
+	return std::chrono::duration_cast<Clock::duration>(
+			std::chrono::seconds(1)) / fps;
+}
+
+static ReplayGain ReplayGainMode(Config &cfg)
+{
+	const std::string &mode = cfg.Get("replaygain");
+	if (mode == "off")
+		return ReplayGain::Off;
+	if (mode == "album")
+		return ReplayGain::Album;
+	return ReplayGain::Track;
+}
+
+// The crossfade is given in seconds and may be fractional
+static unsigned CrossfadeMs(Config &cfg)
+{
+	const double secs = strtod(cfg.Get("crossfade").c_str(), nullptr);
+	return secs > 0 ? secs * 1000 : 0;
+}
+
 static int HandleException(const char *const msg)
 {
 	if (g_initialized)
 		tb_shutdown();
+	ControlGlobalDestroy();
+	WatcherGlobalDestroy();
+	AnalyzerGlobalDestroy();
+	PlaybackGlobalDestroy();
 	fprintf(stderr, "Juke: Uncaught exception: %s\n", msg);
 	return 1;
 }
@@ -380,11 +1211,202 @@ static void HandleSegfault(int sig)
 	exit(1);
 }
 
+// Results from the player and analyzer threads; returns true if the screen
+// needs redrawing
+static bool HandleBackground()
+{
+	bool dirty = false;
+
+	PlayerEvent player_event;
+	while (PlaybackPoll(player_event)) {
+		HandlePlayerEvent(player_event);
+		dirty = true;
+	}
+
+	// Drained in one go so that each batch is written in one transaction
+	static std::vector<AnalyzerResult> analyzed;
+	if (AnalyzerPoll(analyzed)) {
+		g_library.StoreAnalysis(analyzed);
+		for (const AnalyzerResult &result : analyzed) {
+			if (result.job == AnalyzerJob::SeekIndex)
+				g_seek_id = 0;
+		}
+	}
+
+	if (LatencyCollect() && g_overlay)
+		dirty = true;
+
+	return dirty;
+}
+
+// Bring in what the watcher saw change in the library directory
+static bool HandleLibraryChanges()
+{
+	std::vector<std::string> paths;
+	if (!WatcherPoll(paths))
+		return false;
+
+	std::vector<std::string> stored;
+	const bool changed = g_library.Update(paths, &stored);
+	Analyze(stored);
+	if (!g_library.Complete())
+		SetStatus(INCOMPLETE_SCAN);
+	if (!changed)
+		return !g_library.Complete();
+
+	LoadShuffle();
+	// The preloaded song may be one that has gone
+	PreloadNext();
+
+	KeepHoverInList();
+	return true;
+}
+
+static void RunInterface(Config &cfg)
+{
+	g_status = GetStatus();
+	Draw();
+
+	const Clock::duration frame = FramePeriod(cfg);
+	Clock::time_point next_frame = Clock::now() + frame;
+	bool dirty = false;
+	int timeout = -1;
+
+	while (!g_exit) {
+		const unsigned events = EventWait(timeout);
+
+		if (events & EVENT_INPUT)
+			dirty |= HandleEvents();
+
+		if (events & EVENT_CONTROL)
+			dirty |= ControlPoll();
+
+		if (events & EVENT_LIBRARY)
+			dirty |= HandleLibraryChanges();
+
+		dirty |= HandleBackground();
+
+		if (StatusChanged()) {
+			g_status = GetStatus();
+			dirty = true;
+		}
+
+		PrefetchAroundHover();
+
+		EventSetTick(g_playing && !g_paused ?
+				PROGRESS_TICK_MS : 0);
+
+		// Draw at most once per frame period; input arriving before the
+		// deadline is folded into the frame drawn when it expires
+		timeout = -1;
+		if (!dirty && (events & EVENT_TICK)) {
+			// A pending full frame will pick up the new position anyway
+			DrawProgressTick();
+		} else if (dirty) {
+			const Clock::time_point now = Clock::now();
+			if (now >= next_frame) {
+				Draw();
+				dirty = false;
+				next_frame = now + frame;
+			} else {
+				timeout = std::chrono::ceil<std::chrono::milliseconds>(
+						next_frame - now).count();
+			}
+		}
+	}
+}
+
+static void HandleTerminate(int)
+{
+	g_terminate = 1;
+	EventWake();
+}
+
+// Fork and carry on in the child, in a new session. The parent waits until
+// the child calls DaemonReady(), so startup errors still reach the terminal,
+// and exits with success only if it got that far.
+static void Daemonize()
+{
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC))
+		throw "Couldn't create daemon pipe";
+
+	const pid_t pid = fork();
+	if (pid < 0)
+		throw "Couldn't start daemon";
+
+	if (pid > 0) {
+		close(fds[1]);
+		char ready;
+		ssize_t n;
+		while ((n = read(fds[0], &ready, 1)) < 0 && errno == EINTR)
+			;
+		exit(n == 1 ? 0 : 1);
+	}
+
+	close(fds[0]);
+	g_ready = fds[1];
+	setsid();
+}
+
+static void DaemonReady()
+{
+	const char ready = 1;
+	if (write(g_ready, &ready, 1) != 1)
+		throw "Couldn't signal daemon startup";
+	close(g_ready);
+	g_ready = -1;
+
+	const int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+	if (null >= 0) {
+		dup2(null, STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		close(null);
+	}
+}
+
+// Playback and the library without the terminal, driven over the control
+// socket until it is told to quit or gets a termination signal
+static void RunDaemon()
+{
+	signal(SIGTERM, HandleTerminate);
+	signal(SIGINT, HandleTerminate);
+	signal(SIGHUP, SIG_IGN);
+
+	DaemonReady();
+
+	while (!g_exit && !g_terminate) {
+		const unsigned events = EventWait(-1);
+
+		if (events & EVENT_CONTROL)
+			ControlPoll();
+
+		if (events & EVENT_LIBRARY)
+			HandleLibraryChanges();
+
+		HandleBackground();
+	}
+}
+
 int main(int argc, char **argv)
 {
 	signal(SIGSEGV, HandleSegfault);
 
+	bool as_daemon = false;
+	if (argc > 1 && IsCommand(argv[1])) {
+		return RunCommand(argc, argv);
+	} else if (argc == 2 && !strcmp(argv[1], "--daemon")) {
+		as_daemon = true;
+	} else if (argc > 1) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
+
 	try {
+		if (as_daemon)
+			Daemonize();
+
 		PlayerGlobalInit();
 
 		Config cfg;
@@ -401,74 +1423,77 @@ int main(int argc, char **argv)
 			SetStatus("Juke Music Player: Using library \"" + dir + "\"");
 		}
 
-		g_library.Scan();
+		g_library.Open(cfg.Get("database"));
+		g_library.LoadFullList();
+		g_replaygain = ReplayGainMode(cfg);
+		g_queue.Open(cfg.Get("queue"));
 
-		if (tb_init()) {
-			fprintf(stderr, "Can't initialize terminal\n");
-			return 1;
-		}
-
-		g_initialized = true;
-
-		tb_select_input_mode(TB_INPUT_ESC | TB_INPUT_MOUSE);
-
-		Draw();
-
-		struct tb_event ev;
-		while (!g_exit) {
-			bool dirty = false;
-
-			if (tb_peek_event(&ev, 10)) {
-				switch (ev.type) {
-				case TB_EVENT_KEY:
-					if (ev.key == TB_KEY_CTRL_Q)
-						g_exit = true;
-					else
-						HandleInput(ev.key, ev.ch);
-					break;
-
-				case TB_EVENT_RESIZE:
-					dirty = true;
-					break;
-
-				case TB_EVENT_MOUSE:
-					if (ev.key == TB_KEY_MOUSE_WHEEL_DOWN) {
-						ScrollDown();
-					} else if (ev.key == TB_KEY_MOUSE_WHEEL_UP) {
-						ScrollUp();
-					} else if (ev.key == TB_KEY_MOUSE_LEFT) {
-						SelectScreenRow(ev.y, false);
-					} else if (ev.key == TB_KEY_MOUSE_RIGHT) {
-						SelectScreenRow(ev.y, true);
-					}
-					break;
-
-				default:
-					break;
-				}
-
-				dirty = true;
+		// The list from the last run is drawn while libvlc starts up, and the
+		// scan that needs it runs after
+		if (!as_daemon) {
+			if (tb_init()) {
+				fprintf(stderr, "Can't initialize terminal\n");
+				return 1;
 			}
 
-			if (StatusChanged()) {
-				g_status = GetStatus();
-				dirty = true;
-			}
+			g_initialized = true;
 
-			if (g_player.IsFinished()) {
-				g_player.SetFinished(false);
-				g_playing++;
-				if (g_playing < g_library.Count())
-					PlayLibraryIndex(g_playing);
-			}
+			tb_select_input_mode(TB_INPUT_ESC | TB_INPUT_MOUSE);
+			tb_set_char_width_func(CharWidth);
 
-			if (dirty)
-				Draw();
+			const std::string status = GetStatus();
+			SetStatus("Scanning library on filesystem...");
+			g_status = GetStatus();
+			Draw();
+			SetStatus(status);
 		}
 
+		g_library.Scan(false);
+		LoadShuffle();
+		if (!g_library.Complete())
+			SetStatus(INCOMPLETE_SCAN);
+
+		EventGlobalInit();
+		PlaybackGlobalInit(CrossfadeMs(cfg), cfg.Get("wav_output"));
+		if (!as_daemon) {
+			EventWatchInput(tb_input_fd());
+			EventWatchInput(tb_resize_fd());
+		}
+
+		// Only one instance can be controlled, and a daemon is useless
+		// without its socket
+		if (!ControlGlobalInit(cfg.Get("socket"), HandleControl)) {
+			if (as_daemon)
+				throw "Juke is already running";
+			SetStatus("Juke is already running elsewhere; "
+					"remote control is off");
+		}
+
+		if (cfg.Get("watch") != "off" && !WatcherGlobalInit("."))
+			SetStatus("Can't watch the library for changes; use scan");
+
+		g_seek_indexes = cfg.Get("seek_index") != "off";
+		AnalyzerGlobalInit(g_library.Unanalyzed(), g_seek_indexes ?
+				g_library.Unindexed() : std::vector<std::string>());
+
+		if (cfg.Get("frame_log").size())
+			g_frame_stats.OpenLog(cfg.Get("frame_log"));
+		if (cfg.Get("latency_log").size())
+			LatencyOpenLog(cfg.Get("latency_log"));
+
+		if (as_daemon)
+			RunDaemon();
+		else
+			RunInterface(cfg);
+
 		if (g_initialized)
 			tb_shutdown();
 
+		ControlGlobalDestroy();
+		WatcherGlobalDestroy();
+		AnalyzerGlobalDestroy();
+		PlaybackGlobalDestroy();
+		EventGlobalDestroy();
 		PlayerGlobalDestroy();
 	} catch (const char *const s) {
 		return HandleException(s);
@@ -0,0 +1,318 @@
+#include "mixer.hpp"
+#include "latency.hpp"
+#include <chrono>
+#include <vector>
+#include <unistd.h>
+
+#define MIXER_BLOCK 1024 // Frames mixed at a time
+#define MIXER_WAIT_US 1000
+#define GAIN_STEPS 4095.0f
+
+typedef std::chrono::steady_clock Clock;
+
+Mixer::Mixer(AudioSink *sink)
+	: m_sink(sink)
+	, m_quit(false)
+	, m_ramp_seq(0)
+	, m_busy_ns(0)
+	, m_frames(0)
+	, m_idle(false)
+{
+	for (Stream &s : m_streams) {
+		s.mixer = this;
+		s.ramp = 0;
+		s.flush = false;
+		s.active = false;
+		s.drained = false;
+		s.follow = false;
+		s.ramp_seen = 0;
+		s.gain = s.target = 1.0f;
+		s.step = 0.0f;
+		s.ramp_left = 0;
+	}
+
+	m_thread = std::thread(&Mixer::Run, this);
+}
+
+Mixer::~Mixer()
+{
+	m_quit = true;
+	Wake();
+	m_thread.join();
+	delete m_sink;
+}
+
+void Mixer::Attach(libvlc_media_player_t *player, unsigned stream)
+{
+	libvlc_audio_set_format(player, "FL32", MIXER_RATE, MIXER_CHANNELS);
+	libvlc_audio_set_callbacks(player, Play, Pause, Resume, Flush, Drain,
+			&m_streams[stream]);
+}
+
+// Requests are packed into one word so that any thread can post one without
+// a lock: 8 bits of sequence number, 12 bits each for the start and end gains
+// and 32 bits for the length
+void Mixer::SetGain(unsigned stream, float from, float to, size_t frames)
+{
+	const uint64_t seq = (m_ramp_seq++ & 0xff) + 1;
+	const uint64_t f = (uint64_t)(from * GAIN_STEPS) & 0xfff;
+	const uint64_t t = (uint64_t)(to * GAIN_STEPS) & 0xfff;
+	const uint64_t n = frames > UINT32_MAX ? UINT32_MAX : frames;
+	m_streams[stream].ramp = seq << 56 | f << 44 | t << 32 | n;
+}
+
+void Mixer::Follow(unsigned stream)
+{
+	SetGain(stream, 1, 1, 0);
+	m_streams[stream].follow = true;
+}
+
+double Mixer::Load() const
+{
+	const uint64_t frames = m_frames;
+	if (!frames)
+		return 0;
+	return m_busy_ns / (frames * 1e9 / MIXER_RATE);
+}
+
+void Mixer::Play(void *data, const void *samples, unsigned count, int64_t pts)
+{
+	Stream *s = (Stream *)data;
+	const float *in = (const float *)samples;
+	size_t n = count * MIXER_CHANNELS;
+
+	s->active = true;
+	s->drained = false;
+
+	LatencyMark(PlayStage::FirstAudio);
+
+	// Libvlc delivers audio roughly in real time, so the ring only fills up
+	// when the sink is slow; wait for it rather than dropping audio
+	while (n && !s->mixer->m_quit) {
+		const size_t written = s->ring.Write(in, n);
+		in += written;
+		n -= written;
+		s->mixer->Wake();
+		if (n)
+			usleep(MIXER_WAIT_US);
+	}
+}
+
+void Mixer::Pause(void *data, int64_t pts)
+{
+	((Stream *)data)->active = false;
+}
+
+void Mixer::Resume(void *data, int64_t pts)
+{
+	Stream *s = (Stream *)data;
+	s->active = true;
+	s->mixer->Wake();
+}
+
+void Mixer::Flush(void *data, int64_t pts)
+{
+	Stream *s = (Stream *)data;
+	if (s->drained)
+		return;
+
+	s->flush = true;
+	s->mixer->Wake();
+	while (s->flush && !s->mixer->m_quit)
+		usleep(MIXER_WAIT_US);
+}
+
+// Returns straight away so that the end of the track is reported while its
+// last samples are still in the ring, giving the next deck time to start
+void Mixer::Drain(void *data)
+{
+	Stream *s = (Stream *)data;
+	s->active = false;
+	s->drained = true;
+	s->mixer->Wake();
+}
+
+// The lock is only taken when the mixer is asleep, so the callbacks don't
+// contend with it while audio is flowing. The fences pair with the one in
+// WaitForWork(): either the mixer sees what changed before it sleeps, or the
+// caller sees it asleep and wakes it.
+void Mixer::Wake()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_idle) {
+		std::lock_guard<std::mutex> lock(m_idle_mutex);
+		m_idle_cond.notify_one();
+	}
+}
+
+void Mixer::WaitForWork()
+{
+	std::unique_lock<std::mutex> lock(m_idle_mutex);
+	m_idle = true;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	bool flush = false;
+	for (Stream &s : m_streams)
+		flush |= s.flush;
+
+	if (!m_quit && !flush && !FramesReady())
+		m_idle_cond.wait(lock);
+	m_idle = false;
+}
+
+// How many frames to mix next, or 0 to wait. A real-time sink takes a block
+// whenever anything is playing and silence fills any underrun. Otherwise the
+// mixer waits until every active stream has a full block, so the output
+// doesn't depend on thread timing.
+size_t Mixer::FramesReady()
+{
+	bool any_active = false;
+	bool short_active = false;
+	size_t most = 0;
+
+	for (Stream &s : m_streams) {
+		const size_t avail = s.ring.Size() / MIXER_CHANNELS;
+		if (s.active) {
+			any_active = true;
+			short_active |= avail < MIXER_BLOCK;
+		}
+		most = std::max(most, std::min(avail, (size_t)MIXER_BLOCK));
+	}
+
+	if (m_sink->IsRealTime())
+		return any_active || most ? MIXER_BLOCK : 0;
+
+	if (short_active)
+		return 0;
+	return any_active ? MIXER_BLOCK : most;
+}
+
+void Mixer::UpdateRamp(Stream &s)
+{
+	const uint64_t ramp = s.ramp;
+	if (ramp == s.ramp_seen)
+		return;
+	s.ramp_seen = ramp;
+
+	const float from = ((ramp >> 44) & 0xfff) / GAIN_STEPS;
+	const float to = ((ramp >> 32) & 0xfff) / GAIN_STEPS;
+	const size_t frames = ramp & 0xffffffff;
+
+	s.target = to;
+	s.ramp_left = frames;
+	s.gain = frames ? from : to;
+	s.step = frames ? (to - from) / frames : 0.0f;
+}
+
+// The gain is worked out from the frame index rather than accumulated, so the
+// loop has no carried dependency and the compiler can vectorize it. The index
+// is an int because x86 has no packed conversion from unsigned 64-bit.
+static void MixRamp(float *out, const float *in, int frames, float gain,
+		float step)
+{
+	for (int i = 0; i < frames; i++) {
+		const float g = gain + step * (float)i;
+		for (int c = 0; c < MIXER_CHANNELS; c++)
+			out[i * MIXER_CHANNELS + c] += in[i * MIXER_CHANNELS + c] * g;
+	}
+}
+
+static void MixConstant(float *out, const float *in, size_t samples, float gain)
+{
+	for (size_t i = 0; i < samples; i++)
+		out[i] += in[i] * gain;
+}
+
+void Mixer::MixStream(Stream &s, float *out, const float *in, size_t frames)
+{
+	size_t done = 0;
+
+	if (s.ramp_left) {
+		done = std::min(s.ramp_left, frames);
+		MixRamp(out, in, done, s.gain, s.step);
+		s.ramp_left -= done;
+		s.gain = s.ramp_left ? s.gain + s.step * done : s.target;
+	}
+
+	if (done < frames && s.gain != 0.0f) {
+		MixConstant(out + done * MIXER_CHANNELS, in + done * MIXER_CHANNELS,
+				(frames - done) * MIXER_CHANNELS, s.gain);
+	}
+}
+
+// Whole frames only; the last sample can be missing if the writer was part
+// way through a frame
+size_t Mixer::ReadStream(Stream &s, float *in, size_t frames)
+{
+	const size_t want = std::min(s.ring.Size(), frames * MIXER_CHANNELS);
+	return s.ring.Read(in, want - want % MIXER_CHANNELS) / MIXER_CHANNELS;
+}
+
+// Whether a finished track still has audio waiting to be mixed
+bool Mixer::HasTail()
+{
+	for (Stream &s : m_streams) {
+		if (s.drained && !s.follow && s.ring.Size() >= MIXER_CHANNELS)
+			return true;
+	}
+	return false;
+}
+
+void Mixer::Run()
+{
+	std::vector<float> in(MIXER_BLOCK * MIXER_CHANNELS);
+	std::vector<float> out(MIXER_BLOCK * MIXER_CHANNELS);
+
+	while (!m_quit) {
+		for (Stream &s : m_streams) {
+			// A stopped deck mustn't be waited on for a block that won't
+			// come, so it is idle until libvlc plays into it again
+			if (s.flush) {
+				s.ring.Clear();
+				s.active = false;
+				s.drained = false;
+				s.flush = false;
+			}
+		}
+
+		const size_t frames = FramesReady();
+		if (!frames) {
+			WaitForWork();
+			continue;
+		}
+
+		const Clock::time_point start = Clock::now();
+
+		std::fill(out.begin(), out.begin() + frames * MIXER_CHANNELS, 0.0f);
+
+		// Tails of finished tracks go first and any stream following
+		// them starts where the longest one stops
+		size_t tail = 0;
+		for (Stream &s : m_streams) {
+			if (s.follow)
+				continue;
+			UpdateRamp(s);
+			const size_t got = ReadStream(s, in.data(), frames);
+			MixStream(s, out.data(), in.data(), got);
+			if (s.drained)
+				tail = std::max(tail, got);
+		}
+
+		const bool has_tail = HasTail();
+		for (Stream &s : m_streams) {
+			if (!s.follow)
+				continue;
+			UpdateRamp(s);
+			const size_t got = ReadStream(s, in.data(), frames - tail);
+			MixStream(s, out.data() + tail * MIXER_CHANNELS, in.data(), got);
+			if (!has_tail)
+				s.follow = false;
+		}
+
+		m_busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+				Clock::now() - start).count();
+
+		m_sink->Write(out.data(), frames);
+		m_frames += frames;
+	}
+}
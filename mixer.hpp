@@ -0,0 +1,96 @@
+#pragma once
+
+#include "sink.hpp"
+#include "spsc.hpp"
+#include <vlc/vlc.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+
+#define MIXER_RATE 44100
+#define MIXER_CHANNELS 2
+#define MIXER_STREAMS 2
+#define MIXER_RING_SIZE 65536 // Samples per stream, about 0.75 seconds
+
+// Mixes the decoded audio of the player's decks so that one track can fade
+// into the next. Libvlc hands each deck's PCM to the audio callbacks on its
+// decoder thread, and a ring per stream carries it to the mixer thread, which
+// applies the gains and writes the sum to the sink.
+class Mixer {
+private:
+	struct Stream {
+		Mixer *mixer;
+		SpscRing<float, MIXER_RING_SIZE> ring;
+		// Latest gain change, packed by SetGain()
+		std::atomic<uint64_t> ramp;
+		// Set by libvlc's flush callback until the mixer has emptied the ring
+		std::atomic<bool> flush;
+		// Set while libvlc is delivering audio for the stream
+		std::atomic<bool> active;
+		// Set once the track has ended; what is left in the ring is its
+		// tail, which still has to be played
+		std::atomic<bool> drained;
+		// Start straight after the tails of drained streams, not on top
+		std::atomic<bool> follow;
+
+		// Only used by the mixer thread
+		uint64_t ramp_seen;
+		float gain;
+		float target;
+		float step;
+		size_t ramp_left;
+	};
+
+	Stream m_streams[MIXER_STREAMS];
+	AudioSink *m_sink;
+	std::thread m_thread;
+	std::atomic<bool> m_quit;
+	std::atomic<unsigned> m_ramp_seq;
+	std::atomic<uint64_t> m_busy_ns;
+	std::atomic<uint64_t> m_frames;
+
+	// The mixer thread sleeps here while there is nothing to mix, and the
+	// callbacks wake it when that may have changed
+	std::mutex m_idle_mutex;
+	std::condition_variable m_idle_cond;
+	std::atomic<bool> m_idle;
+
+	void Run();
+	void Wake();
+	void WaitForWork();
+	size_t FramesReady();
+	void UpdateRamp(Stream &s);
+	void MixStream(Stream &s, float *out, const float *in, size_t frames);
+	size_t ReadStream(Stream &s, float *in, size_t frames);
+	bool HasTail();
+
+	static void Play(void *data, const void *samples, unsigned count,
+			int64_t pts);
+	static void Pause(void *data, int64_t pts);
+	static void Resume(void *data, int64_t pts);
+	static void Flush(void *data, int64_t pts);
+	static void Drain(void *data);
+
+public:
+	// Takes ownership of the sink
+	Mixer(AudioSink *sink);
+	~Mixer();
+
+	Mixer(const Mixer &m) = delete;
+
+	// Route a media player's decoded audio into one of the streams
+	void Attach(libvlc_media_player_t *player, unsigned stream);
+
+	// Ramp a stream's gain from `from` to `to` over `frames` frames, or
+	// set it straight away if frames is 0. Safe to call from any thread.
+	void SetGain(unsigned stream, float from, float to, size_t frames);
+
+	// Play a stream at full gain once the other streams' remaining audio
+	// has been mixed, for gapless changes without a crossfade
+	void Follow(unsigned stream);
+
+	// Time spent mixing as a fraction of the audio produced
+	double Load() const;
+};
@@ -0,0 +1,187 @@
+#include "parser.hpp"
+#include "player.hpp"
+#include <cstdlib>
+
+#define PARSE_FLAGS \
+	(libvlc_media_parse_flag_t)(libvlc_media_parse_local | libvlc_media_fetch_local)
+// Status of a parse that is still running
+#define NOT_REPORTED 0
+
+static void MediaParsedCallback(const libvlc_event_t *const ev, void *data)
+{
+	ParserItem *item = (ParserItem *)data;
+	item->parser->MediaParsed(item,
+			(libvlc_media_parsed_status_t)ev->u.media_parsed_changed.new_status);
+}
+
+static std::string Meta(libvlc_media_t *media, libvlc_meta_t meta)
+{
+	char *const s = libvlc_media_get_meta(media, meta);
+	std::string str(s ? s : "");
+	free(s);
+	return str;
+}
+
+Parser::Parser(unsigned in_flight, unsigned timeout_ms)
+	: m_in_flight(in_flight ? in_flight : 1)
+	, m_timeout_ms(timeout_ms)
+{}
+
+Parser::~Parser()
+{
+	ParseResult r;
+	while (m_active.size())
+		Finish(m_active.front(), r);
+}
+
+// Runs on libvlc's thread. Done, failed, skipped and timed out are all final.
+void Parser::MediaParsed(ParserItem *item, libvlc_media_parsed_status_t status)
+{
+	if (status == NOT_REPORTED)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	item->status = status;
+	m_finished.push_back(item);
+	m_cond.notify_one();
+}
+
+// Start queued files until every slot is busy. The parse may be reported
+// before parse_with_options returns, so no lock is held here.
+void Parser::Fill()
+{
+	libvlc_instance_t *const inst = m_pending.size() ? ParseInstance() : nullptr;
+
+	while (m_pending.size() && !Full()) {
+		std::string path = std::move(m_pending.front());
+		m_pending.pop_front();
+
+		libvlc_media_t *media = libvlc_media_new_path(inst, path.c_str());
+		if (!media) {
+			m_failed.push_back(ParseResult{ path, MediaTags(),
+					"Cannot open media file" });
+			continue;
+		}
+
+		// Libvlc's timeout only starts once its preparser picks the file up,
+		// and the files ahead of it are parsed first, so the backstop allows
+		// for a full queue
+		m_active.push_back(ParserItem{ this, std::move(path), media,
+				Clock::now() + std::chrono::milliseconds(
+					(uint64_t)m_timeout_ms * (m_in_flight + 1)),
+				(libvlc_media_parsed_status_t)NOT_REPORTED });
+		ParserItem &item = m_active.back();
+
+		libvlc_event_attach(libvlc_media_event_manager(media),
+				libvlc_MediaParsedChanged, MediaParsedCallback, &item);
+		if (libvlc_media_parse_with_options(media, PARSE_FLAGS, m_timeout_ms))
+			MediaParsed(&item, libvlc_media_parsed_status_failed);
+	}
+}
+
+// Read the tags of a reported item, or stop one that never was, and free it
+void Parser::Finish(ParserItem &item, ParseResult &r)
+{
+	// Detaching waits for a callback in progress, so the item can't be
+	// reported after this
+	libvlc_event_detach(libvlc_media_event_manager(item.media),
+			libvlc_MediaParsedChanged, MediaParsedCallback, &item);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto it = m_finished.begin(); it != m_finished.end(); ++it) {
+			if (*it == &item) {
+				m_finished.erase(it);
+				break;
+			}
+		}
+	}
+
+	r.path = std::move(item.path);
+	r.tags = MediaTags();
+	libvlc_time_t length;
+
+	switch ((int)item.status) {
+	case libvlc_media_parsed_status_done:
+		r.error = nullptr;
+		r.tags.title = Meta(item.media, libvlc_meta_Title);
+		r.tags.artist = Meta(item.media, libvlc_meta_Artist);
+		r.tags.album = Meta(item.media, libvlc_meta_Album);
+		r.tags.track = strtoul(Meta(item.media, libvlc_meta_TrackNumber).c_str(),
+				nullptr, 10);
+		length = libvlc_media_get_duration(item.media);
+		r.tags.length = length > 0 ? length / 1000 : 0;
+		break;
+	case libvlc_media_parsed_status_timeout:
+	case NOT_REPORTED:
+		r.error = "Timed out reading media file";
+		break;
+	default:
+		r.error = "Cannot parse media file";
+		break;
+	}
+
+	if (item.status == NOT_REPORTED)
+		libvlc_media_parse_stop(item.media);
+	libvlc_media_release(item.media);
+
+	for (auto it = m_active.begin(); it != m_active.end(); ++it) {
+		if (&*it == &item) {
+			m_active.erase(it);
+			break;
+		}
+	}
+}
+
+void Parser::Add(const std::string &path)
+{
+	m_pending.push_back(path);
+	Fill();
+}
+
+bool Parser::Next(ParseResult &r, bool wait)
+{
+	while (1) {
+		if (m_failed.size()) {
+			r = std::move(m_failed.front());
+			m_failed.pop_front();
+			return true;
+		}
+
+		if (m_active.empty())
+			return false;
+
+		Clock::time_point deadline = m_active.front().deadline;
+		for (const ParserItem &item : m_active)
+			deadline = std::min(deadline, item.deadline);
+
+		ParserItem *item = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (wait) {
+				m_cond.wait_until(lock, deadline,
+						[this]() { return m_finished.size(); });
+			}
+			if (m_finished.size())
+				item = m_finished.front();
+		}
+
+		// A parse libvlc hasn't reported by its deadline is given up on
+		if (!item && Clock::now() >= deadline) {
+			for (ParserItem &i : m_active) {
+				if (i.deadline <= deadline) {
+					item = &i;
+					break;
+				}
+			}
+		}
+
+		if (item) {
+			Finish(*item, r);
+			Fill();
+			return true;
+		}
+
+		if (!wait)
+			return false;
+	}
+}
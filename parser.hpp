@@ -0,0 +1,74 @@
+#pragma once
+
+#include "song.hpp"
+#include <vlc/vlc.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+
+class Parser;
+
+// A file being parsed, which libvlc's callback reports back to its parser
+struct ParserItem {
+	Parser *parser;
+	std::string path;
+	libvlc_media_t *media;
+	std::chrono::steady_clock::time_point deadline; // For the backstop
+	libvlc_media_parsed_status_t status;
+};
+
+struct ParseResult {
+	std::string path;
+	MediaTags tags;
+	const char *error; // Null if the file was parsed
+};
+
+// Reads tags with the parse-only libvlc instance, keeping several files in
+// flight so libvlc's preparser never sits idle waiting for us. A file is done
+// when libvlc reports it through MediaParsedChanged, and only then are its tags
+// read. Libvlc times out each parse itself; a parse it never reports is
+// stopped once its deadline passes.
+class Parser {
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	unsigned m_in_flight;
+	unsigned m_timeout_ms;
+	std::deque<std::string> m_pending;
+	// Only touched by the owning thread; libvlc's threads see items through
+	// m_finished
+	std::list<ParserItem> m_active;
+	std::deque<ParseResult> m_failed;
+
+	// Items libvlc has reported, in the order it did
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<ParserItem *> m_finished;
+
+	void Fill();
+	void Finish(ParserItem &item, ParseResult &r);
+
+public:
+	Parser(unsigned in_flight, unsigned timeout_ms);
+	~Parser();
+
+	Parser(const Parser &p) = delete;
+
+	Parser(Parser &&p) = delete;
+
+	// Queue a file, starting its parse if fewer than in_flight are running
+	void Add(const std::string &path);
+
+	// Take a finished file, in no particular order. With wait set this blocks
+	// until one finishes; it returns false if there is none ready, or when
+	// waiting, none left at all.
+	bool Next(ParseResult &r, bool wait);
+
+	// Whether every slot is busy, so that Add would only queue
+	inline bool Full() const { return m_active.size() >= m_in_flight; }
+
+	void MediaParsed(ParserItem *item, libvlc_media_parsed_status_t status);
+};
@@ -0,0 +1,253 @@
+#include "playback.hpp"
+#include "event.hpp"
+#include "mixer.hpp"
+#include "player.hpp"
+#include "spsc.hpp"
+#include <atomic>
+#include <thread>
+#include <cerrno>
+#include <cstdint>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define QUEUE_SIZE 64
+#define POSITION_POLL_MS 250
+
+static std::thread g_thread;
+static Mixer *g_mixer = nullptr;
+static unsigned g_crossfade_ms = 0;
+static int g_wake = -1;
+static SpscQueue<PlayerCommand, QUEUE_SIZE> g_commands;
+static SpscQueue<PlayerEvent, QUEUE_SIZE> g_events;
+static std::atomic<size_t> g_position(0);
+static std::atomic<size_t> g_length(0);
+static std::atomic<size_t> g_cache_hits(0);
+static std::atomic<size_t> g_cache_misses(0);
+
+// Wake the player thread; called from the UI and from libvlc's callbacks
+static void Wake()
+{
+	const uint64_t n = 1;
+	ssize_t r = write(g_wake, &n, sizeof(n));
+	(void)r;
+}
+
+static void Emit(PlayerEventType type, size_t id, const char *error = nullptr)
+{
+	// The UI drains every event each time it wakes, so the queue can only
+	// fill up if it has stopped; dropping the event is harmless then
+	if (g_events.Push(PlayerEvent{ type, id, error }))
+		EventWake();
+}
+
+static void Run()
+{
+	Player player;
+	player.SetNotify(Wake);
+	player.SetMixer(g_mixer, g_crossfade_ms);
+
+	size_t current = 0;
+	size_t next = 0;
+	bool playing = false;
+	bool paused = false;
+	bool quit = false;
+
+	while (!quit) {
+		struct pollfd pfd = { g_wake, POLLIN, 0 };
+		const int timeout = playing && !paused ? POSITION_POLL_MS : -1;
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+			break;
+
+		uint64_t n;
+		while (read(g_wake, &n, sizeof(n)) > 0)
+			;
+
+		PlayerCommand cmd;
+		while (!quit && g_commands.Pop(cmd)) {
+			try {
+				switch (cmd.type) {
+				case PlayerCommandType::Open:
+					player.Open(cmd.path, cmd.gain);
+					player.Play();
+					current = cmd.id;
+					playing = true;
+					paused = false;
+					Emit(PlayerEventType::Started, current);
+					break;
+
+				case PlayerCommandType::Preload:
+					if (cmd.path.size())
+						player.Preload(cmd.path, cmd.gain);
+					else
+						player.ClearPreload();
+					next = cmd.id;
+					break;
+
+				case PlayerCommandType::Prefetch:
+					player.Prefetch(cmd.path);
+					break;
+
+				case PlayerCommandType::Pause:
+					player.Pause();
+					paused = !paused;
+					break;
+
+				case PlayerCommandType::Stop:
+					player.Stop();
+					playing = false;
+					break;
+
+				case PlayerCommandType::Seek:
+					player.SetPosition(cmd.arg);
+					break;
+
+				case PlayerCommandType::SeekFraction:
+					player.SetPercentage(cmd.fraction);
+					break;
+
+				case PlayerCommandType::VolumeUp:
+					player.VolumeUp();
+					break;
+
+				case PlayerCommandType::VolumeDown:
+					player.VolumeDown();
+					break;
+
+				case PlayerCommandType::Quit:
+					quit = true;
+					break;
+				}
+			} catch (const char *const s) {
+				// A track that fails to preload is opened normally when the
+				// current one ends, so only report failed opens
+				if (cmd.type == PlayerCommandType::Open) {
+					playing = false;
+					Emit(PlayerEventType::Error, cmd.id, s);
+				}
+			}
+		}
+
+		try {
+			player.Update();
+		} catch (const char *const) {
+			// A failed preload is retried by the normal open at the end
+		}
+
+		if (player.PollAdvanced()) {
+			current = next;
+			Emit(PlayerEventType::Advanced, current);
+		}
+
+		if (player.IsFinished()) {
+			player.SetFinished(false);
+			playing = false;
+			Emit(PlayerEventType::Finished, current);
+		}
+
+		g_position = player.GetPosition();
+		g_length = player.GetLength();
+		g_cache_hits = player.CacheHits();
+		g_cache_misses = player.CacheMisses();
+	}
+}
+
+void PlaybackGlobalInit(unsigned crossfade_ms, const std::string &wav_output)
+{
+	if ((g_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		throw "Couldn't create player wake event";
+
+	g_crossfade_ms = crossfade_ms;
+	if (crossfade_ms || wav_output.size()) {
+		g_mixer = new Mixer(wav_output.size() ?
+				OpenWavSink(wav_output) : OpenDeviceSink());
+	}
+
+	g_thread = std::thread(Run);
+}
+
+void PlaybackGlobalDestroy()
+{
+	if (!g_thread.joinable())
+		return;
+
+	while (!PlaybackSend(PlayerCommandType::Quit))
+		std::this_thread::yield();
+
+	g_thread.join();
+	close(g_wake);
+	g_wake = -1;
+
+	// The player and its callbacks are gone, so nothing feeds the mixer now
+	delete g_mixer;
+	g_mixer = nullptr;
+}
+
+static bool Send(PlayerCommand &&cmd)
+{
+	if (!g_commands.Push(std::move(cmd)))
+		return false;
+	Wake();
+	return true;
+}
+
+bool PlaybackOpen(size_t id, const std::string &path, float gain)
+{
+	return Send(PlayerCommand{ PlayerCommandType::Open, id, path, 0, gain, 0 });
+}
+
+bool PlaybackPreload(size_t id, const std::string &path, float gain)
+{
+	return Send(PlayerCommand{ PlayerCommandType::Preload, id, path, 0, gain, 0 });
+}
+
+bool PlaybackPrefetch(const std::string &path)
+{
+	// Prefetches are only hints, so they leave half the queue to the commands
+	// that matter
+	if (g_commands.Size() >= QUEUE_SIZE / 2)
+		return false;
+	return Send(PlayerCommand{ PlayerCommandType::Prefetch, 0, path, 0, 0, 0 });
+}
+
+bool PlaybackSend(PlayerCommandType type, long arg)
+{
+	return Send(PlayerCommand{ type, 0, "", arg, 0, 0 });
+}
+
+bool PlaybackSeekFraction(double fraction)
+{
+	return Send(PlayerCommand{ PlayerCommandType::SeekFraction, 0, "", 0, 0,
+			fraction });
+}
+
+bool PlaybackPoll(PlayerEvent &ev)
+{
+	return g_events.Pop(ev);
+}
+
+size_t PlaybackPosition()
+{
+	return g_position / 1000;
+}
+
+size_t PlaybackPositionMs()
+{
+	return g_position;
+}
+
+size_t PlaybackLength()
+{
+	return g_length;
+}
+
+double PlaybackMixerLoad()
+{
+	return g_mixer ? g_mixer->Load() : -1.0;
+}
+
+void PlaybackCacheStats(size_t &hits, size_t &misses)
+{
+	hits = g_cache_hits;
+	misses = g_cache_misses;
+}
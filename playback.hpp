@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// Playback runs on its own thread so that creating and parsing media never
+// blocks the UI. The UI sends commands and receives events through a pair of
+// lock-free queues; only the UI thread may call the functions below.
+
+enum class PlayerCommandType {
+	Open,
+	Preload,
+	Prefetch,
+	Pause,
+	Stop,
+	Seek,
+	SeekFraction,
+	VolumeUp,
+	VolumeDown,
+	Quit,
+};
+
+struct PlayerCommand {
+	PlayerCommandType type;
+	size_t id; // Caller's identifier for Open/Preload, echoed back in events
+	std::string path;
+	long arg; // Seek target in milliseconds
+	float gain; // Replay gain in dB for Open/Preload
+	double fraction; // SeekFraction target as a fraction of the file
+};
+
+enum class PlayerEventType {
+	Started, // An Open command succeeded and the track is playing
+	Advanced, // The preloaded track took over from the one that ended
+	Finished, // The track ended with nothing preloaded
+	Error, // An Open command failed
+};
+
+struct PlayerEvent {
+	PlayerEventType type;
+	size_t id;
+	const char *error;
+};
+
+// Audio goes through the mixer if crossfading or writing a WAV file, and
+// straight out of libvlc otherwise
+void PlaybackGlobalInit(unsigned crossfade_ms, const std::string &wav_output);
+void PlaybackGlobalDestroy();
+
+// Queue a command for the player thread. These return false if the queue is
+// full, which only happens if the player thread is stuck. Preloading an empty
+// path drops whatever was preloaded. Prefetching is best-effort and is refused
+// once the queue is half full, so it never crowds out Open or Preload.
+bool PlaybackOpen(size_t id, const std::string &path, float gain);
+bool PlaybackPreload(size_t id, const std::string &path, float gain);
+bool PlaybackPrefetch(const std::string &path);
+bool PlaybackSend(PlayerCommandType type, long arg = 0);
+bool PlaybackSeekFraction(double fraction);
+
+// Take the next event from the player thread, returning false if there are none
+bool PlaybackPoll(PlayerEvent &ev);
+
+// Position and length of the current track in seconds, as last published by
+// the player thread
+size_t PlaybackPosition();
+size_t PlaybackLength();
+size_t PlaybackPositionMs();
+
+// Time spent mixing as a fraction of real time, or negative without a mixer
+double PlaybackMixerLoad();
+
+// Lookups of the player thread's media cache by Open and Preload commands
+void PlaybackCacheStats(size_t &hits, size_t &misses);
@@ -1,100 +1,433 @@
 #include "player.hpp"
+#include "latency.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <future>
 
 #define PARSE_FLAGS \
 	(libvlc_media_parse_flag_t)(libvlc_media_parse_local | libvlc_media_fetch_local)
 #define VOLUME_STEP 5
+#define MEDIA_CACHE_SIZE 16
+#define MAX_VOLUME 200
+
+// Outputs the parse instance never opens, so their plugins aren't loaded
+static const char *const g_parse_args[] = {
+	"--intf=dummy", "--vout=dummy", "--aout=adummy", "--no-video",
+	"--no-lua", "--no-stats",
+};
 
 static libvlc_instance_t *g_inst = nullptr;
+static libvlc_instance_t *g_parse_inst = nullptr;
+static std::shared_future<void> g_init;
+static std::atomic<bool> g_ready(false);
 
-void PlayerGlobalInit()
+static void Init()
 {
 	if (!(g_inst = libvlc_new(0, nullptr)))
 		throw "Couldn't initialize media player";
+
+	// Plugins were just scanned for the instance above, so this is cheap
+	if (!(g_parse_inst = libvlc_new(
+					sizeof(g_parse_args) / sizeof(g_parse_args[0]),
+					g_parse_args)))
+		throw "Couldn't initialize media parser";
+}
+
+static void WaitForInit()
+{
+	if (g_ready.load(std::memory_order_acquire))
+		return;
+
+	g_init.get();
+	g_ready.store(true, std::memory_order_release);
+}
+
+void PlayerGlobalInit()
+{
+	g_init = std::async(std::launch::async, Init).share();
 }
 
 void PlayerGlobalDestroy()
 {
-	libvlc_release(g_inst);
+	if (!g_init.valid())
+		return;
+
+	// Anything Init() threw has already been reported by whoever waited
+	g_init.wait();
+	if (g_parse_inst)
+		libvlc_release(g_parse_inst);
+	if (g_inst)
+		libvlc_release(g_inst);
+	g_parse_inst = g_inst = nullptr;
+	g_init = std::shared_future<void>();
+	g_ready = false;
+}
+
+libvlc_instance_t *PlayerInstance()
+{
+	WaitForInit();
+	return g_inst;
 }
 
-Player::Player(const std::string &path)
-	: m_media(nullptr)
-	, m_player(nullptr)
-	, m_volume(100)
-	, m_finished(false)
+libvlc_instance_t *ParseInstance()
 {
-	Open(path);
+	WaitForInit();
+	return g_parse_inst;
 }
 
 Player::~Player()
 {
 	Close();
+
+	for (Deck &d : m_decks) {
+		if (d.player)
+			libvlc_media_player_release(d.player);
+	}
+
+	for (CacheEntry &e : m_cache)
+		libvlc_media_release(e.second);
 }
 
+// Runs on libvlc's thread for the player that ended. Libvlc calls on that
+// player would deadlock here, so anything beyond starting the preloaded track
+// is left to the main loop.
 static void PlayerEndReachedCallback(const libvlc_event_t *const ev, void *player)
 {
 	Player *p = (Player *)player;
-	p->SetFinished(true);
+	p->TrackEnded(ev->p_obj);
+	p->Notify();
 }
 
-#include <unistd.h>
-void Player::Open(const std::string &path)
+static void PlayerPlayingCallback(const libvlc_event_t *const, void *)
 {
-	Close();
+	LatencyMark(PlayStage::Playing);
+}
 
-	m_finished = false;
+static void MediaParsedCallback(const libvlc_event_t *const ev, void *player)
+{
+	if (ev->u.media_parsed_changed.new_status == libvlc_media_parsed_status_done)
+		((Player *)player)->MediaParsed((const libvlc_media_t *)ev->p_obj);
+}
 
-	if (!(m_media = libvlc_media_new_path(g_inst, path.c_str())))
-		throw "Cannot open media file";
+void Player::MediaParsed(const libvlc_media_t *media)
+{
+	if (media == m_opened_media)
+		LatencyMark(PlayStage::Parsed);
+}
 
-	libvlc_media_parse_with_options(m_media, PARSE_FLAGS, 3000);
+// Decks are created the first time they are used and then kept, so the audio
+// output and event manager are set up once rather than per track
+libvlc_media_player_t *Player::DeckPlayer(Deck &d)
+{
+	if (d.player)
+		return d.player;
 
-	if (!(m_player = libvlc_media_player_new_from_media(m_media))) {
-		Close();
+	if (!(d.player = libvlc_media_player_new(PlayerInstance())))
 		throw "Cannot play media file";
-	}
 
-	// The media needs to be played in order to get the length
-	// libvlc_audio_set_volume(m_player, 0);
-	// libvlc_media_player_play(m_player);
-	// sleep(2);
-	// libvlc_media_player_stop(m_player);
-	libvlc_audio_set_volume(m_player, m_volume);
+	libvlc_audio_set_volume(d.player, DeckVolume(d));
 
-	libvlc_event_manager_t *em = libvlc_media_player_event_manager(m_player);
+	if (m_mixer)
+		m_mixer->Attach(d.player, &d - m_decks);
+
+	libvlc_event_manager_t *em = libvlc_media_player_event_manager(d.player);
 	libvlc_event_attach(em, libvlc_MediaPlayerEndReached,
 			PlayerEndReachedCallback, this);
+	libvlc_event_attach(em, libvlc_MediaPlayerPlaying,
+			PlayerPlayingCallback, this);
+
+	return d.player;
+}
+
+// Look up the media for a path, creating it and starting a background parse
+// if it isn't cached. The cache keeps its own reference.
+libvlc_media_t *Player::CachedMedia(const std::string &path, bool count)
+{
+	auto it = m_cache_index.find(path);
+	if (it != m_cache_index.end()) {
+		m_cache.splice(m_cache.begin(), m_cache, it->second);
+		if (count)
+			m_cache_hits++;
+		return it->second->second;
+	}
+
+	if (count)
+		m_cache_misses++;
+
+	libvlc_media_t *media = libvlc_media_new_path(PlayerInstance(), path.c_str());
+	if (!media)
+		throw "Cannot open media file";
+
+	libvlc_event_attach(libvlc_media_event_manager(media),
+			libvlc_MediaParsedChanged, MediaParsedCallback, this);
+	libvlc_media_parse_with_options(media, PARSE_FLAGS, 3000);
+
+	m_cache.emplace_front(path, media);
+	m_cache_index[path] = m_cache.begin();
+
+	if (m_cache.size() > MEDIA_CACHE_SIZE) {
+		libvlc_media_release(m_cache.back().second);
+		m_cache_index.erase(m_cache.back().first);
+		m_cache.pop_back();
+	}
+
+	return media;
+}
+
+// Create and parse the media for a track that is likely to be played soon
+void Player::Prefetch(const std::string &path)
+{
+	CachedMedia(path, false);
+}
+
+void Player::LoadDeck(Deck &d, const std::string &path, float gain)
+{
+	libvlc_media_player_t *player = DeckPlayer(d);
+	libvlc_media_t *media = CachedMedia(path, true);
+	libvlc_media_retain(media);
+
+	// Stops whatever the deck was playing and keeps its own reference
+	libvlc_media_player_set_media(player, media);
+
+	if (d.media)
+		libvlc_media_release(d.media);
+	d.media = media;
+
+	d.gain = gain;
+	libvlc_audio_set_volume(player, DeckVolume(d));
+}
+
+void Player::UnloadDeck(Deck &d)
+{
+	if (d.player)
+		libvlc_media_player_set_media(d.player, nullptr);
+
+	if (d.media) {
+		libvlc_media_release(d.media);
+		d.media = nullptr;
+	}
+}
+
+// Only the owning thread loads or releases decks, so it can use the current
+// one after the lock is dropped even if the callback moves on to the next track
+Player::Deck &Player::Current()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_decks[m_current];
+}
+
+Player::Deck &Player::Other()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_decks[m_current ^ 1];
+}
+
+// Must be called before anything is opened
+void Player::SetMixer(Mixer *mixer, unsigned crossfade_ms)
+{
+	m_mixer = mixer;
+	m_crossfade_ms = crossfade_ms;
+}
+
+void Player::StopFade()
+{
+	if (!m_fading)
+		return;
+
+	if (libvlc_media_player_t *p = Other().player)
+		libvlc_media_player_stop(p);
+	m_fading = false;
+}
+
+void Player::Open(const std::string &path, float gain)
+{
+	LatencyMark(PlayStage::OpenStart);
+
+	ClearPreload();
+	StopFade();
+
+	m_finished = false;
+
+	Deck &d = Current();
+	LoadDeck(d, path, gain);
+
+	// Media from the cache may have been parsed long ago
+	m_opened_media = d.media;
+	if (libvlc_media_get_parsed_status(d.media) == libvlc_media_parsed_status_done)
+		LatencyMark(PlayStage::Parsed);
+
+	if (m_mixer)
+		m_mixer->SetGain(&d - m_decks, 1, 1, 0);
+
+	LatencyMark(PlayStage::OpenEnd);
 }
 
 void Player::Close()
 {
-	if (m_media) {
-		libvlc_media_release(m_media);
-		m_media = nullptr;
+	ClearPreload();
+	StopFade();
+
+	for (Deck &d : m_decks)
+		UnloadDeck(d);
+
+	m_advanced = false;
+}
+
+// Load the track to play when the current one ends into the other deck. Libvlc
+// parses in the background, so this should be called well before the end.
+void Player::Preload(const std::string &path, float gain)
+{
+	ClearPreload();
+
+	if (m_fading) {
+		m_pending_preload = path;
+		m_pending_gain = gain;
+		return;
+	}
+
+	LoadDeck(Other(), path, gain);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_next_ready = true;
+}
+
+void Player::ClearPreload()
+{
+	m_pending_preload.clear();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_next_ready = false;
+}
+
+// Called from the end-of-track callback. Starts the preloaded deck if the
+// current one ended, or notes that a fade has finished if the other one did.
+void Player::TrackEnded(const void *ended)
+{
+	libvlc_media_player_t *next;
+	unsigned deck;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (ended != m_decks[m_current].player) {
+			m_fade_done = true;
+			return;
+		}
+
+		if (!m_next_ready) {
+			m_finished = true;
+			return;
+		}
+
+		deck = m_current ^= 1;
+		m_next_ready = false;
+		next = m_decks[deck].player;
+	}
+
+	// Through the mixer the new track follows on from the samples of the old
+	// one still in its ring, so there is no gap
+	if (m_mixer)
+		m_mixer->Follow(deck);
+
+	libvlc_media_player_play(next);
+	m_advanced = true;
+}
+
+// Called regularly by the owning thread. Starts the next track early with a
+// crossfade when the current one is near its end, and loads the track after
+// that once the fade has finished.
+void Player::Update()
+{
+	if (m_fade_done.exchange(false) && m_fading) {
+		m_fading = false;
+		if (m_pending_preload.size()) {
+			const std::string path = m_pending_preload;
+			Preload(path, m_pending_gain);
+		}
 	}
 
-	if (m_player) {
-		libvlc_media_player_release(m_player);
-		m_player = nullptr;
+	if (!m_mixer || !m_crossfade_ms || m_fading)
+		return;
+
+	libvlc_media_player_t *current = Current().player;
+	if (!current || !libvlc_media_player_is_playing(current))
+		return;
+
+	const libvlc_time_t length = libvlc_media_player_get_length(current);
+	const libvlc_time_t time = libvlc_media_player_get_time(current);
+	if (length <= 0 || time <= 0 || length - time > m_crossfade_ms)
+		return;
+
+	libvlc_media_player_t *next;
+	unsigned from, to;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_next_ready)
+			return;
+
+		from = m_current;
+		to = m_current ^= 1;
+		m_next_ready = false;
+		next = m_decks[to].player;
+	}
+
+	const size_t frames = (length - time) * MIXER_RATE / 1000;
+	m_mixer->SetGain(to, 0, 1, frames);
+	m_mixer->SetGain(from, 1, 0, frames);
+	m_fading = true;
+
+	libvlc_media_player_play(next);
+	m_advanced = true;
+}
+
+// Returns true once after the callback has moved on to the preloaded track
+bool Player::PollAdvanced()
+{
+	return m_advanced.exchange(false);
+}
+
+// Libvlc amplifies above 100, which leaves room for positive replay gain
+int Player::DeckVolume(const Deck &d) const
+{
+	const int v = std::lround(m_volume * std::pow(10.0f, d.gain / 20));
+	return v < 0 ? 0 : v > MAX_VOLUME ? MAX_VOLUME : v;
+}
+
+void Player::ApplyVolume()
+{
+	for (Deck &d : m_decks) {
+		if (d.player)
+			libvlc_audio_set_volume(d.player, DeckVolume(d));
 	}
 }
 
 void Player::Play()
 {
-	if (m_player)
-		libvlc_media_player_play(m_player);
+	if (libvlc_media_player_t *p = Current().player) {
+		LatencyMark(PlayStage::PlayIssued);
+		libvlc_media_player_play(p);
+	}
 }
 
 void Player::Pause()
 {
-	if (m_player)
-		libvlc_media_player_pause(m_player);
+	if (libvlc_media_player_t *p = Current().player)
+		libvlc_media_player_pause(p);
+
+	// Both tracks pause together in the middle of a crossfade
+	if (m_fading) {
+		if (libvlc_media_player_t *p = Other().player)
+			libvlc_media_player_pause(p);
+	}
 }
 
 void Player::Stop()
 {
-	if (m_player)
-		libvlc_media_player_stop(m_player);
+	StopFade();
+
+	if (libvlc_media_player_t *p = Current().player)
+		libvlc_media_player_stop(p);
 }
 
 void Player::VolumeUp()
@@ -103,7 +436,7 @@ void Player::VolumeUp()
 		m_volume += VOLUME_STEP;
 		if (m_volume > 100)
 			m_volume = 100;
-		libvlc_audio_set_volume(m_player, m_volume);
+		ApplyVolume();
 	}
 }
 
@@ -113,63 +446,39 @@ void Player::VolumeDown()
 		m_volume -= VOLUME_STEP;
 		if (m_volume < 0)
 			m_volume = 0;
-		libvlc_audio_set_volume(m_player, m_volume);
+		ApplyVolume();
 	}
 }
 
 size_t Player::GetLength()
 {
-	return m_player ? libvlc_media_player_get_length(m_player) / 1000 : 0;
+	libvlc_media_player_t *p = Current().player;
+	return p ? libvlc_media_player_get_length(p) / 1000 : 0;
 }
 
 size_t Player::GetPosition()
 {
-	return m_player ? libvlc_media_player_get_time(m_player) : 0;
+	libvlc_media_player_t *p = Current().player;
+	return p ? libvlc_media_player_get_time(p) : 0;
 }
 
 void Player::SetPosition(size_t pos)
 {
-	libvlc_media_player_set_time(m_player, pos);
+	libvlc_media_player_set_time(Current().player, pos);
 }
 
 float Player::GetPercentage()
 {
-	return m_player ? libvlc_media_player_get_position(m_player) : 0;
+	libvlc_media_player_t *p = Current().player;
+	return p ? libvlc_media_player_get_position(p) : 0;
 }
 
 void Player::SetPercentage(float perc)
 {
-	libvlc_media_player_set_position(m_player, perc);
+	libvlc_media_player_set_position(Current().player, perc);
 }
 
 void Player::SetRate(float rate)
 {
-	libvlc_media_player_set_rate(m_player, rate);
-}
-
-std::string Player::GetMetaString(Meta meta)
-{
-	if (!m_media)
-		throw "Media not loaded";
-
-	libvlc_meta_t m;
-
-	switch (meta) {
-	case Meta::Title:	m = libvlc_meta_Title;	break;
-	case Meta::Artist:	m = libvlc_meta_Artist;	break;
-	case Meta::Album:	m = libvlc_meta_Album;	break;
-	default:			return "";
-	}
-
-	const char *const s = libvlc_media_get_meta(m_media, m);
-	return std::string(s ? s : "");
-}
-
-unsigned Player::GetTrackNumber()
-{
-	if (!m_media)
-		throw "Media not loaded";
-
-	const char *const tn = libvlc_media_get_meta(m_media, libvlc_meta_TrackNumber);
-	return tn ? std::strtoul(tn, nullptr, 10) : 0;
+	libvlc_media_player_set_rate(Current().player, rate);
 }
@@ -1,49 +1,117 @@
 #pragma once
 
+#include "mixer.hpp"
 #include <vlc/vlc.h>
 #include <string>
-
+#include <atomic>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+
+// Libvlc loads its plugins when it starts, which takes a while on a cold
+// cache, so it is brought up on a background thread. The instances below wait
+// for it, and rethrow if it failed.
 void PlayerGlobalInit();
 void PlayerGlobalDestroy();
 
-enum class Meta {
-	Title,
-	Artist,
-	Album,
-};
+// Shared with the loudness analyzer
+libvlc_instance_t *PlayerInstance();
+
+// An instance without audio or video output, for reading metadata
+libvlc_instance_t *ParseInstance();
 
 class Player {
 private:
-	libvlc_media_t *m_media;
-	libvlc_media_player_t *m_player;
+	struct Deck {
+		libvlc_media_t *media;
+		libvlc_media_player_t *player;
+		float gain; // Replay gain of the loaded track in dB
+	};
+
+	// Two long-lived media players. Tracks are swapped in with set_media so
+	// the audio output stays open; one deck plays while the other holds the
+	// preloaded next track.
+	Deck m_decks[2];
+	unsigned m_current;
+	bool m_next_ready;
+	// Guards the handover between decks, which happens on libvlc's thread
+	std::mutex m_mutex;
 	int m_volume;
-	bool m_finished;
+	std::atomic<bool> m_finished;
+	std::atomic<bool> m_advanced;
+	// Called from libvlc's thread when a track ends
+	void (*m_notify)();
+
+	// Optional mixer the decks play through, which allows crossfades
+	Mixer *m_mixer;
+	unsigned m_crossfade_ms;
+	// The other deck is still playing out the previous track
+	bool m_fading;
+	std::atomic<bool> m_fade_done;
+	// Next track to load once the fading deck is free
+	std::string m_pending_preload;
+	float m_pending_gain;
+	// Media of the last Open, whose parse is reported to the latency trace
+	std::atomic<libvlc_media_t *> m_opened_media;
+
+	typedef std::pair<std::string, libvlc_media_t *> CacheEntry;
+
+	// Recently used media, most recent first, so that a track which was
+	// prefetched or played before starts without being created and parsed
+	std::list<CacheEntry> m_cache;
+	std::unordered_map<std::string, std::list<CacheEntry>::iterator> m_cache_index;
+	size_t m_cache_hits;
+	size_t m_cache_misses;
+
+	libvlc_media_player_t *DeckPlayer(Deck &d);
+	void LoadDeck(Deck &d, const std::string &path, float gain);
+	void UnloadDeck(Deck &d);
+	Deck &Current();
+	Deck &Other();
+	int DeckVolume(const Deck &d) const;
+	void ApplyVolume();
+	libvlc_media_t *CachedMedia(const std::string &path, bool count);
+	void StopFade();
 
 public:
 	Player()
-		: m_media(nullptr)
-		, m_player(nullptr)
+		: m_decks{}
+		, m_current(0)
+		, m_next_ready(false)
 		, m_volume(100)
 		, m_finished(false)
+		, m_advanced(false)
+		, m_notify(nullptr)
+		, m_mixer(nullptr)
+		, m_crossfade_ms(0)
+		, m_fading(false)
+		, m_fade_done(false)
+		, m_pending_gain(0)
+		, m_opened_media(nullptr)
+		, m_cache_hits(0)
+		, m_cache_misses(0)
 	{}
 
-	Player(const std::string &path);
-
 	~Player();
 
 	Player(const Player &p) = delete;
 
-	Player(Player &&p)
-	{
-		m_media = p.m_media;
-		m_player = p.m_player;
-		p.m_player = nullptr;
-		p.m_player = nullptr;
-	}
+	Player(Player &&p) = delete;
 
-	void Open(const std::string &path);
+	void Open(const std::string &path, float gain = 0);
 	void Close();
 
+	void Preload(const std::string &path, float gain = 0);
+	void ClearPreload();
+	void SetMixer(Mixer *mixer, unsigned crossfade_ms);
+	void TrackEnded(const void *ended);
+	void Update();
+	bool PollAdvanced();
+
+	void Prefetch(const std::string &path);
+	inline size_t CacheHits() const { return m_cache_hits; }
+	inline size_t CacheMisses() const { return m_cache_misses; }
+
 	void Play();
 	void Pause();
 	void Stop();
@@ -59,9 +127,9 @@ public:
 
 	void SetRate(float rate);
 
-	std::string GetMetaString(Meta meta);
-	unsigned GetTrackNumber();
-
 	inline bool IsFinished() const { return m_finished; }
 	inline void SetFinished(bool val) { m_finished = val; }
+	inline void SetNotify(void (*notify)()) { m_notify = notify; }
+	inline void Notify() const { if (m_notify) m_notify(); }
+	void MediaParsed(const libvlc_media_t *media);
 };
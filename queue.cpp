@@ -0,0 +1,293 @@
+#include "queue.hpp"
+#include <cstdio>
+#include <unistd.h>
+
+#define NIL UINT32_MAX
+#define COMPACT_SLACK 1024 // Records beyond twice the queue length allowed
+
+enum : uint8_t {
+	OP_INSERT = 1,
+	OP_REMOVE,
+	OP_MOVE,
+};
+
+// One change to the queue as written to the journal. Inserts record the id
+// they produced, so replaying a damaged journal is caught rather than
+// rebuilding the wrong queue.
+struct JournalRecord {
+	uint8_t op;
+	uint8_t pad[3];
+	uint32_t song;
+	uint64_t id;
+	uint64_t other;
+};
+
+Queue::Queue()
+	: m_head(NIL)
+	, m_tail(NIL)
+	, m_count(0)
+	, m_journal(nullptr)
+	, m_records(0)
+{}
+
+Queue::~Queue()
+{
+	if (m_journal)
+		fclose(m_journal);
+}
+
+uint32_t Queue::Allocate(unsigned song)
+{
+	uint32_t slot;
+
+	if (m_free.size()) {
+		slot = m_free.back();
+		m_free.pop_back();
+	} else {
+		slot = m_slab.size();
+		m_slab.push_back(Entry{ 0, 0, NIL, NIL });
+	}
+
+	m_slab[slot].song = song;
+	return slot;
+}
+
+// Insert a slot after another, or at the front if after is NIL
+void Queue::Link(uint32_t slot, uint32_t after)
+{
+	Entry &e = m_slab[slot];
+	e.prev = after;
+	e.next = after == NIL ? m_head : m_slab[after].next;
+
+	if (e.next == NIL)
+		m_tail = slot;
+	else
+		m_slab[e.next].prev = slot;
+
+	if (after == NIL)
+		m_head = slot;
+	else
+		m_slab[after].next = slot;
+}
+
+void Queue::Unlink(uint32_t slot)
+{
+	Entry &e = m_slab[slot];
+
+	if (e.prev == NIL)
+		m_head = e.next;
+	else
+		m_slab[e.prev].next = e.next;
+
+	if (e.next == NIL)
+		m_tail = e.prev;
+	else
+		m_slab[e.next].prev = e.prev;
+
+	e.prev = e.next = NIL;
+}
+
+QueueId Queue::MakeId(uint32_t slot) const
+{
+	return ((QueueId)m_slab[slot].generation << 32) | (slot + 1);
+}
+
+bool Queue::Valid(QueueId id) const
+{
+	const uint32_t slot = (uint32_t)id - 1;
+	return id != QUEUE_NONE && slot < m_slab.size() &&
+		m_slab[slot].generation == (uint32_t)(id >> 32) &&
+		(m_slab[slot].prev != NIL || m_head == slot);
+}
+
+QueueId Queue::DoInsert(unsigned song, QueueId after)
+{
+	const uint32_t slot = Allocate(song);
+	Link(slot, after == QUEUE_NONE ? NIL : (uint32_t)after - 1);
+	m_count++;
+	return MakeId(slot);
+}
+
+bool Queue::DoRemove(QueueId id)
+{
+	if (!Valid(id))
+		return false;
+
+	const uint32_t slot = (uint32_t)id - 1;
+	Unlink(slot);
+	m_slab[slot].generation++;
+	m_free.push_back(slot);
+	m_count--;
+	return true;
+}
+
+bool Queue::DoMove(QueueId id, QueueId after)
+{
+	if (!Valid(id) || id == after || (after != QUEUE_NONE && !Valid(after)))
+		return false;
+
+	const uint32_t slot = (uint32_t)id - 1;
+	Unlink(slot);
+	Link(slot, after == QUEUE_NONE ? NIL : (uint32_t)after - 1);
+	return true;
+}
+
+void Queue::DoClear()
+{
+	m_slab.clear();
+	m_free.clear();
+	m_head = m_tail = NIL;
+	m_count = 0;
+}
+
+void Queue::Record(uint8_t op, QueueId id, QueueId other, unsigned song)
+{
+	if (!m_journal)
+		return;
+
+	const JournalRecord r = { op, {}, song, id, other };
+	if (fwrite(&r, sizeof(r), 1, m_journal) != 1 || fflush(m_journal))
+		throw "Couldn't write queue journal";
+	m_records++;
+}
+
+void Queue::Open(const std::string &path)
+{
+	bool damaged = false;
+
+	if (FILE *f = fopen(path.c_str(), "rb")) {
+		JournalRecord r;
+		size_t n;
+
+		while ((n = fread(&r, 1, sizeof(r), f)) == sizeof(r)) {
+			bool ok = true;
+
+			switch (r.op) {
+			case OP_INSERT:
+				ok = (r.other == QUEUE_NONE || Valid(r.other)) &&
+					DoInsert(r.song, r.other) == r.id;
+				break;
+			case OP_REMOVE:
+				ok = DoRemove(r.id);
+				break;
+			case OP_MOVE:
+				ok = DoMove(r.id, r.other);
+				break;
+			default:
+				ok = false;
+				break;
+			}
+
+			if (!ok) {
+				damaged = true;
+				break;
+			}
+			m_records++;
+		}
+
+		// A partial record is left by a crash in the middle of a write
+		if (n && n != sizeof(r))
+			damaged = true;
+
+		fclose(f);
+	}
+
+	if (damaged || m_records > 2 * m_count + COMPACT_SLACK) {
+		Compact(path);
+	} else if (!(m_journal = fopen(path.c_str(), "ab"))) {
+		throw "Couldn't open queue journal";
+	}
+}
+
+// Rewrite the journal as one insert per entry. Entries get new ids, since the
+// slab is rebuilt without any free slots.
+void Queue::Compact(const std::string &path)
+{
+	std::vector<unsigned> songs;
+	songs.reserve(m_count);
+	for (uint32_t s = m_head; s != NIL; s = m_slab[s].next)
+		songs.push_back(m_slab[s].song);
+
+	const std::string tmp = path + ".tmp";
+	if (!(m_journal = fopen(tmp.c_str(), "wb")))
+		throw "Couldn't write queue journal";
+
+	DoClear();
+	m_records = 0;
+
+	for (unsigned song : songs)
+		Append(song);
+
+	fclose(m_journal);
+
+	if (rename(tmp.c_str(), path.c_str()))
+		throw "Couldn't replace queue journal";
+
+	if (!(m_journal = fopen(path.c_str(), "ab")))
+		throw "Couldn't open queue journal";
+}
+
+QueueId Queue::Append(unsigned song)
+{
+	const QueueId after = m_tail == NIL ? QUEUE_NONE : MakeId(m_tail);
+	const QueueId id = DoInsert(song, after);
+	Record(OP_INSERT, id, after, song);
+	return id;
+}
+
+QueueId Queue::Prepend(unsigned song)
+{
+	const QueueId id = DoInsert(song, QUEUE_NONE);
+	Record(OP_INSERT, id, QUEUE_NONE, song);
+	return id;
+}
+
+bool Queue::Move(QueueId id, QueueId after)
+{
+	if (!DoMove(id, after))
+		return false;
+	Record(OP_MOVE, id, after, 0);
+	return true;
+}
+
+bool Queue::Remove(QueueId id)
+{
+	if (!DoRemove(id))
+		return false;
+	Record(OP_REMOVE, id, QUEUE_NONE, 0);
+
+	// Playing through the queue empties it, which keeps the journal short
+	if (!m_count)
+		Clear();
+	return true;
+}
+
+// An empty queue needs no history, so the journal is simply emptied
+void Queue::Clear()
+{
+	DoClear();
+
+	if (m_journal) {
+		if (ftruncate(fileno(m_journal), 0))
+			throw "Couldn't truncate queue journal";
+		m_records = 0;
+	}
+}
+
+QueueId Queue::Front() const
+{
+	return m_head == NIL ? QUEUE_NONE : MakeId(m_head);
+}
+
+QueueId Queue::Next(QueueId id) const
+{
+	if (!Valid(id))
+		return QUEUE_NONE;
+	const uint32_t next = m_slab[(uint32_t)id - 1].next;
+	return next == NIL ? QUEUE_NONE : MakeId(next);
+}
+
+unsigned Queue::Song(QueueId id) const
+{
+	return Valid(id) ? m_slab[(uint32_t)id - 1].song : 0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Identifies an entry in the queue for as long as it is there. The low half is
+// the slot and the high half counts how often the slot has been reused, so an
+// id for a removed entry never refers to a later one until the queue is
+// cleared or reloaded.
+typedef uint64_t QueueId;
+
+#define QUEUE_NONE ((QueueId)0)
+
+// Songs to play next, independent of what the song list is showing. Entries
+// live in a slab and are linked in play order by slot, so adding, removing and
+// moving entries is constant time at any length.
+//
+// Every change is appended to a journal as a fixed-size record; loading
+// replays it, and rewrites it compacted if it has grown much longer than the
+// queue itself.
+class Queue {
+private:
+	struct Entry {
+		unsigned song;
+		uint32_t generation;
+		uint32_t prev;
+		uint32_t next;
+	};
+
+	std::vector<Entry> m_slab;
+	std::vector<uint32_t> m_free;
+	uint32_t m_head;
+	uint32_t m_tail;
+	size_t m_count;
+
+	FILE *m_journal;
+	size_t m_records;
+
+	uint32_t Allocate(unsigned song);
+	void Link(uint32_t slot, uint32_t after);
+	void Unlink(uint32_t slot);
+	bool Valid(QueueId id) const;
+	QueueId MakeId(uint32_t slot) const;
+	void Record(uint8_t op, QueueId id, QueueId other, unsigned song);
+	void Compact(const std::string &path);
+
+	QueueId DoInsert(unsigned song, QueueId after);
+	bool DoRemove(QueueId id);
+	bool DoMove(QueueId id, QueueId after);
+	void DoClear();
+
+public:
+	Queue();
+	~Queue();
+	Queue(const Queue &q) = delete;
+
+	// Replay the journal at path and keep appending to it
+	void Open(const std::string &path);
+
+	QueueId Append(unsigned song);
+	QueueId Prepend(unsigned song);
+	// Put id after another entry, or first if after is QUEUE_NONE
+	bool Move(QueueId id, QueueId after);
+	bool Remove(QueueId id);
+	void Clear();
+
+	inline size_t Count() const { return m_count; }
+	inline bool Empty() const { return !m_count; }
+
+	// First entry, or QUEUE_NONE if the queue is empty
+	QueueId Front() const;
+	QueueId Next(QueueId id) const;
+	unsigned Song(QueueId id) const;
+};
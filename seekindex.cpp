@@ -0,0 +1,250 @@
+#include "seekindex.hpp"
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Bitrates in kbps by [MPEG-1, MPEG-2/2.5][layer 1, 2, 3][index]
+static const uint16_t g_bitrates[2][3][15] = {
+	{
+		{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+		{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+		{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+	},
+	{
+		{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+		{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+		{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+	},
+};
+
+static const uint16_t g_sample_rates[3] = { 44100, 48000, 32000 };
+
+struct Mp3Frame {
+	size_t length;
+	unsigned samples;
+	unsigned rate;
+};
+
+static bool ParseMp3Header(const uint8_t *p, Mp3Frame &f)
+{
+	if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0)
+		return false;
+
+	const unsigned version = (p[1] >> 3) & 3; // 0: 2.5, 2: 2, 3: 1
+	const unsigned layer = 4 - ((p[1] >> 1) & 3); // 4 is reserved
+	const unsigned bitrate = p[2] >> 4;
+	const unsigned rate = (p[2] >> 2) & 3;
+	const unsigned padding = (p[2] >> 1) & 1;
+
+	if (version == 1 || layer == 4 || !bitrate || bitrate == 15 || rate == 3)
+		return false;
+
+	const bool v1 = version == 3;
+	f.rate = g_sample_rates[rate] >> (v1 ? 0 : version == 2 ? 1 : 2);
+	f.samples = layer == 1 ? 384 : layer == 3 && !v1 ? 576 : 1152;
+
+	const unsigned kbps = g_bitrates[!v1][layer - 1][bitrate];
+	if (layer == 1)
+		f.length = (12 * kbps * 1000 / f.rate + padding) * 4;
+	else
+		f.length = f.samples / 8 * kbps * 1000 / f.rate + padding;
+
+	return true;
+}
+
+static size_t Id3v2Size(const uint8_t *data, size_t size)
+{
+	if (size < 10 || memcmp(data, "ID3", 3))
+		return 0;
+
+	const size_t len = (data[6] & 0x7f) << 21 | (data[7] & 0x7f) << 14 |
+		(data[8] & 0x7f) << 7 | (data[9] & 0x7f);
+	const size_t total = 10 + len + (data[5] & 0x10 ? 10 : 0);
+	return std::min(total, size);
+}
+
+// A header only counts if another follows it, which rules out sync patterns
+// inside tags and damaged data
+static bool BuildMp3(const uint8_t *data, size_t size,
+		std::vector<SeekPoint> &points, uint64_t &audio_size)
+{
+	// Neither an ID3v2 tag at the start nor an ID3v1 tag at the end is audio
+	const size_t start = Id3v2Size(data, size);
+	const size_t end = size - start >= 128 &&
+		!memcmp(data + size - 128, "TAG", 3) ? size - 128 : size;
+	uint64_t samples = 0;
+	uint32_t next_ms = 0;
+	bool first = true;
+
+	for (size_t pos = start; pos + 4 <= end; ) {
+		Mp3Frame f, g;
+		if (!ParseMp3Header(data + pos, f) || pos + f.length > end ||
+				(pos + f.length + 4 <= end &&
+				 !ParseMp3Header(data + pos + f.length, g))) {
+			pos++;
+			continue;
+		}
+
+		// A Xing, Info or VBRI frame at the start holds no audio
+		const size_t probe = std::min<size_t>(f.length, 64);
+		if (first && (memmem(data + pos, probe, "Xing", 4) ||
+					memmem(data + pos, probe, "Info", 4) ||
+					memmem(data + pos, probe, "VBRI", 4))) {
+			first = false;
+			pos += f.length;
+			continue;
+		}
+		first = false;
+
+		const uint32_t ms = samples * 1000 / f.rate;
+		if (ms >= next_ms) {
+			points.push_back(SeekPoint{ ms, 0, pos - start });
+			next_ms = ms + SEEK_INDEX_INTERVAL_MS;
+		}
+
+		samples += f.samples;
+		pos += f.length;
+	}
+
+	audio_size = end - start;
+	return points.size();
+}
+
+static uint32_t Le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// The granule position of an Ogg page is the sample count at its end, so the
+// point records the page after it
+static bool BuildOgg(const uint8_t *data, size_t size,
+		std::vector<SeekPoint> &points, uint64_t &audio_size)
+{
+	uint32_t serial = 0;
+	uint64_t rate = 0;
+	uint64_t preskip = 0;
+	uint32_t next_ms = SEEK_INDEX_INTERVAL_MS;
+
+	points.push_back(SeekPoint{ 0, 0, 0 });
+
+	for (size_t pos = 0; pos + 27 <= size; ) {
+		const uint8_t *page = data + pos;
+		if (memcmp(page, "OggS", 4) || page[4] != 0)
+			return false;
+
+		const size_t segments = page[26];
+		if (pos + 27 + segments > size)
+			break;
+
+		size_t length = 27 + segments;
+		for (size_t i = 0; i < segments; i++)
+			length += page[27 + i];
+		if (pos + length > size)
+			break;
+
+		const uint8_t *body = page + 27 + segments;
+		const size_t body_size = length - 27 - segments;
+		int64_t granule;
+		memcpy(&granule, page + 6, sizeof(granule));
+
+		if (!rate) {
+			// Identification header of the first stream
+			serial = Le32(page + 14);
+			if (body_size >= 16 && !memcmp(body, "\x01vorbis", 7)) {
+				rate = Le32(body + 12);
+			} else if (body_size >= 12 && !memcmp(body, "OpusHead", 8)) {
+				rate = 48000;
+				preskip = body[10] | body[11] << 8;
+			} else {
+				return false;
+			}
+			if (!rate)
+				return false;
+		} else if (Le32(page + 14) == serial && granule > 0 &&
+				(uint64_t)granule > preskip) {
+			const uint32_t ms = (granule - preskip) * 1000 / rate;
+			if (ms >= next_ms && pos + length < size) {
+				points.push_back(SeekPoint{ ms, 0, pos + length });
+				next_ms = ms + SEEK_INDEX_INTERVAL_MS;
+			}
+		}
+
+		pos += length;
+	}
+
+	audio_size = size;
+	return rate;
+}
+
+static bool IsMp3Path(const std::string &path)
+{
+	return path.size() >= 4 &&
+		!strcasecmp(path.c_str() + path.size() - 4, ".mp3");
+}
+
+bool BuildSeekIndex(const std::string &path, std::vector<SeekPoint> &points,
+		uint64_t &size)
+{
+	points.clear();
+
+	const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < 4) {
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	// The whole file is read once, front to back
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	// MP3 has no magic number, so only files named as MP3 are scanned for it
+	const uint8_t *data = (const uint8_t *)map;
+	bool ok = false;
+	if (!memcmp(data, "OggS", 4))
+		ok = BuildOgg(data, st.st_size, points, size);
+	else if (IsMp3Path(path))
+		ok = BuildMp3(data, st.st_size, points, size);
+
+	munmap(map, st.st_size);
+
+	if (!ok)
+		points.clear();
+	return ok;
+}
+
+bool SeekIndexable(const std::string &path)
+{
+	const size_t dot = path.rfind('.');
+	if (dot == std::string::npos)
+		return false;
+	const char *ext = path.c_str() + dot;
+	return !strcasecmp(ext, ".mp3") || !strcasecmp(ext, ".ogg") ||
+		!strcasecmp(ext, ".oga") || !strcasecmp(ext, ".opus");
+}
+
+uint64_t SeekOffset(const std::vector<SeekPoint> &points, uint64_t size,
+		uint32_t ms)
+{
+	auto it = std::upper_bound(points.begin(), points.end(), ms,
+			[](uint32_t t, const SeekPoint &p) { return t < p.ms; });
+	if (it == points.begin())
+		return 0;
+
+	const SeekPoint &a = *(it - 1);
+	if (it == points.end() || it->ms == a.ms || it->offset < a.offset)
+		return std::min(a.offset, size);
+
+	return a.offset + (it->offset - a.offset) * (ms - a.ms) / (it->ms - a.ms);
+}
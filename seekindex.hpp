@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define SEEK_INDEX_INTERVAL_MS 1000
+
+// A place in a file where decoding can start. Offsets are into the audio data:
+// for MP3 they start after any ID3v2 tag, which libvlc skips before it maps
+// positions to bytes.
+struct SeekPoint {
+	uint32_t ms;
+	uint32_t reserved;
+	uint64_t offset;
+};
+
+// Scan the frame headers of an MP3 file, or the pages of an Ogg Vorbis or Opus
+// file, and record roughly one point per interval. Size is set to the length
+// of the audio data, which for MP3 leaves out ID3 tags at either end. Returns
+// false for other formats or damaged files.
+bool BuildSeekIndex(const std::string &path, std::vector<SeekPoint> &points,
+		uint64_t &size);
+
+// Whether a file is named as one of the formats above
+bool SeekIndexable(const std::string &path);
+
+// Offset of ms in the audio data, interpolated between the points around it.
+// Within an interval the bitrate is close to constant, so this lands within a
+// frame or so of the target even for VBR files.
+uint64_t SeekOffset(const std::vector<SeekPoint> &points, uint64_t size,
+		uint32_t ms);
@@ -0,0 +1,55 @@
+#include "shuffle.hpp"
+
+// Splitmix64 finaliser; any well mixed function works as a round function
+static uint64_t Mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+void Shuffle::Reset(uint64_t seed, uint64_t size, uint64_t position)
+{
+	m_seed = seed;
+	m_size = size;
+	m_position = position;
+
+	m_half_bits = 1;
+	while (m_half_bits < 32 && (1ull << (2 * m_half_bits)) < size)
+		m_half_bits++;
+	m_half_mask = (1ull << m_half_bits) - 1;
+}
+
+uint64_t Shuffle::Encrypt(const uint64_t *keys, uint64_t x) const
+{
+	uint64_t left = x >> m_half_bits;
+	uint64_t right = x & m_half_mask;
+
+	for (unsigned i = 0; i < SHUFFLE_ROUNDS; i++) {
+		const uint64_t next = left ^ (Mix(keys[i] ^ right) & m_half_mask);
+		left = right;
+		right = next;
+	}
+
+	return (left << m_half_bits) | right;
+}
+
+// The domain is less than four times the size, so this walks a few steps on
+// average. It always ends, since following the cycle from a position inside
+// the range must come back into it.
+uint64_t Shuffle::Permute(uint64_t position) const
+{
+	if (!m_size)
+		return 0;
+
+	const uint64_t pass = position / m_size;
+	uint64_t keys[SHUFFLE_ROUNDS];
+	for (unsigned i = 0; i < SHUFFLE_ROUNDS; i++)
+		keys[i] = Mix(m_seed + pass * SHUFFLE_ROUNDS + i);
+
+	uint64_t x = Encrypt(keys, position % m_size);
+	while (x >= m_size)
+		x = Encrypt(keys, x);
+	return x;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+
+#define SHUFFLE_ROUNDS 4
+
+// A random order over the indices [0, size) that is never stored. Position p
+// maps to index Permute(p), where Permute is a keyed Feistel network over the
+// smallest even power of two that covers the range; results outside the range
+// are fed back in until they land inside it. Each index comes up exactly once
+// per pass of size positions, stepping either way is constant time, and the
+// order is recreated from just the seed. Every pass uses different keys.
+class Shuffle {
+private:
+	uint64_t m_seed;
+	uint64_t m_size;
+	uint64_t m_position;
+	unsigned m_half_bits;
+	uint64_t m_half_mask;
+
+	uint64_t Encrypt(const uint64_t *keys, uint64_t x) const;
+
+public:
+	Shuffle() { Reset(0, 0); }
+
+	void Reset(uint64_t seed, uint64_t size, uint64_t position = 0);
+
+	// Index at a position in the order
+	uint64_t Permute(uint64_t position) const;
+
+	inline uint64_t Seed() const { return m_seed; }
+	inline uint64_t Size() const { return m_size; }
+	// Where the owner is up to; not used by Permute
+	inline uint64_t Position() const { return m_position; }
+	inline void SetPosition(uint64_t position) { m_position = position; }
+};
@@ -0,0 +1,135 @@
+#include "sink.hpp"
+#include "mixer.hpp"
+#ifdef JUKE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+#define DEVICE_LATENCY_US 100000
+#define WAV_HEADER_SIZE 44
+
+#ifdef JUKE_ALSA
+class DeviceSink : public AudioSink {
+private:
+	snd_pcm_t *m_pcm;
+
+public:
+	DeviceSink()
+	{
+		if (snd_pcm_open(&m_pcm, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0)
+			throw "Couldn't open audio device";
+
+		if (snd_pcm_set_params(m_pcm, SND_PCM_FORMAT_FLOAT,
+					SND_PCM_ACCESS_RW_INTERLEAVED, MIXER_CHANNELS, MIXER_RATE,
+					1, DEVICE_LATENCY_US) < 0) {
+			snd_pcm_close(m_pcm);
+			throw "Couldn't configure audio device";
+		}
+	}
+
+	~DeviceSink()
+	{
+		snd_pcm_drop(m_pcm);
+		snd_pcm_close(m_pcm);
+	}
+
+	void Write(const float *samples, size_t frames) override
+	{
+		while (frames) {
+			const snd_pcm_sframes_t n = snd_pcm_writei(m_pcm, samples, frames);
+			if (n < 0) {
+				// Underruns are expected while nothing is playing
+				if (snd_pcm_recover(m_pcm, n, 1) < 0)
+					return;
+				continue;
+			}
+			samples += n * MIXER_CHANNELS;
+			frames -= n;
+		}
+	}
+
+	bool IsRealTime() const override { return true; }
+};
+#endif
+
+// Fields are written little-endian, as the format requires
+static void PutLE(FILE *f, uint32_t v, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		fputc((v >> (8 * i)) & 0xff, f);
+}
+
+class WavSink : public AudioSink {
+private:
+	FILE *m_file;
+	uint32_t m_bytes;
+	std::vector<int16_t> m_buf;
+
+	void WriteHeader()
+	{
+		const uint32_t block = MIXER_CHANNELS * sizeof(int16_t);
+
+		fseek(m_file, 0, SEEK_SET);
+		fputs("RIFF", m_file);
+		PutLE(m_file, WAV_HEADER_SIZE - 8 + m_bytes, 4);
+		fputs("WAVEfmt ", m_file);
+		PutLE(m_file, 16, 4);
+		PutLE(m_file, 1, 2); // PCM
+		PutLE(m_file, MIXER_CHANNELS, 2);
+		PutLE(m_file, MIXER_RATE, 4);
+		PutLE(m_file, MIXER_RATE * block, 4);
+		PutLE(m_file, block, 2);
+		PutLE(m_file, 16, 2);
+		fputs("data", m_file);
+		PutLE(m_file, m_bytes, 4);
+	}
+
+public:
+	WavSink(const std::string &path)
+		: m_bytes(0)
+	{
+		if (!(m_file = fopen(path.c_str(), "wb")))
+			throw "Couldn't open WAV output file";
+		WriteHeader();
+	}
+
+	~WavSink()
+	{
+		WriteHeader();
+		fclose(m_file);
+	}
+
+	void Write(const float *samples, size_t frames) override
+	{
+		const size_t n = frames * MIXER_CHANNELS;
+		m_buf.resize(n);
+
+		for (size_t i = 0; i < n; i++) {
+			float s = samples[i];
+			s = s > 1.0f ? 1.0f : s < -1.0f ? -1.0f : s;
+			m_buf[i] = (int16_t)(s * 32767.0f);
+		}
+
+		// Samples are stored in host order, so this assumes a little-endian host
+		fwrite(m_buf.data(), sizeof(int16_t), n, m_file);
+		m_bytes += n * sizeof(int16_t);
+	}
+
+	bool IsRealTime() const override { return false; }
+};
+
+AudioSink *OpenDeviceSink()
+{
+#ifdef JUKE_ALSA
+	return new DeviceSink();
+#else
+	throw "Crossfading needs juke built with ALSA; set ALSA=1 and rebuild";
+#endif
+}
+
+AudioSink *OpenWavSink(const std::string &path)
+{
+	return new WavSink(path);
+}
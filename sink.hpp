@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// Destination for the mixer's output: interleaved float frames at
+// MIXER_RATE with MIXER_CHANNELS channels
+class AudioSink {
+public:
+	virtual ~AudioSink() {}
+
+	virtual void Write(const float *samples, size_t frames) = 0;
+
+	// True if Write() blocks until the audio is played, pacing the mixer
+	virtual bool IsRealTime() const = 0;
+};
+
+// The default ALSA playback device. Without ALSA support built in, this
+// throws.
+AudioSink *OpenDeviceSink();
+
+// A 16-bit PCM WAV file, for checking the mix offline
+AudioSink *OpenWavSink(const std::string &path);
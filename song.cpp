@@ -1,23 +1,25 @@
 #include "song.hpp"
-#include "player.hpp"
 #include "util.hpp"
 #include <cctype>
 
-Song::Song(std::string path)
-	: path(path)
+Song::Song(const std::string &path, const MediaTags &tags)
+	: id(0)
+	, path(path)
+	, loudness(NAN)
+	, peak(NAN)
+	, album_loudness(NAN)
+	, album_peak(NAN)
 {
 	if (!path.size())
 		throw "Empty path";
 
-	Player player(path);
-
-	title = player.GetMetaString(Meta::Title);
+	title = tags.title;
 	if (!title.size())
 		title = path;
 	title = fs::path(title).stem().string();
 
-	artist = player.GetMetaString(Meta::Artist);
-	album = player.GetMetaString(Meta::Album);
+	artist = tags.artist;
+	album = tags.album;
 
 	if (!artist.size() || !album.size()) {
 		const std::vector<std::string> parts = Split(path, "/");
@@ -35,7 +37,7 @@ Song::Song(std::string path)
 	if (!album.size())
 		album = "<Unknown album>";
 
-	track = player.GetTrackNumber();
+	track = tags.track;
 	if (track == 0 && title.size() >= 4) {
 		if (isdigit(title[0]) && isdigit(title[1]) && title[2] == ' ') {
 			track = (title[0] - '0') * 10 + (title[1] - '0');
@@ -46,5 +48,5 @@ Song::Song(std::string path)
 		}
 	}
 
-	length = player.GetLength();
+	length = tags.length;
 }
@@ -1,15 +1,39 @@
 #pragma once
 
 #include <string>
+#include <cmath>
+
+// Tags as read from a file, before any are filled in from its path
+struct MediaTags {
+	std::string title;
+	std::string artist;
+	std::string album;
+	unsigned track;
+	unsigned length; // Seconds
+
+	MediaTags() : track(0), length(0) {}
+};
 
 struct Song {
+	unsigned id; // Database rowid, which stays the same across rescans
 	std::string path;
 	std::string title;
 	std::string artist;
 	std::string album;
 	unsigned track;
 	unsigned length;
+	// From the loudness analysis; NAN until the track has been analysed
+	double loudness; // Integrated loudness in LUFS
+	double peak; // Linear true peak
+	double album_loudness;
+	double album_peak; // Highest peak of the album's analysed tracks
 
-	Song() {}
-	Song(std::string path);
+	Song()
+		: id(0)
+		, loudness(NAN)
+		, peak(NAN)
+		, album_loudness(NAN)
+		, album_peak(NAN)
+	{}
+	Song(const std::string &path, const MediaTags &tags);
 };
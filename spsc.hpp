@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. N must be a power of two.
+template <typename T, size_t N>
+class SpscQueue {
+private:
+	static_assert(N && (N & (N - 1)) == 0, "Queue size must be a power of two");
+
+	T m_items[N];
+	// Next slot to pop; only written by the consumer
+	alignas(64) std::atomic<size_t> m_head;
+	// Next slot to push; only written by the producer
+	alignas(64) std::atomic<size_t> m_tail;
+
+public:
+	SpscQueue()
+		: m_head(0)
+		, m_tail(0)
+	{}
+
+	SpscQueue(const SpscQueue &q) = delete;
+
+	// Returns false if the queue is full
+	bool Push(T &&item)
+	{
+		const size_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head.load(std::memory_order_acquire) == N)
+			return false;
+
+		m_items[tail & (N - 1)] = std::move(item);
+		m_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Returns false if the queue is empty
+	bool Pop(T &item)
+	{
+		const size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire))
+			return false;
+
+		item = std::move(m_items[head & (N - 1)]);
+		m_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Number of items waiting; exact for the producer, an upper bound
+	// otherwise
+	size_t Size() const
+	{
+		return m_tail.load(std::memory_order_acquire) -
+			m_head.load(std::memory_order_acquire);
+	}
+};
+
+// Bounded lock-free ring of plain values for one producer thread and one
+// consumer thread, moving runs of items at a time. N must be a power of two.
+template <typename T, size_t N>
+class SpscRing {
+private:
+	static_assert(N && (N & (N - 1)) == 0, "Ring size must be a power of two");
+
+	T m_items[N];
+	alignas(64) std::atomic<size_t> m_head;
+	alignas(64) std::atomic<size_t> m_tail;
+
+public:
+	SpscRing()
+		: m_head(0)
+		, m_tail(0)
+	{}
+
+	SpscRing(const SpscRing &r) = delete;
+
+	// Write up to n items, returning how many fit
+	size_t Write(const T *items, size_t n)
+	{
+		const size_t tail = m_tail.load(std::memory_order_relaxed);
+		const size_t space = N - (tail - m_head.load(std::memory_order_acquire));
+		if (n > space)
+			n = space;
+
+		const size_t at = tail & (N - 1);
+		const size_t first = n < N - at ? n : N - at;
+		std::copy(items, items + first, m_items + at);
+		std::copy(items + first, items + n, m_items);
+
+		m_tail.store(tail + n, std::memory_order_release);
+		return n;
+	}
+
+	// Read up to n items, returning how many there were
+	size_t Read(T *items, size_t n)
+	{
+		const size_t head = m_head.load(std::memory_order_relaxed);
+		const size_t avail = m_tail.load(std::memory_order_acquire) - head;
+		if (n > avail)
+			n = avail;
+
+		const size_t at = head & (N - 1);
+		const size_t first = n < N - at ? n : N - at;
+		std::copy(m_items + at, m_items + at + first, items);
+		std::copy(m_items, m_items + (n - first), items + first);
+
+		m_head.store(head + n, std::memory_order_release);
+		return n;
+	}
+
+	// Number of items waiting; exact for the consumer
+	size_t Size() const
+	{
+		return m_tail.load(std::memory_order_acquire) -
+			m_head.load(std::memory_order_acquire);
+	}
+
+	// Drop everything written so far; consumer only
+	void Clear()
+	{
+		m_head.store(m_tail.load(std::memory_order_acquire),
+				std::memory_order_release);
+	}
+};
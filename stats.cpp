@@ -0,0 +1,135 @@
+#include "stats.hpp"
+#include <cstring>
+
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+
+static unsigned BucketIndex(uint64_t v)
+{
+	if (v < SUB_BUCKETS)
+		return v;
+
+	const unsigned e = 63 - __builtin_clzll(v);
+	const unsigned sub = (v >> (e - SUB_BITS)) & (SUB_BUCKETS - 1);
+	return (e - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+static uint64_t BucketValue(unsigned idx)
+{
+	if (idx < SUB_BUCKETS)
+		return idx;
+
+	const unsigned e = idx / SUB_BUCKETS + SUB_BITS - 1;
+	const uint64_t sub = idx % SUB_BUCKETS;
+	return (SUB_BUCKETS | sub) << (e - SUB_BITS);
+}
+
+void Histogram::Clear()
+{
+	memset(m_buckets, 0, sizeof(m_buckets));
+	m_count = 0;
+}
+
+void Histogram::Add(uint64_t us)
+{
+	unsigned idx = BucketIndex(us);
+	if (idx >= BUCKETS)
+		idx = BUCKETS - 1;
+	m_buckets[idx]++;
+	m_count++;
+}
+
+uint64_t Histogram::Percentile(double p) const
+{
+	if (!m_count)
+		return 0;
+
+	const uint64_t rank = p * (m_count - 1) / 100;
+	uint64_t seen = 0;
+
+	for (unsigned i = 0; i < BUCKETS; i++) {
+		seen += m_buckets[i];
+		if (seen > rank)
+			return BucketValue(i);
+	}
+
+	return BucketValue(BUCKETS - 1);
+}
+
+FrameStats::FrameStats()
+	: m_last()
+	, m_frames(0)
+	, m_log(nullptr)
+{}
+
+FrameStats::~FrameStats()
+{
+	if (m_log)
+		fclose(m_log);
+}
+
+void FrameStats::OpenLog(const std::string &path)
+{
+	if (!(m_log = fopen(path.c_str(), "a")))
+		throw "Couldn't open frame log";
+	setvbuf(m_log, nullptr, _IOLBF, 0);
+}
+
+void FrameStats::Add(const FrameCost &cost)
+{
+	const uint64_t total = cost.layout_us + cost.cells_us + cost.present_us;
+
+	m_layout.Add(cost.layout_us);
+	m_cells.Add(cost.cells_us);
+	m_present.Add(cost.present_us);
+	m_total.Add(total);
+	m_last = cost;
+	m_frames++;
+
+	if (m_log) {
+		fprintf(m_log, "frame=%lu total_us=%lu layout_us=%lu cells_us=%lu "
+				"present_us=%lu cells=%d bytes=%d writes=%d\n",
+				(unsigned long)m_frames, (unsigned long)total,
+				(unsigned long)cost.layout_us, (unsigned long)cost.cells_us,
+				(unsigned long)cost.present_us, cost.cells, cost.bytes,
+				cost.syscalls);
+	}
+}
+
+void FrameStats::Clear()
+{
+	m_layout.Clear();
+	m_cells.Clear();
+	m_present.Clear();
+	m_total.Clear();
+	m_last = FrameCost();
+	m_frames = 0;
+}
+
+static std::string HistogramLine(const char *const name, const Histogram &h,
+		uint64_t last)
+{
+	char buf[96];
+	snprintf(buf, sizeof(buf), "%-8s %6lu us  p50 %6lu  p99 %6lu", name,
+			(unsigned long)last, (unsigned long)h.Percentile(50),
+			(unsigned long)h.Percentile(99));
+	return buf;
+}
+
+void FrameStats::Summary(std::vector<std::string> &out) const
+{
+	char buf[96];
+
+	snprintf(buf, sizeof(buf), "Frames   %lu", (unsigned long)m_frames);
+	out.push_back(buf);
+
+	out.push_back(HistogramLine("Total", m_total,
+				m_last.layout_us + m_last.cells_us + m_last.present_us));
+	out.push_back(HistogramLine("Layout", m_layout, m_last.layout_us));
+	out.push_back(HistogramLine("Cells", m_cells, m_last.cells_us));
+	out.push_back(HistogramLine("Present", m_present, m_last.present_us));
+
+	snprintf(buf, sizeof(buf), "Changed  %d cells  %d bytes  %d writes",
+			m_last.cells, m_last.bytes, m_last.syscalls);
+	out.push_back(buf);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Histogram of durations in microseconds. Buckets are spaced logarithmically
+// with eight linear steps per power of two, so percentiles are accurate to
+// within 12.5% at constant cost per sample.
+class Histogram {
+private:
+	static const unsigned BUCKETS = 256;
+
+	uint64_t m_buckets[BUCKETS];
+	uint64_t m_count;
+
+public:
+	Histogram() { Clear(); }
+
+	void Clear();
+	void Add(uint64_t us);
+	uint64_t Percentile(double p) const;
+
+	inline uint64_t Count() const { return m_count; }
+};
+
+// What it took to produce one frame
+struct FrameCost {
+	uint64_t layout_us;
+	uint64_t cells_us;
+	uint64_t present_us;
+	int cells;
+	int bytes;
+	int syscalls;
+};
+
+class FrameStats {
+private:
+	Histogram m_layout;
+	Histogram m_cells;
+	Histogram m_present;
+	Histogram m_total;
+	FrameCost m_last;
+	uint64_t m_frames;
+	FILE *m_log;
+
+public:
+	FrameStats();
+	~FrameStats();
+
+	FrameStats(const FrameStats &s) = delete;
+
+	// Append a line per frame to the file at path
+	void OpenLog(const std::string &path);
+
+	void Add(const FrameCost &cost);
+	void Clear();
+
+	// Human readable summary, one line per entry
+	void Summary(std::vector<std::string> &out) const;
+};
@@ -54,9 +54,22 @@ static void bytebuffer_resize(struct bytebuffer *b, int len) {
 	b->len = len;
 }
 
-static void bytebuffer_flush(struct bytebuffer *b, int fd) {
-	write(fd, b->buf, b->len);
+// returns the number of write() calls it took
+static int bytebuffer_flush(struct bytebuffer *b, int fd) {
+	int off = 0;
+	int calls = 0;
+	while (off < b->len) {
+		ssize_t r = write(fd, b->buf + off, b->len - off);
+		calls++;
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			break;
+		}
+		off += r;
+	}
 	bytebuffer_clear(b);
+	return calls;
 }
 
 static void bytebuffer_truncate(struct bytebuffer *b, int n) {
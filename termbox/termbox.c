@@ -43,14 +43,34 @@ static int termh = -1;
 static int inputmode = TB_INPUT_ESC;
 static int outputmode = TB_OUTPUT_NORMAL;
 
-static int inout;
-static int winch_fds[2];
+static int inout = -1;
+static int winch_fds[2] = {-1, -1};
 
 static int lastx = LAST_COORD_INIT;
 static int lasty = LAST_COORD_INIT;
+
+#define LAST_ATTR_INIT 0xFFFF
+static uint16_t lastfg = LAST_ATTR_INIT;
+static uint16_t lastbg = LAST_ATTR_INIT;
+
+/* Gaps of unchanged cells up to this wide are rewritten rather than skipped
+ * with a cursor movement, which takes at least four bytes */
+#define MAX_GAP_FILL 4
+/* Only erase the end of a line when that saves writing more cells than this */
+#define MIN_ERASE_GAIN 3
+/* Only scroll when it saves redrawing at least this many rows */
+#define MIN_SCROLL_ROWS 2
+
+static struct tb_present_stats present_stats;
+static uint32_t *back_hashes;
+static uint32_t *front_hashes;
+static int hashes_cap;
 static int cursor_x = -1;
 static int cursor_y = -1;
 
+static int default_char_width(uint32_t ch);
+static int (*char_width)(uint32_t ch) = default_char_width;
+
 static uint16_t background = TB_DEFAULT;
 static uint16_t foreground = TB_DEFAULT;
 
@@ -65,7 +85,12 @@ static void cellbuf_free(struct cellbuf *buf);
 static void update_size(void);
 static void update_term_size(void);
 static void send_attr(uint16_t fg, uint16_t bg);
-static void send_char(int x, int y, uint32_t c);
+static void send_char(int x, int y, uint32_t c, int w);
+static void move_cursor(int x, int y);
+static int cell_width(uint32_t ch);
+static int erase_line(int x, int y);
+static void scroll_rows(void);
+static void present_rows(int first, int last);
 static void send_clear(void);
 static void sigwinch_handler(int xxx);
 static int wait_fill_event(struct tb_event *event, struct timeval *timeout);
@@ -120,6 +145,7 @@ int tb_init_fd(int inout_)
 	bytebuffer_puts(&output_buffer, funcs[T_ENTER_KEYPAD]);
 	bytebuffer_puts(&output_buffer, funcs[T_HIDE_CURSOR]);
 	send_clear();
+	bytebuffer_flush(&output_buffer, inout);
 
 	update_term_size();
 	cellbuf_init(&back_buffer, termw, termh);
@@ -162,6 +188,10 @@ void tb_shutdown(void)
 
 	cellbuf_free(&back_buffer);
 	cellbuf_free(&front_buffer);
+	free(back_hashes);
+	free(front_hashes);
+	back_hashes = front_hashes = NULL;
+	hashes_cap = 0;
 	bytebuffer_free(&output_buffer);
 	bytebuffer_free(&input_buffer);
 	termw = termh = -1;
@@ -169,37 +199,73 @@ void tb_shutdown(void)
 
 void tb_present(void)
 {
-	int x,y,w,i;
-	struct tb_cell *back, *front;
-
 	/* invalidate cursor position */
 	lastx = LAST_COORD_INIT;
 	lasty = LAST_COORD_INIT;
 
+	present_stats.cells = 0;
+
 	if (buffer_size_change_request) {
 		update_size();
 		buffer_size_change_request = 0;
 	}
 
-	for (y = 0; y < front_buffer.height; ++y) {
+	scroll_rows();
+	present_rows(0, front_buffer.height);
+}
+
+void tb_present_rows(int first, int last)
+{
+	lastx = LAST_COORD_INIT;
+	lasty = LAST_COORD_INIT;
+
+	present_stats.cells = 0;
+
+	/* a resize repaints everything, so leave it to the next tb_present() */
+	if (buffer_size_change_request) {
+		present_stats.bytes = present_stats.syscalls = 0;
+		return;
+	}
+
+	if (first < 0)
+		first = 0;
+	if (last > front_buffer.height)
+		last = front_buffer.height;
+
+	present_rows(first, last);
+}
+
+static void present_rows(int first, int last)
+{
+	int x,y,w,i,erased;
+	struct tb_cell *back, *front;
+
+	for (y = first; y < last; ++y) {
+		erased = 0;
 		for (x = 0; x < front_buffer.width; ) {
 			back = &CELL(&back_buffer, x, y);
 			front = &CELL(&front_buffer, x, y);
-			w = wcwidth(back->ch);
-			if (w < 1) w = 1;
+			w = cell_width(back->ch);
 			if (memcmp(back, front, sizeof(struct tb_cell)) == 0) {
 				x += w;
 				continue;
 			}
+			if (!erased) {
+				/* look at the cell again after erasing */
+				erased = 1;
+				if (erase_line(x, y))
+					continue;
+			}
 			memcpy(front, back, sizeof(struct tb_cell));
 			send_attr(back->fg, back->bg);
+			present_stats.cells++;
 			if (w > 1 && x >= front_buffer.width - (w - 1)) {
 				// Not enough room for wide ch, so send spaces
 				for (i = x; i < front_buffer.width; ++i) {
-					send_char(i, y, ' ');
+					send_char(i, y, ' ', 1);
 				}
 			} else {
-				send_char(x, y, back->ch);
+				send_char(x, y, back->ch, w);
 				for (i = 1; i < w; ++i) {
 					front = &CELL(&front_buffer, x + i, y);
 					front->ch = 0;
@@ -212,7 +278,13 @@ void tb_present(void)
 	}
 	if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
 		write_cursor(cursor_x, cursor_y);
-	bytebuffer_flush(&output_buffer, inout);
+	present_stats.bytes = output_buffer.len;
+	present_stats.syscalls = bytebuffer_flush(&output_buffer, inout);
+}
+
+void tb_get_present_stats(struct tb_present_stats *stats)
+{
+	*stats = present_stats;
 }
 
 void tb_set_cursor(int cx, int cy)
@@ -296,6 +368,16 @@ int tb_peek_event(struct tb_event *event, int timeout)
 	return wait_fill_event(event, &tv);
 }
 
+int tb_input_fd(void)
+{
+	return inout;
+}
+
+int tb_resize_fd(void)
+{
+	return winch_fds[0];
+}
+
 int tb_width(void)
 {
 	return termw;
@@ -351,6 +433,11 @@ void tb_set_clear_attributes(uint16_t fg, uint16_t bg)
 	background = bg;
 }
 
+void tb_set_char_width_func(int (*func)(uint32_t ch))
+{
+	char_width = func ? func : default_char_width;
+}
+
 /* -------------------------------------------------------- */
 
 static int convertnum(uint32_t num, char* buf) {
@@ -423,6 +510,11 @@ static void write_sgr(uint16_t fg, uint16_t bg) {
 	}
 }
 
+static int default_char_width(uint32_t ch)
+{
+	return wcwidth(ch);
+}
+
 static void cellbuf_init(struct cellbuf *buf, int width, int height)
 {
 	buf->cells = (struct tb_cell*)malloc(sizeof(struct tb_cell) * width * height);
@@ -497,11 +589,7 @@ static void update_term_size(void)
 
 static void send_attr(uint16_t fg, uint16_t bg)
 {
-#define LAST_ATTR_INIT 0xFFFF
-	static uint16_t lastfg = LAST_ATTR_INIT, lastbg = LAST_ATTR_INIT;
 	if (fg != lastfg || bg != lastbg) {
-		bytebuffer_puts(&output_buffer, funcs[T_SGR0]);
-
 		uint16_t fgcol;
 		uint16_t bgcol;
 
@@ -531,6 +619,22 @@ static void send_attr(uint16_t fg, uint16_t bg)
 			bgcol = bg & 0x0F;
 		}
 
+		/* When the attributes stay the same and no color goes back to the
+		 * default, setting the new colors is enough; otherwise start over
+		 * from a reset */
+		if (lastfg != LAST_ATTR_INIT &&
+				(fg & 0xFF00) == (lastfg & 0xFF00) &&
+				(bg & 0xFF00) == (lastbg & 0xFF00) &&
+				(fgcol != TB_DEFAULT || (fg & 0xFF) == (lastfg & 0xFF)) &&
+				(bgcol != TB_DEFAULT || (bg & 0xFF) == (lastbg & 0xFF))) {
+			write_sgr(fgcol, bgcol);
+			lastfg = fg;
+			lastbg = bg;
+			return;
+		}
+
+		bytebuffer_puts(&output_buffer, funcs[T_SGR0]);
+
 		if (fg & TB_BOLD)
 			bytebuffer_puts(&output_buffer, funcs[T_BOLD]);
 		if (bg & TB_BOLD)
@@ -547,24 +651,250 @@ static void send_attr(uint16_t fg, uint16_t bg)
 	}
 }
 
-static void send_char(int x, int y, uint32_t c)
+static int cell_width(uint32_t ch)
+{
+	int w = char_width(ch);
+	return w < 1 ? 1 : w;
+}
+
+/* Rewrite a short run of unchanged cells if that is cheaper than moving the
+ * cursor over them, which is the case for plain ASCII in the current
+ * attributes */
+static int fill_gap(int x, int y, int n)
+{
+	int i;
+
+	if (n > MAX_GAP_FILL)
+		return 0;
+
+	for (i = x; i < x + n; ++i) {
+		const struct tb_cell *c = &CELL(&front_buffer, i, y);
+		if (c->ch >= 0x80 || (c->ch < 0x20 && c->ch != 0) ||
+				c->fg != lastfg || c->bg != lastbg)
+			return 0;
+	}
+
+	for (i = x; i < x + n; ++i) {
+		const char ch = CELL(&front_buffer, i, y).ch;
+		bytebuffer_append(&output_buffer, ch ? &ch : " ", 1);
+	}
+
+	return 1;
+}
+
+static void move_cursor(int x, int y)
+{
+	char buf[32];
+
+	if (y == lasty && x > lastx) {
+		const int gap = x - lastx - 1;
+		if (gap == 0 || fill_gap(lastx + 1, y, gap))
+			return;
+		WRITE_LITERAL("\033[");
+		if (gap > 1)
+			WRITE_INT(gap);
+		WRITE_LITERAL("C");
+	} else if (x == 0 && lasty != LAST_COORD_INIT && y == lasty + 1) {
+		WRITE_LITERAL("\r\n");
+	} else {
+		write_cursor(x, y);
+	}
+}
+
+static void send_char(int x, int y, uint32_t c, int w)
 {
 	char buf[7];
 	int bw = tb_utf8_unicode_to_char(buf, c);
-	if (x-1 != lastx || y != lasty)
-		write_cursor(x, y);
-	lastx = x; lasty = y;
+	move_cursor(x, y);
+	lastx = x + w - 1; lasty = y;
 	if(!c) buf[0] = ' '; // replace 0 with whitespace
 	bytebuffer_append(&output_buffer, buf, bw);
 }
 
+static int is_erasable(const struct tb_cell *c)
+{
+	/* Erased cells take the default background, or the current one on
+	 * terminals with back color erase, so only plain blanks qualify */
+	return c->ch == ' ' && c->bg == TB_DEFAULT && (c->fg & TB_REVERSE) == 0;
+}
+
+/* Clear the rest of a row with a single erase-line sequence if that saves
+ * more than it costs: blank cells that changed no longer need to be written,
+ * but unchanged ones that aren't blank have to be written again */
+static int erase_line(int x, int y)
+{
+	int i, gain = 0;
+	const int n = front_buffer.width - x;
+	const struct tb_cell *back = &CELL(&back_buffer, x, y);
+	struct tb_cell *front = &CELL(&front_buffer, x, y);
+
+	if (!*funcs[T_CLEAR_EOL])
+		return 0;
+
+	for (i = 0; i < n; ++i) {
+		const int same = memcmp(&back[i], &front[i], sizeof(struct tb_cell)) == 0;
+		if (is_erasable(&back[i]))
+			gain += !same;
+		else
+			gain -= same;
+	}
+
+	if (gain <= MIN_ERASE_GAIN)
+		return 0;
+
+	if (lastbg != TB_DEFAULT || (lastfg & TB_REVERSE))
+		send_attr(TB_DEFAULT, TB_DEFAULT);
+	move_cursor(x, y);
+	bytebuffer_puts(&output_buffer, funcs[T_CLEAR_EOL]);
+	/* the cursor doesn't move */
+	lastx = x - 1;
+	lasty = y;
+
+	for (i = 0; i < n; ++i) {
+		if (is_erasable(&back[i])) {
+			if (memcmp(&back[i], &front[i], sizeof(struct tb_cell)))
+				present_stats.cells++;
+			front[i] = back[i];
+		} else {
+			front[i].ch = ' ';
+			front[i].fg = TB_DEFAULT;
+			front[i].bg = TB_DEFAULT;
+		}
+	}
+
+	return 1;
+}
+
+static uint32_t row_hash(struct cellbuf *buf, int y)
+{
+	/* FNV-1a */
+	const unsigned char *p = (const unsigned char *)&CELL(buf, 0, y);
+	const size_t n = sizeof(struct tb_cell) * buf->width;
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int rows_equal(int back_y, int front_y)
+{
+	return memcmp(&CELL(&back_buffer, 0, back_y),
+			&CELL(&front_buffer, 0, front_y),
+			sizeof(struct tb_cell) * front_buffer.width) == 0;
+}
+
+/* Find the longest run of rows that moved vertically by the same amount
+ * since the last frame and move them on screen with a scroll region, so that
+ * only the rows scrolled into view need to be drawn */
+static void scroll_rows(void)
+{
+	const int h = front_buffer.height;
+	const int w = front_buffer.width;
+	int k, y, start, end, gain;
+	int best_k = 0, best_start = 0, best_end = 0, best_gain = 0;
+	char buf[32];
+
+	if (h < 3)
+		return;
+
+	if (hashes_cap < h) {
+		back_hashes = realloc(back_hashes, sizeof(uint32_t) * h);
+		front_hashes = realloc(front_hashes, sizeof(uint32_t) * h);
+		hashes_cap = h;
+	}
+
+	for (y = 0; y < h; ++y) {
+		back_hashes[y] = row_hash(&back_buffer, y);
+		front_hashes[y] = row_hash(&front_buffer, y);
+	}
+
+	/* back row y shows what front row y + k did */
+	for (k = 1 - h; k < h; ++k) {
+		if (k == 0)
+			continue;
+		start = -1;
+		gain = 0;
+		end = k < 0 ? h : h - k;
+		for (y = k < 0 ? -k : 0; y <= end; ++y) {
+			if (y < end && back_hashes[y] == front_hashes[y + k]) {
+				if (start < 0)
+					start = y;
+				if (back_hashes[y] != front_hashes[y])
+					gain++;
+				continue;
+			}
+			if (start >= 0 && gain > best_gain) {
+				best_k = k;
+				best_start = start;
+				best_end = y - 1;
+				best_gain = gain;
+			}
+			start = -1;
+			gain = 0;
+		}
+	}
+
+	if (best_gain < MIN_SCROLL_ROWS)
+		return;
+
+	for (y = best_start; y <= best_end; ++y)
+		if (!rows_equal(y, y + best_k))
+			return;
+
+	/* region covering both where the rows were and where they end up */
+	const int top = best_k > 0 ? best_start : best_start + best_k;
+	const int bottom = best_k > 0 ? best_end + best_k : best_end;
+	const int n = best_k > 0 ? best_k : -best_k;
+
+	/* line feeds at the bottom margin scroll the region up and reverse
+	 * index at the top margin scrolls it down, both filling the new lines
+	 * with the current background */
+	send_attr(TB_DEFAULT, TB_DEFAULT);
+	WRITE_LITERAL("\033[");
+	WRITE_INT(top + 1);
+	WRITE_LITERAL(";");
+	WRITE_INT(bottom + 1);
+	WRITE_LITERAL("r");
+	write_cursor(0, best_k > 0 ? bottom : top);
+	for (y = 0; y < n; ++y) {
+		if (best_k > 0)
+			WRITE_LITERAL("\n");
+		else
+			WRITE_LITERAL("\033M");
+	}
+	WRITE_LITERAL("\033[r");
+
+	/* resetting the scroll region homes the cursor */
+	lastx = LAST_COORD_INIT;
+	lasty = LAST_COORD_INIT;
+
+	memmove(&CELL(&front_buffer, 0, best_start),
+			&CELL(&front_buffer, 0, best_start + best_k),
+			sizeof(struct tb_cell) * w * (best_end - best_start + 1));
+
+	const int blank_start = best_k > 0 ? best_end + 1 : top;
+	for (y = blank_start; y < blank_start + n; ++y) {
+		for (k = 0; k < w; ++k) {
+			struct tb_cell *c = &CELL(&front_buffer, k, y);
+			c->ch = ' ';
+			c->fg = TB_DEFAULT;
+			c->bg = TB_DEFAULT;
+		}
+	}
+
+	present_stats.cells += w * best_gain;
+}
+
 static void send_clear(void)
 {
 	send_attr(foreground, background);
 	bytebuffer_puts(&output_buffer, funcs[T_CLEAR_SCREEN]);
 	if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
 		write_cursor(cursor_x, cursor_y);
-	bytebuffer_flush(&output_buffer, inout);
 
 	/* we need to invalidate cursor position too and these two vars are
 	 * used only for simple cursor positioning optimization, cursor
@@ -199,6 +199,11 @@ SO_IMPORT void tb_set_clear_attributes(uint16_t fg, uint16_t bg);
 /* Synchronizes the internal back buffer with the terminal. */
 SO_IMPORT void tb_present(void);
 
+/* Synchronizes only rows [first, last) of the back buffer with the terminal.
+ * Rows are not scrolled and a pending resize is left for tb_present().
+ */
+SO_IMPORT void tb_present_rows(int first, int last);
+
 #define TB_HIDE_CURSOR -1
 
 /* Sets the position of the cursor. Upper-left character is (0, 0). If you pass
@@ -309,6 +314,29 @@ SO_IMPORT int tb_peek_event(struct tb_event *event, int timeout);
  */
 SO_IMPORT int tb_poll_event(struct tb_event *event);
 
+/* File descriptors that become readable when tb_peek_event() has input or a
+ * resize to report. They are meant to be registered with an external
+ * poll/epoll loop, after which pending events should be drained with
+ * tb_peek_event(event, 0) until it returns 0. Both are -1 before tb_init().
+ */
+SO_IMPORT int tb_input_fd(void);
+SO_IMPORT int tb_resize_fd(void);
+
+/* Output produced by the last tb_present() call. */
+struct tb_present_stats {
+	int cells;    /* cells written or erased */
+	int bytes;    /* bytes written to the terminal */
+	int syscalls; /* write() calls it took */
+};
+
+SO_IMPORT void tb_get_present_stats(struct tb_present_stats *stats);
+
+/* Sets the function used to find how many columns a character occupies when
+ * presenting wide characters. Passing NULL restores the default, wcwidth(3),
+ * which depends on the current locale.
+ */
+SO_IMPORT void tb_set_char_width_func(int (*func)(uint32_t ch));
+
 /* Utility utf8 functions. */
 #define TB_EOF -1
 SO_IMPORT int tb_utf8_char_length(char c);
@@ -0,0 +1,129 @@
+/*
+Checks the frame time Histogram's percentiles against the exact ones for a
+spread of sample sets: they should never be above the true value and never
+more than one bucket, 12.5%, below it.
+
+Run with "make test". Exits with a non-zero status if anything is wrong.
+*/
+
+#include "../stats.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static unsigned g_failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		g_failures++; \
+	} \
+} while (0)
+
+// Small deterministic generator so failures can be reproduced
+static uint64_t g_rng = 0x9e3779b97f4a7c15ull;
+
+static uint64_t NextRandom()
+{
+	g_rng ^= g_rng << 13;
+	g_rng ^= g_rng >> 7;
+	g_rng ^= g_rng << 17;
+	return g_rng;
+}
+
+static void CheckSamples(const char *name, std::vector<uint64_t> samples)
+{
+	Histogram h;
+	for (uint64_t v : samples)
+		h.Add(v);
+	std::sort(samples.begin(), samples.end());
+
+	if (h.Count() != samples.size()) {
+		fprintf(stderr, "%s: counted %llu of %zu\n", name,
+				(unsigned long long)h.Count(), samples.size());
+		g_failures++;
+	}
+
+	const double percentiles[] = { 0, 1, 10, 50, 90, 99, 99.9, 100 };
+	for (double p : percentiles) {
+		const uint64_t exact = samples[(uint64_t)(p * (samples.size() - 1) /
+				100)];
+		const uint64_t got = h.Percentile(p);
+		if (got > exact || got < exact - exact / 8) {
+			fprintf(stderr, "%s: p%g is %llu, should be %llu\n", name, p,
+					(unsigned long long)got, (unsigned long long)exact);
+			g_failures++;
+		}
+	}
+}
+
+int main()
+{
+	Histogram h;
+	CHECK(h.Count() == 0);
+	CHECK(h.Percentile(50) == 0);
+
+	// Values below the first power of two with sub-buckets are exact
+	for (uint64_t v = 0; v < 8; v++) {
+		h.Clear();
+		h.Add(v);
+		CHECK(h.Percentile(50) == v);
+	}
+
+	// A bucket reports its lowest value, so the bounds come back exactly
+	for (unsigned e = 3; e < 34; e++) {
+		for (uint64_t sub = 0; sub < 8; sub++) {
+			const uint64_t v = (8 | sub) << (e - 3);
+			h.Clear();
+			h.Add(v);
+			h.Add(v + (v >> 4));
+			if (h.Percentile(0) != v || h.Percentile(100) != v) {
+				fprintf(stderr, "bucket at %llu reports %llu\n",
+						(unsigned long long)v,
+						(unsigned long long)h.Percentile(0));
+				g_failures++;
+			}
+		}
+	}
+
+	// Every value up to a few powers of two
+	std::vector<uint64_t> samples;
+	for (uint64_t v = 0; v < 5000; v++)
+		samples.push_back(v);
+	CheckSamples("sequence", samples);
+
+	// Frame times are mostly a few milliseconds with a long tail
+	samples.clear();
+	for (int i = 0; i < 100000; i++) {
+		const uint64_t r = NextRandom();
+		samples.push_back(r % 100 ? 2000 + r % 3000 : r % 2000000);
+	}
+	CheckSamples("frames", samples);
+
+	// Up to the last bucket, at nearly five hours
+	samples.clear();
+	for (int i = 0; i < 100000; i++)
+		samples.push_back(NextRandom() >> (30 + NextRandom() % 34));
+	CheckSamples("every magnitude", samples);
+
+	// Values past the last bucket land in it rather than outside the array
+	h.Clear();
+	h.Add(UINT64_MAX);
+	h.Add(1);
+	CHECK(h.Count() == 2);
+	CHECK(h.Percentile(0) == 1);
+	CHECK(h.Percentile(100) > 1000000000);
+
+	h.Clear();
+	CHECK(h.Count() == 0);
+	CHECK(h.Percentile(100) == 0);
+
+	if (g_failures) {
+		fprintf(stderr, "histogram: %u failures\n", g_failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("histogram: percentiles within a bucket\n");
+	return EXIT_SUCCESS;
+}
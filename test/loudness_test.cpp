@@ -0,0 +1,158 @@
+/*
+Measures generated tones with the LoudnessMeter and checks the results
+against the EBU Tech 3341 test cases it can reproduce without the reference
+files: steady and gated 997 Hz stereo tones, which must read within 0.1 LU of
+what they were made to, and a tone whose peaks fall between samples, which
+the true peak has to find.
+
+Run with "make test". Exits with a non-zero status if anything is wrong.
+*/
+
+#include "../loudness.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#define TONE_HZ 997.0
+#define TOLERANCE_LU 0.1
+
+static unsigned g_failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		g_failures++; \
+	} \
+} while (0)
+
+// Interleaved stereo, the same in both channels, carrying on from where the
+// last part left off
+class Signal {
+public:
+	std::vector<float> samples;
+
+	void Tone(double hz, double dbfs, double seconds, double phase = 0)
+	{
+		const double amplitude = std::pow(10, dbfs / 20);
+		const size_t start = samples.size() / LOUDNESS_CHANNELS;
+		const size_t frames = seconds * LOUDNESS_RATE;
+		for (size_t i = start; i < start + frames; i++) {
+			const float v = amplitude * std::sin(2 * M_PI * hz * i /
+					LOUDNESS_RATE + phase);
+			for (int c = 0; c < LOUDNESS_CHANNELS; c++)
+				samples.push_back(v);
+		}
+	}
+
+	void Silence(double seconds)
+	{
+		samples.resize(samples.size() +
+				(size_t)(seconds * LOUDNESS_RATE) * LOUDNESS_CHANNELS);
+	}
+
+	// Fed in uneven pieces, as the decoder hands them over
+	void Measure(LoudnessMeter &meter) const
+	{
+		const size_t frames = samples.size() / LOUDNESS_CHANNELS;
+		size_t done = 0;
+		for (size_t piece = 1; done < frames; piece = piece * 7 % 4801) {
+			const size_t n = std::min(piece, frames - done);
+			meter.Add(samples.data() + done * LOUDNESS_CHANNELS, n);
+			done += n;
+		}
+	}
+};
+
+static void ExpectLoudness(const char *name, const Signal &signal,
+		double lufs)
+{
+	LoudnessMeter meter;
+	signal.Measure(meter);
+	const double got = meter.Integrated();
+	if (std::fabs(got - lufs) > TOLERANCE_LU) {
+		fprintf(stderr, "%s: %.2f LUFS, should be %.1f\n", name, got, lufs);
+		g_failures++;
+	}
+}
+
+static void Loudness()
+{
+	// Cases 1 and 2: a steady tone reads as its level
+	Signal s;
+	s.Tone(TONE_HZ, -23, 20);
+	ExpectLoudness("tone at -23", s, -23);
+
+	s = Signal();
+	s.Tone(TONE_HZ, -33, 20);
+	ExpectLoudness("tone at -33", s, -33);
+
+	// Case 3: the relative gate leaves out the quieter parts
+	s = Signal();
+	s.Tone(TONE_HZ, -36, 10);
+	s.Tone(TONE_HZ, -23, 60);
+	s.Tone(TONE_HZ, -36, 10);
+	ExpectLoudness("relative gate", s, -23);
+
+	// Case 4: and the absolute gate the ones below -70
+	s = Signal();
+	s.Tone(TONE_HZ, -72, 10);
+	s.Tone(TONE_HZ, -36, 10);
+	s.Tone(TONE_HZ, -23, 60);
+	s.Tone(TONE_HZ, -36, 10);
+	s.Tone(TONE_HZ, -72, 10);
+	ExpectLoudness("absolute gate", s, -23);
+
+	// Nothing above the absolute gate reads as the gate
+	LoudnessMeter meter;
+	CHECK(meter.Integrated() == -70);
+	s = Signal();
+	s.Silence(3);
+	s.Measure(meter);
+	CHECK(meter.Integrated() == -70);
+	CHECK(meter.Peak() == 0);
+}
+
+// A quarter of the sample rate with a 45 degree phase puts every sample at
+// 0.707 of the peak, which only oversampling finds
+static void TruePeak()
+{
+	Signal s;
+	s.Tone(LOUDNESS_RATE / 4, -6, 1, M_PI / 4);
+
+	float sample_peak = 0;
+	for (float v : s.samples)
+		sample_peak = std::max(sample_peak, std::fabs(v));
+	const double peak = std::pow(10, -6 / 20.0);
+
+	LoudnessMeter meter;
+	s.Measure(meter);
+	CHECK(sample_peak < 0.72 * peak);
+	if (std::fabs(20 * std::log10(meter.Peak() / peak)) > 0.5) {
+		fprintf(stderr, "true peak %.4f, should be %.4f\n", meter.Peak(),
+				peak);
+		g_failures++;
+	}
+
+	// At a low frequency the true peak is the sample peak
+	s = Signal();
+	s.Tone(TONE_HZ, -1, 1);
+	meter = LoudnessMeter();
+	s.Measure(meter);
+	CHECK(std::fabs(20 * std::log10(meter.Peak()) + 1) < 0.05);
+}
+
+int main()
+{
+	Loudness();
+	TruePeak();
+
+	if (g_failures) {
+		fprintf(stderr, "loudness: %u failures\n", g_failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("loudness: tones measure as made\n");
+	return EXIT_SUCCESS;
+}
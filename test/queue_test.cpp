@@ -0,0 +1,286 @@
+/*
+Runs random edits on a Queue alongside a plain vector, reopening the journal
+every so often and checking that the replayed queue matches. Also checks
+that stale ids are refused, that a journal cut off or damaged part way
+through is replayed up to the damage, and that a long journal is compacted.
+
+Run with "make test". Exits with a non-zero status if anything is wrong.
+*/
+
+#include "../queue.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EDITS 20000
+#define REOPEN_EVERY 97
+#define RECORD_SIZE 24
+#define STALE_IDS 8 // Removed ids kept to check they stay dead
+
+static unsigned g_failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		g_failures++; \
+	} \
+} while (0)
+
+// Small deterministic generator so failures can be reproduced
+static uint32_t g_rng = 0x12345678;
+
+static uint32_t NextRandom()
+{
+	g_rng ^= g_rng << 13;
+	g_rng ^= g_rng >> 17;
+	g_rng ^= g_rng << 5;
+	return g_rng;
+}
+
+struct Model {
+	std::vector<QueueId> ids;
+	std::vector<unsigned> songs;
+};
+
+// Whether the queue holds the model's songs in order, taking the ids it has
+// for them since a compacted journal hands out new ones
+static bool Matches(const Queue &q, Model &m, bool take_ids)
+{
+	if (q.Count() != m.songs.size() || q.Empty() != m.songs.empty())
+		return false;
+
+	QueueId id = q.Front();
+	for (size_t i = 0; i < m.songs.size(); i++, id = q.Next(id)) {
+		if (id == QUEUE_NONE || q.Song(id) != m.songs[i])
+			return false;
+		if (take_ids)
+			m.ids[i] = id;
+		else if (id != m.ids[i])
+			return false;
+	}
+	return id == QUEUE_NONE;
+}
+
+static size_t FileSize(const std::string &path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) ? 0 : st.st_size;
+}
+
+static void Append(const std::string &path, const void *data, size_t size)
+{
+	FILE *f = fopen(path.c_str(), "ab");
+	if (!f || fwrite(data, 1, size, f) != size) {
+		fprintf(stderr, "can't write %s\n", path.c_str());
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+}
+
+static void RandomEdits(const std::string &path)
+{
+	std::unique_ptr<Queue> q(new Queue);
+	q->Open(path);
+	Model m;
+	QueueId gone[STALE_IDS] = {};
+
+	for (unsigned n = 1; n <= EDITS && !g_failures; n++) {
+		const uint32_t r = NextRandom();
+		const size_t count = m.songs.size();
+		const size_t i = count ? NextRandom() % count : 0;
+		const unsigned song = 1 + NextRandom() % 1000;
+
+		// Inserts are slightly more likely, so the queue wanders up to a few
+		// hundred entries
+		switch (r % 16) {
+		case 0: case 1: case 2: case 3: case 4:
+			m.ids.push_back(q->Append(song));
+			m.songs.push_back(song);
+			break;
+		case 5: case 6:
+			m.ids.insert(m.ids.begin(), q->Prepend(song));
+			m.songs.insert(m.songs.begin(), song);
+			break;
+		case 7: case 8: case 9: {
+			if (!count)
+				break;
+			CHECK(q->Remove(m.ids[i]));
+			gone[n % STALE_IDS] = m.ids[i];
+			m.ids.erase(m.ids.begin() + i);
+			m.songs.erase(m.songs.begin() + i);
+			// Removing the last entry clears the queue, which starts ids
+			// over
+			if (m.songs.empty())
+				std::fill(gone, gone + STALE_IDS, QUEUE_NONE);
+			break;
+		}
+		case 15:
+			if (r % 1024 == 15) {
+				q->Clear();
+				m.ids.clear();
+				m.songs.clear();
+				std::fill(gone, gone + STALE_IDS, QUEUE_NONE);
+				break;
+			}
+			// Fall through
+		default: {
+			if (!count)
+				break;
+			// After an entry, or first
+			const size_t to = NextRandom() % (count + 1);
+			const QueueId id = m.ids[i];
+			const QueueId after = to ? m.ids[to - 1] : QUEUE_NONE;
+			if (id == after) {
+				CHECK(!q->Move(id, after));
+				break;
+			}
+			CHECK(q->Move(id, after));
+			const unsigned moved = m.songs[i];
+			m.ids.erase(m.ids.begin() + i);
+			m.songs.erase(m.songs.begin() + i);
+			const size_t at = to > i ? to - 1 : to;
+			m.ids.insert(m.ids.begin() + at, id);
+			m.songs.insert(m.songs.begin() + at, moved);
+			break;
+		}
+		}
+
+		if (!Matches(*q, m, false)) {
+			fprintf(stderr, "edit %u: queue differs from model\n", n);
+			g_failures++;
+		}
+
+		// A removed entry's id isn't given to a later one, even once its
+		// slot is reused, until the queue is cleared or reopened
+		for (QueueId id : gone) {
+			if (id == QUEUE_NONE)
+				continue;
+			CHECK(q->Song(id) == 0);
+			CHECK(q->Next(id) == QUEUE_NONE);
+			CHECK(!q->Move(id, QUEUE_NONE));
+			CHECK(!q->Remove(id));
+		}
+
+		if (n % REOPEN_EVERY == 0) {
+			q.reset();
+			q.reset(new Queue);
+			q->Open(path);
+			std::fill(gone, gone + STALE_IDS, QUEUE_NONE);
+			if (!Matches(*q, m, true)) {
+				fprintf(stderr, "edit %u: replayed queue differs\n", n);
+				g_failures++;
+			}
+		}
+	}
+
+	// However long it has grown, a journal reopened is at most twice the
+	// queue plus the slack before it is compacted
+	CHECK(FileSize(path) % RECORD_SIZE == 0);
+	CHECK(FileSize(path) / RECORD_SIZE <= 2 * m.songs.size() + 1024);
+}
+
+static void Damage(const std::string &path)
+{
+	unlink(path.c_str());
+	Model m;
+	{
+		Queue q;
+		q.Open(path);
+		for (unsigned song = 1; song <= 5; song++) {
+			m.ids.push_back(q.Append(song));
+			m.songs.push_back(song);
+		}
+	}
+
+	// A crash part way through a write leaves a partial record, which is
+	// dropped
+	Append(path, "\x01\x00\x00\x00\x07", 5);
+	{
+		Queue q;
+		q.Open(path);
+		CHECK(Matches(q, m, true));
+		CHECK(FileSize(path) == 5 * RECORD_SIZE);
+	}
+
+	// A record that doesn't fit what came before it ends the replay there
+	uint8_t bad[RECORD_SIZE] = { 2 };
+	bad[8] = 42;
+	Append(path, bad, sizeof(bad));
+	{
+		Queue q;
+		q.Open(path);
+		CHECK(Matches(q, m, true));
+		CHECK(FileSize(path) == 5 * RECORD_SIZE);
+	}
+
+	// Emptying the queue empties the journal
+	{
+		Queue q;
+		q.Open(path);
+		CHECK(Matches(q, m, true));
+		for (QueueId id : m.ids)
+			CHECK(q.Remove(id));
+		CHECK(q.Empty());
+		CHECK(FileSize(path) == 0);
+	}
+
+	// A queue that was never opened works, just without a journal
+	Queue q;
+	const QueueId id = q.Append(3);
+	CHECK(q.Front() == id && q.Song(id) == 3 && q.Count() == 1);
+}
+
+// Moves don't change the queue's length, so enough of them make the journal
+// long enough to be compacted on the next open
+static void Compaction(const std::string &path)
+{
+	unlink(path.c_str());
+	Model m;
+	{
+		Queue q;
+		q.Open(path);
+		for (unsigned song = 1; song <= 10; song++) {
+			m.ids.push_back(q.Append(song));
+			m.songs.push_back(song);
+		}
+		for (int i = 0; i < 2000; i++)
+			CHECK(q.Move(q.Next(q.Front()), QUEUE_NONE));
+	}
+
+	// Every move swapped the first two, an even number of times
+	Queue q;
+	q.Open(path);
+	CHECK(Matches(q, m, true));
+	CHECK(FileSize(path) == 10 * RECORD_SIZE);
+}
+
+int main()
+{
+	char dir[] = "/tmp/queue_test.XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	const std::string path = std::string(dir) + "/queue";
+
+	RandomEdits(path);
+	Damage(path);
+	Compaction(path);
+
+	unlink(path.c_str());
+	unlink((path + ".tmp").c_str());
+	rmdir(dir);
+
+	if (g_failures) {
+		fprintf(stderr, "queue: %u failures\n", g_failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("queue: replays match\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,258 @@
+/*
+Builds seek indexes for synthetic MP3 and Ogg files and checks the points and
+audio sizes against what the frames and pages were made to hold, then checks
+SeekOffset() against hand-worked points.
+
+Run with "make test". Exits with a non-zero status if anything is wrong.
+*/
+
+#include "../seekindex.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// MPEG-1 layer 3, 128 kbps, 44.1 kHz, no padding: 417 bytes of 1152 samples
+#define MP3_HEADER "\xff\xfb\x90\x00"
+#define MP3_FRAME 417
+#define MP3_SAMPLES 1152
+#define MP3_RATE 44100
+
+// Ogg pages of one 200 byte segment, 100 ms apart
+#define OGG_BODY 200
+#define OGG_PAGE_MS 100
+
+static unsigned g_failures = 0;
+static std::string g_dir;
+static std::vector<std::string> g_files;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		g_failures++; \
+	} \
+} while (0)
+
+static std::string WriteFile(const char *name, const std::string &data)
+{
+	const std::string path = g_dir + "/" + name;
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f || fwrite(data.data(), 1, data.size(), f) != data.size()) {
+		fprintf(stderr, "can't write %s\n", path.c_str());
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+	g_files.push_back(path);
+	return path;
+}
+
+static std::string Mp3Frame(const char *marker)
+{
+	std::string frame(MP3_HEADER, 4);
+	frame.resize(MP3_FRAME);
+	if (marker)
+		memcpy(&frame[36], marker, 4);
+	return frame;
+}
+
+// An ID3v2 tag with a body of size bytes, which is small enough that the
+// syncsafe size fits in the last byte
+static std::string Id3v2(size_t size)
+{
+	std::string tag("ID3\x04\x00\x00\x00\x00\x00", 9);
+	tag += (char)size;
+	tag.resize(10 + size, '\xff');
+	return tag;
+}
+
+static std::string Id3v1()
+{
+	std::string tag("TAG");
+	tag.resize(128, '\xff');
+	return tag;
+}
+
+// Frame k of the audio starts k frames in and ms_k into the track; a point is
+// taken at the first frame at least a second past the last one
+static void CheckMp3Points(const std::vector<SeekPoint> &points, size_t frames,
+		size_t first)
+{
+	CHECK(points.size() > 1);
+	uint32_t next_ms = 0;
+	size_t p = 0;
+	for (size_t k = 0; k < frames && p < points.size(); k++) {
+		const uint32_t ms = (uint64_t)k * MP3_SAMPLES * 1000 / MP3_RATE;
+		if (ms < next_ms)
+			continue;
+		CHECK(points[p].ms == ms);
+		CHECK(points[p].offset == first + k * MP3_FRAME);
+		next_ms = ms + SEEK_INDEX_INTERVAL_MS;
+		p++;
+	}
+	CHECK(p == points.size());
+}
+
+static void Mp3()
+{
+	const size_t frames = 200;
+	std::string audio;
+	for (size_t i = 0; i < frames; i++)
+		audio += Mp3Frame(nullptr);
+
+	std::vector<SeekPoint> points;
+	uint64_t size;
+
+	// Bare frames
+	CHECK(BuildSeekIndex(WriteFile("bare.mp3", audio), points, size));
+	CHECK(size == audio.size());
+	CheckMp3Points(points, frames, 0);
+
+	// Tags at both ends and a Xing frame are skipped, and offsets count from
+	// the end of the ID3v2 tag
+	const std::string xing = Mp3Frame("Xing");
+	const std::string tagged = Id3v2(100) + xing + audio + Id3v1();
+	CHECK(BuildSeekIndex(WriteFile("tagged.mp3", tagged), points, size));
+	CHECK(size == xing.size() + audio.size());
+	CheckMp3Points(points, frames, xing.size());
+
+	// An Info frame is the same as a Xing one
+	CHECK(BuildSeekIndex(WriteFile("info.mp3", Mp3Frame("Info") + audio),
+				points, size));
+	CHECK(points.size() && points[0].offset == MP3_FRAME);
+
+	// A sync pattern inside junk isn't taken for a frame unless another
+	// frame follows it
+	const std::string junk = std::string("\x00\xff\xfb\x90\x00\x00", 6);
+	CHECK(BuildSeekIndex(WriteFile("junk.mp3", junk + audio), points, size));
+	CheckMp3Points(points, frames, junk.size());
+
+	// MP3 has no magic number, so the name decides
+	CHECK(!BuildSeekIndex(WriteFile("frames.wav", audio), points, size));
+	CHECK(points.empty());
+	CHECK(!BuildSeekIndex(WriteFile("empty.mp3", std::string(1000, '\0')),
+				points, size));
+}
+
+static void Le32(std::string &s, size_t at, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		s[at + i] = (char)(v >> i * 8);
+}
+
+static std::string OggPage(uint64_t granule, uint32_t serial,
+		const std::string &body)
+{
+	std::string page("OggS", 4);
+	page.resize(26);
+	Le32(page, 6, granule);
+	Le32(page, 10, granule >> 32);
+	Le32(page, 14, serial);
+	page += (char)1; // Segments
+	page += (char)body.size();
+	return page + body;
+}
+
+// A stream of pages ending every OGG_PAGE_MS after an identification header,
+// with the granule positions offset by preskip
+static void CheckOgg(const char *name, const std::string &head, uint32_t rate,
+		uint32_t preskip)
+{
+	const size_t pages = 60;
+	std::string data = OggPage(0, 7, head);
+	const size_t first = data.size();
+	for (size_t i = 1; i <= pages; i++) {
+		// Pages of other streams are passed over
+		if (i % 7 == 0)
+			data += OggPage(i * 1000000, 8, std::string(OGG_BODY, '\0'));
+		data += OggPage(preskip + i * rate / 1000 * OGG_PAGE_MS, 7,
+				std::string(OGG_BODY, '\0'));
+	}
+
+	std::vector<SeekPoint> points;
+	uint64_t size;
+	CHECK(BuildSeekIndex(WriteFile(name, data), points, size));
+	CHECK(size == data.size());
+
+	// A page whose granule reaches the next second gives a point at the start
+	// of the page after it, except for the last page
+	const size_t page = 28 + OGG_BODY;
+	CHECK(points.size() == pages * OGG_PAGE_MS / 1000);
+	CHECK(points.size() && points[0].ms == 0 && points[0].offset == 0);
+	for (size_t p = 1; p < points.size(); p++) {
+		const size_t i = p * 1000 / OGG_PAGE_MS;
+		CHECK(points[p].ms == p * 1000);
+		CHECK(points[p].offset == first + (i + i / 7) * page);
+	}
+}
+
+static void Ogg()
+{
+	std::string vorbis("\x01vorbis", 7);
+	vorbis.resize(30);
+	Le32(vorbis, 12, 44100);
+	CheckOgg("vorbis.ogg", vorbis, 44100, 0);
+
+	std::string opus("OpusHead\x01\x02", 10);
+	opus.resize(19);
+	opus[10] = (char)(312 & 0xff);
+	opus[11] = (char)(312 >> 8);
+	CheckOgg("opus.opus", opus, 48000, 312);
+
+	// Any other first stream isn't indexed
+	std::vector<SeekPoint> points;
+	uint64_t size;
+	const std::string theora = std::string("\x80theora", 7) +
+		std::string(30, '\0');
+	CHECK(!BuildSeekIndex(WriteFile("theora.ogg", OggPage(0, 7, theora)),
+				points, size));
+}
+
+static void Offsets()
+{
+	const std::vector<SeekPoint> points = {
+		{ 0, 0, 0 }, { 1000, 0, 1000 }, { 2000, 0, 3000 }, { 2000, 0, 3500 },
+	};
+
+	CHECK(SeekOffset(points, 4000, 0) == 0);
+	CHECK(SeekOffset(points, 4000, 500) == 500);
+	CHECK(SeekOffset(points, 4000, 1500) == 2000);
+	CHECK(SeekOffset(points, 4000, 1999) == 2998);
+	// Points with the same time don't divide by zero
+	CHECK(SeekOffset(points, 4000, 2000) == 3500);
+	// Past the last point the offset stays put, and never passes the end
+	CHECK(SeekOffset(points, 4000, 9000) == 3500);
+	CHECK(SeekOffset(points, 3200, 9000) == 3200);
+
+	// Before the first point is the start
+	const std::vector<SeekPoint> late = { { 500, 0, 800 }, { 1500, 0, 1800 } };
+	CHECK(SeekOffset(late, 4000, 100) == 0);
+	CHECK(SeekOffset({}, 4000, 100) == 0);
+}
+
+int main()
+{
+	char dir[] = "/tmp/seekindex_test.XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	g_dir = dir;
+
+	Mp3();
+	Ogg();
+	Offsets();
+
+	for (const std::string &path : g_files)
+		unlink(path.c_str());
+	rmdir(dir);
+
+	if (g_failures) {
+		fprintf(stderr, "seekindex: %u failures\n", g_failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("seekindex: all checks pass\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+/*
+Checks that every pass of a Shuffle visits each index exactly once, for every
+size up to a few hundred and a spread of larger ones, that passes and seeds
+give different orders, and that an order resized to a larger library at the
+start of a pass carries on with whole passes of the new size.
+
+Run with "make test". Exits with a non-zero status if any size goes wrong.
+*/
+
+#include "../shuffle.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#define SMALL_SIZES 300
+#define LARGE_SIZE 5000
+#define PASSES 3
+
+static unsigned g_failures = 0;
+
+// Whether positions [first, first + size) cover [0, size) once each
+static bool IsPermutation(const Shuffle &s, uint64_t first, uint64_t size)
+{
+	std::vector<bool> seen(size);
+	for (uint64_t p = first; p < first + size; p++) {
+		const uint64_t idx = s.Permute(p);
+		if (idx >= size || seen[idx])
+			return false;
+		seen[idx] = true;
+	}
+	return true;
+}
+
+static bool SameOrder(const Shuffle &a, uint64_t a_first, const Shuffle &b,
+		uint64_t b_first, uint64_t size)
+{
+	for (uint64_t i = 0; i < size; i++) {
+		if (a.Permute(a_first + i) != b.Permute(b_first + i))
+			return false;
+	}
+	return true;
+}
+
+static void CheckSize(uint64_t seed, uint64_t size)
+{
+	Shuffle s;
+	s.Reset(seed, size);
+
+	for (uint64_t pass = 0; pass < PASSES; pass++) {
+		if (!IsPermutation(s, pass * size, size)) {
+			fprintf(stderr, "seed %llu size %llu: pass %llu isn't a "
+					"permutation\n", (unsigned long long)seed,
+					(unsigned long long)size, (unsigned long long)pass);
+			g_failures++;
+			return;
+		}
+	}
+
+	// Too few orders to tell apart below this
+	if (size < 8)
+		return;
+
+	if (SameOrder(s, 0, s, size, size)) {
+		fprintf(stderr, "seed %llu size %llu: passes repeat\n",
+				(unsigned long long)seed, (unsigned long long)size);
+		g_failures++;
+	}
+
+	Shuffle other;
+	other.Reset(seed + 1, size);
+	if (SameOrder(s, 0, other, 0, size)) {
+		fprintf(stderr, "seed %llu size %llu: seeds give the same order\n",
+				(unsigned long long)seed, (unsigned long long)size);
+		g_failures++;
+	}
+}
+
+// The owner resizes at a pass boundary the way MoveShuffle() does, keeping
+// the seed and the pass number, and every pass from there on has to cover the
+// new size
+static void CheckGrow(uint64_t seed, uint64_t from, uint64_t to)
+{
+	Shuffle s;
+	s.Reset(seed, from, 2 * from);
+	s.Reset(s.Seed(), to, s.Position() / from * to);
+
+	bool ok = s.Position() == 2 * to;
+	for (uint64_t pass = 2; ok && pass < 2 + PASSES; pass++)
+		ok = IsPermutation(s, pass * to, to);
+
+	if (!ok) {
+		fprintf(stderr, "seed %llu: growing from %llu to %llu went wrong\n",
+				(unsigned long long)seed, (unsigned long long)from,
+				(unsigned long long)to);
+		g_failures++;
+	}
+}
+
+// Each index should come first about as often as any other
+static void CheckSpread()
+{
+	const uint64_t size = 5;
+	const unsigned seeds = 5000;
+	unsigned counts[size] = {};
+
+	Shuffle s;
+	for (unsigned seed = 0; seed < seeds; seed++) {
+		s.Reset(seed, size);
+		counts[s.Permute(0)]++;
+	}
+
+	for (uint64_t i = 0; i < size; i++) {
+		if (counts[i] < seeds / size * 8 / 10 ||
+				counts[i] > seeds / size * 12 / 10) {
+			fprintf(stderr, "index %llu came first %u times in %u\n",
+					(unsigned long long)i, counts[i], seeds);
+			g_failures++;
+		}
+	}
+}
+
+int main()
+{
+	Shuffle empty;
+	empty.Reset(1, 0);
+	if (empty.Permute(0) != 0 || empty.Permute(7) != 0) {
+		fprintf(stderr, "an empty order doesn't give 0\n");
+		g_failures++;
+	}
+
+	for (uint64_t size = 1; size <= SMALL_SIZES && !g_failures; size++) {
+		for (uint64_t seed = 0; seed < 4; seed++)
+			CheckSize(seed * 0x9e3779b97f4a7c15ull, size);
+	}
+
+	// Sizes either side of the powers of two, where the domain grows at every
+	// other one
+	for (uint64_t size = 4; size <= LARGE_SIZE && !g_failures; size *= 2) {
+		CheckSize(size, size - 1);
+		CheckSize(size, size);
+		CheckSize(size, size + 1);
+	}
+	CheckSize(42, LARGE_SIZE);
+
+	for (uint64_t from = 1; from <= 64 && !g_failures; from++) {
+		CheckGrow(from, from, from + 1);
+		CheckGrow(from, from, from * 3 + 5);
+	}
+	CheckGrow(7, 1000, LARGE_SIZE);
+
+	CheckSpread();
+
+	if (g_failures) {
+		fprintf(stderr, "shuffle: %u failures\n", g_failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("shuffle: every pass is a permutation\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,283 @@
+/*
+Walks a tree made under /tmp and checks that files come out in the order
+sqlite's BINARY collation sorts their paths, which the library scan relies on
+to merge the walk with its rows; that directories which can't be read are
+skipped or reported as the header says; and that directories whose mtime
+hasn't moved are skipped given records of a previous walk.
+
+The permission checks drop to an unprivileged user when run as root, which
+would otherwise read everything.
+
+Run with "make test". Exits with a non-zero status if anything is wrong.
+*/
+
+#include "../walker.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define NOBODY 65534
+
+static unsigned g_failures = 0;
+static std::string g_root;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		g_failures++; \
+	} \
+} while (0)
+
+static void MakeDir(const std::string &path)
+{
+	if (mkdir((g_root + "/" + path).c_str(), 0755)) {
+		perror(path.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void MakeFile(const std::string &path)
+{
+	const int fd = open((g_root + "/" + path).c_str(),
+			O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path.c_str());
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+}
+
+static std::vector<std::string> Walk(const std::string &root,
+		DirectoryRecords *records, bool *complete = nullptr)
+{
+	Walker walker(root, records);
+	std::vector<std::string> paths;
+	std::string path;
+	while (walker.Next(path))
+		paths.push_back(path);
+	if (complete)
+		*complete = walker.Complete();
+	return paths;
+}
+
+static void Dump(const char *label, const std::vector<std::string> &paths)
+{
+	fprintf(stderr, "%s:\n", label);
+	for (const std::string &path : paths)
+		fprintf(stderr, "  %s\n", path.c_str());
+}
+
+// Names that sort differently once a directory's path carries on with "/":
+// ' ', '!', '-' and '.' all come before it, and '0' after. std::string
+// compares bytes as unsigned, as sqlite does.
+static void Order()
+{
+	const char *const dirs[] = {
+		"a", "a b", "a-b", "a/c", "a/c d", "a0", "\xc3\xa9t\xc3\xa9",
+	};
+	const char *const files[] = {
+		"a!", "a.mp3", "a b/x", "a-b/x", "a/x", "a/c/y", "a/c d/y", "a/c.y",
+		"a0/x", "b", "\xc3\xa9t\xc3\xa9/z", "Z", "z",
+	};
+
+	for (const char *dir : dirs)
+		MakeDir(dir);
+	std::vector<std::string> expected;
+	for (const char *file : files) {
+		MakeFile(file);
+		expected.push_back(g_root + "/" + file);
+	}
+	std::sort(expected.begin(), expected.end());
+
+	bool complete;
+	const std::vector<std::string> walked = Walk(g_root, nullptr, &complete);
+	CHECK(complete);
+	if (walked != expected) {
+		Dump("walked", walked);
+		Dump("expected", expected);
+		g_failures++;
+	}
+
+	// A root that is a file yields itself, and one that is missing nothing
+	CHECK(Walk(g_root + "/b", nullptr) ==
+			std::vector<std::string>{ g_root + "/b" });
+	CHECK(Walk(g_root + "/missing", nullptr, &complete).empty());
+	CHECK(complete);
+}
+
+// What the library's table of directories would hold
+class Records : public DirectoryRecords {
+public:
+	std::map<std::string, std::pair<int64_t, std::vector<std::string>>> dirs;
+	std::vector<std::string> forgotten;
+
+	bool Unchanged(const std::string &dir, int64_t mtime,
+			std::vector<std::string> &subdirs) override
+	{
+		auto it = dirs.find(dir);
+		if (it == dirs.end() || it->second.first != mtime)
+			return false;
+		subdirs = it->second.second;
+		return true;
+	}
+
+	void Record(const std::string &dir, int64_t mtime,
+			const std::vector<std::string> &subdirs) override
+	{
+		dirs[dir] = std::make_pair(mtime, subdirs);
+	}
+
+	void Forget(const std::string &dir) override
+	{
+		forgotten.push_back(dir);
+	}
+};
+
+static void Skipping()
+{
+	MakeDir("s");
+	MakeDir("s/one");
+	MakeDir("s/two");
+	MakeDir("s/two/deep");
+	MakeFile("s/top");
+	MakeFile("s/one/a");
+	MakeFile("s/two/b");
+	MakeFile("s/two/deep/c");
+
+	const std::string root = g_root + "/s";
+	Records records;
+	CHECK(Walk(root, &records).size() == 4);
+	CHECK(records.dirs.size() == 4);
+
+	// Nothing has changed, so no directory is read
+	{
+		Walker walker(root, &records);
+		std::string path;
+		CHECK(!walker.Next(path));
+		CHECK(walker.Complete());
+		CHECK(walker.Unknown(root + "/top"));
+		CHECK(walker.Unknown(root + "/two/deep/c"));
+		CHECK(!walker.Unknown(g_root + "/elsewhere"));
+	}
+
+	// Only the directory that gained a file is read, though the walk still
+	// goes down to the unchanged one below it
+	MakeFile("s/two/new");
+	CHECK(Walk(root, &records) == (std::vector<std::string>{
+				root + "/two/b", root + "/two/new" }));
+	CHECK(Walk(root, &records).empty());
+
+	// A subdirectory recorded under an unchanged parent that has since gone,
+	// as when it was removed within the parent's mtime granularity, is
+	// forgotten so its records don't outlive it
+	records.dirs[root].second.push_back("gone");
+	CHECK(Walk(root, &records).empty());
+	CHECK(records.forgotten == std::vector<std::string>{ root + "/gone" });
+
+	// Without records everything is read again
+	CHECK(Walk(root, nullptr).size() == 5);
+}
+
+// A subdirectory that can't be read is skipped as if it were empty, but an
+// unreadable root means nothing was walked
+static void Permissions(const std::string &root)
+{
+	chmod((root + "/locked").c_str(), 0);
+
+	bool complete;
+	CHECK(Walk(root, nullptr, &complete) ==
+			std::vector<std::string>{ root + "/x" });
+	CHECK(complete);
+
+	// Searchable but not listable
+	chmod(root.c_str(), 0311);
+	Walker walker(root, nullptr);
+	std::string path;
+	CHECK(!walker.Next(path));
+	CHECK(!walker.Complete());
+	CHECK(walker.Unknown(root + "/x"));
+	CHECK(!walker.Unknown(g_root + "/px"));
+
+	chmod(root.c_str(), 0755);
+	chmod((root + "/locked").c_str(), 0755);
+}
+
+// Root reads everything, so then the checks run in a child that has given
+// that up, on a tree it owns
+static void PermissionsUnprivileged()
+{
+	const char *const paths[] = { "p", "p/locked", "p/x", "p/locked/y" };
+	MakeDir("p");
+	MakeDir("p/locked");
+	MakeFile("p/x");
+	MakeFile("p/locked/y");
+	const std::string root = g_root + "/p";
+
+	if (geteuid()) {
+		Permissions(root);
+		return;
+	}
+
+	for (const char *path : paths) {
+		if (lchown((g_root + "/" + path).c_str(), NOBODY, NOBODY)) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	const pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (!pid) {
+		if (setgid(NOBODY) || setuid(NOBODY)) {
+			perror("setuid");
+			_exit(EXIT_FAILURE);
+		}
+		Permissions(root);
+		_exit(g_failures ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	int status;
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+			WEXITSTATUS(status))
+		g_failures++;
+}
+
+static int RemoveEntry(const char *path, const struct stat *, int, FTW *)
+{
+	return remove(path);
+}
+
+int main()
+{
+	char dir[] = "/tmp/walker_test.XXXXXX";
+	if (!mkdtemp(dir) || chmod(dir, 0755)) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	g_root = dir;
+
+	Order();
+	Skipping();
+	PermissionsUnprivileged();
+
+	nftw(dir, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+
+	if (g_failures) {
+		fprintf(stderr, "walker: %u failures\n", g_failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("walker: walks in path order\n");
+	return EXIT_SUCCESS;
+}
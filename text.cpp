@@ -0,0 +1,26 @@
+#include "text.hpp"
+#include "width.hpp"
+extern "C" {
+#include "UTF8/UTF8.h"
+}
+
+void LayoutText(Text &out, const std::string &s)
+{
+	static std::vector<uint32_t> chars;
+
+	out.clear();
+
+	if (!s.size())
+		return;
+
+	chars.resize(s.size());
+	const uint32_t n = utf8_decode(s.data(), s.size(), chars.data(), nullptr);
+
+	out.reserve(n);
+
+	for (uint32_t i = 0; i < n; i++) {
+		const int width = CharWidth(chars[i]);
+		if (width > 0)
+			out.push_back({ chars[i], (uint8_t)width });
+	}
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct Glyph {
+	uint32_t ch;
+	uint8_t width;
+};
+
+// A string decoded into code points along with their display widths, ready to
+// be drawn into cells. Zero-width characters are dropped, as termbox has no
+// way to combine them with the previous cell.
+typedef std::vector<Glyph> Text;
+
+void LayoutText(Text &out, const std::string &s);
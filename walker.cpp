@@ -0,0 +1,138 @@
+#include "walker.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+
+Walker::Walker(const std::string &root, DirectoryRecords *records)
+	: m_records(records)
+{
+	Enter(root, true);
+}
+
+// Read and sort a directory's entries, or if it is unchanged, just the
+// subdirectories it had. Directory names keep a trailing "/" so that a plain
+// string sort puts them where their paths belong.
+void Walker::Enter(const std::string &path, bool root)
+{
+	const auto by_name = [](const Entry &a, const Entry &b) {
+		return a.name < b.name;
+	};
+
+	// A path that has gone, or is no longer a directory, takes its records
+	// with it
+	struct stat st;
+	if (stat(path.c_str(), &st)) {
+		if (errno == ENOENT) {
+			if (m_records)
+				m_records->Forget(path);
+		} else if (root || (errno != EACCES && errno != EPERM)) {
+			// Unlike those below it, an unreadable root means nothing was
+			// walked
+			m_failed.push_back(path + "/");
+		}
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		if (m_records)
+			m_records->Forget(path);
+		if (root)
+			m_file = path;
+		return;
+	}
+
+	const int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+		st.st_mtim.tv_nsec;
+	std::vector<std::string> subdirs;
+
+	if (m_records && m_records->Unchanged(path, mtime, subdirs)) {
+		m_skipped.insert(path);
+		m_stack.push_back(Dir{ path, {}, 0 });
+		std::vector<Entry> &entries = m_stack.back().entries;
+		for (const std::string &name : subdirs)
+			entries.push_back(Entry{ name + "/", true });
+		std::sort(entries.begin(), entries.end(), by_name);
+		return;
+	}
+
+	DIR *dir = opendir(path.c_str());
+	if (!dir) {
+		if (errno != ENOENT &&
+				(root || (errno != EACCES && errno != EPERM)))
+			m_failed.push_back(path + "/");
+		return;
+	}
+
+	m_stack.push_back(Dir{ path, {}, 0 });
+	std::vector<Entry> &entries = m_stack.back().entries;
+
+	struct dirent *ent;
+	while ((errno = 0, ent = readdir(dir))) {
+		const char *const name = ent->d_name;
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
+
+		bool is_dir = ent->d_type == DT_DIR;
+		if (ent->d_type == DT_UNKNOWN) {
+			is_dir = !lstat((path + "/" + name).c_str(), &st) &&
+				S_ISDIR(st.st_mode);
+		}
+
+		entries.push_back(Entry{ is_dir ? std::string(name) + "/" : name,
+				is_dir });
+		if (is_dir)
+			subdirs.push_back(name);
+	}
+	const bool failed = errno;
+	closedir(dir);
+
+	// A partial listing isn't recorded, so the directory is read again
+	if (failed)
+		m_failed.push_back(path + "/");
+	else if (m_records)
+		m_records->Record(path, mtime, subdirs);
+
+	std::sort(entries.begin(), entries.end(), by_name);
+}
+
+bool Walker::Next(std::string &path)
+{
+	if (m_file.size()) {
+		path = std::move(m_file);
+		m_file.clear();
+		return true;
+	}
+
+	while (m_stack.size()) {
+		Dir &d = m_stack.back();
+		if (d.next == d.entries.size()) {
+			m_stack.pop_back();
+			continue;
+		}
+
+		const Entry &e = d.entries[d.next++];
+		if (e.dir) {
+			Enter(d.path + "/" + e.name.substr(0, e.name.size() - 1), false);
+			continue;
+		}
+
+		path = d.path + "/" + e.name;
+		return true;
+	}
+
+	return false;
+}
+
+bool Walker::Unknown(const std::string &path) const
+{
+	const size_t slash = path.rfind('/');
+	if (slash != std::string::npos && m_skipped.count(path.substr(0, slash)))
+		return true;
+
+	for (const std::string &prefix : m_failed) {
+		if (!path.compare(0, prefix.size(), prefix))
+			return true;
+	}
+	return false;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// What a previous walk saw of each directory, so that one whose mtime hasn't
+// moved since can be skipped. Adding, removing or renaming an entry changes a
+// directory's mtime, but rewriting a file in place doesn't.
+class DirectoryRecords {
+public:
+	virtual ~DirectoryRecords() {}
+
+	// Whether dir was recorded with this mtime, and if so set subdirs to the
+	// names of the directories it had
+	virtual bool Unchanged(const std::string &dir, int64_t mtime,
+			std::vector<std::string> &subdirs) = 0;
+
+	// Note what a directory held when it was read
+	virtual void Record(const std::string &dir, int64_t mtime,
+			const std::vector<std::string> &subdirs) = 0;
+
+	// Drop what is known of a directory that has gone and of those under it,
+	// so that one moved back in its place is read
+	virtual void Forget(const std::string &dir) = 0;
+};
+
+// Walks a directory tree yielding files in the order sqlite sorts their paths
+// with the BINARY collation, so the walk can be merged with a query ordered by
+// path. Entries are sorted by name, byte by byte, with directories compared as
+// if their names ended in "/": "a b/x" sorts before "a/x", as the full paths
+// do. Only the entries of the directories on the current path are held.
+//
+// A root that is a file yields just itself, and one that doesn't exist yields
+// nothing. Symbolic links to directories below the root aren't followed, and
+// directories that can't be read for lack of permission are skipped as if
+// empty.
+//
+// Given records, a directory that hasn't changed isn't read: its files aren't
+// yielded, and the walk goes straight on to the subdirectories it had before,
+// each of which costs one stat to check in turn.
+class Walker {
+private:
+	struct Entry {
+		std::string name;
+		bool dir;
+	};
+
+	struct Dir {
+		std::string path;
+		std::vector<Entry> entries;
+		size_t next;
+	};
+
+	std::vector<Dir> m_stack;
+	// Directories that couldn't be read for other reasons, as prefixes of the
+	// paths under them
+	std::vector<std::string> m_failed;
+	std::unordered_set<std::string> m_skipped; // Unchanged directories
+	std::string m_file; // A root that is a file, until it is yielded
+	DirectoryRecords *m_records;
+
+	void Enter(const std::string &path, bool root);
+
+public:
+	// Paths are the root joined with the names below it, so "." gives "./a/b".
+	// Records may be null to read every directory.
+	Walker(const std::string &root, DirectoryRecords *records);
+
+	// Returns false at the end of the walk
+	bool Next(std::string &path);
+
+	// Whether path may exist in a directory the walk couldn't read or skipped
+	// as unchanged, in which case not having seen it says nothing
+	bool Unknown(const std::string &path) const;
+
+	inline bool Complete() const { return m_failed.empty(); }
+};
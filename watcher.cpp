@@ -0,0 +1,222 @@
+#include "watcher.hpp"
+#include "event.hpp"
+#include "util.hpp"
+#include <chrono>
+#include <cstring>
+#include <set>
+#include <unordered_map>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+// Directories past the system's watch limit go unwatched until the next scan
+#define WATCH_MASK \
+	(IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+	 IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define SETTLE_MS 500 // Quiet time before a batch is reported
+#define MAX_DELAY_MS 5000 // Longest a path waits while events keep coming
+#define READ_SIZE 65536
+
+typedef std::chrono::steady_clock Clock;
+
+static int g_inotify = -1;
+static int g_timer = -1;
+static bool g_armed = false;
+static std::string g_root;
+static std::unordered_map<int, std::string> g_watches; // Directory by wd
+static std::set<std::string> g_dirty;
+static Clock::time_point g_first; // Of the events behind g_dirty
+static Clock::time_point g_last;
+
+static void Arm(Clock::duration delay)
+{
+	const long long ns = std::max<long long>(
+			std::chrono::nanoseconds(delay).count(), 1);
+
+	struct itimerspec spec = {};
+	spec.it_value.tv_sec = ns / 1000000000;
+	spec.it_value.tv_nsec = ns % 1000000000;
+
+	if (timerfd_settime(g_timer, 0, &spec, nullptr))
+		throw "Couldn't set library watch timer";
+	g_armed = true;
+}
+
+// Watch a directory and everything below it
+static void AddWatches(const std::string &root)
+{
+	std::vector<std::string> dirs = { root };
+
+	while (dirs.size()) {
+		const std::string dir = std::move(dirs.back());
+		dirs.pop_back();
+
+		const int wd = inotify_add_watch(g_inotify, dir.c_str(), WATCH_MASK);
+		if (wd < 0)
+			continue;
+		g_watches[wd] = dir;
+
+		DIR *d = opendir(dir.c_str());
+		if (!d)
+			continue;
+
+		struct dirent *ent;
+		while ((ent = readdir(d))) {
+			if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+				continue;
+
+			const std::string path = dir + "/" + ent->d_name;
+			bool is_dir = ent->d_type == DT_DIR;
+			if (ent->d_type == DT_UNKNOWN) {
+				struct stat st;
+				is_dir = !lstat(path.c_str(), &st) && S_ISDIR(st.st_mode);
+			}
+			if (is_dir)
+				dirs.push_back(path);
+		}
+		closedir(d);
+	}
+}
+
+// Stop watching a directory that has moved away, and everything below it. If
+// it moved within the tree, it is watched again under its new name.
+static void RemoveWatches(const std::string &root)
+{
+	for (auto it = g_watches.begin(); it != g_watches.end(); ) {
+		const std::string &dir = it->second;
+		if (dir == root || !dir.compare(0, root.size() + 1, root + "/")) {
+			inotify_rm_watch(g_inotify, it->first);
+			it = g_watches.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+static void Dirty(const std::string &path)
+{
+	const Clock::time_point now = Clock::now();
+	if (g_dirty.empty())
+		g_first = now;
+	g_last = now;
+	g_dirty.insert(path);
+
+	// The timer is pushed back when it fires rather than on every event
+	if (!g_armed)
+		Arm(std::chrono::milliseconds(SETTLE_MS));
+}
+
+static void Handle(const struct inotify_event *ev)
+{
+	// Events were lost, so anything may have changed, including directories
+	// created without being watched. A directory already watched keeps its
+	// wd and has its path brought up to date.
+	if (ev->mask & IN_Q_OVERFLOW) {
+		AddWatches(g_root);
+		Dirty(g_root);
+		return;
+	}
+
+	auto it = g_watches.find(ev->wd);
+	if (it == g_watches.end())
+		return;
+
+	if (ev->mask & IN_IGNORED) {
+		g_watches.erase(it);
+		return;
+	}
+
+	if (!ev->len)
+		return;
+
+	const std::string path = it->second + "/" + ev->name;
+
+	// A directory that appears may already have files in it, which its own
+	// watch is too late to see, so the whole of it is read
+	if (ev->mask & IN_ISDIR) {
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+			AddWatches(path);
+		else if (ev->mask & IN_MOVED_FROM)
+			RemoveWatches(path);
+
+		if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+			Dirty(path);
+		return;
+	}
+
+	// A new file is picked up once it is closed after writing, rather than
+	// half copied
+	if (!(ev->mask & IN_CREATE) && IsAudioPath(path))
+		Dirty(path);
+}
+
+bool WatcherGlobalInit(const std::string &root)
+{
+	if ((g_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return false;
+
+	if ((g_timer = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		throw "Couldn't create library watch timer";
+
+	g_root = root;
+	AddWatches(root);
+
+	EventWatchLibrary(g_inotify);
+	EventWatchLibrary(g_timer);
+
+	return true;
+}
+
+void WatcherGlobalDestroy()
+{
+	if (g_inotify < 0)
+		return;
+
+	close(g_timer);
+	close(g_inotify);
+	g_timer = g_inotify = -1;
+	g_armed = false;
+	g_watches.clear();
+	g_dirty.clear();
+}
+
+bool WatcherPoll(std::vector<std::string> &paths)
+{
+	alignas(struct inotify_event) char buf[READ_SIZE];
+	ssize_t n;
+
+	while ((n = read(g_inotify, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n; ) {
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+			Handle(ev);
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	uint64_t expirations;
+	if (read(g_timer, &expirations, sizeof(expirations)) !=
+			sizeof(expirations))
+		return false;
+	g_armed = false;
+
+	if (g_dirty.empty())
+		return false;
+
+	// Wait for the events to stop, but not for ever
+	const Clock::time_point now = Clock::now();
+	const Clock::time_point settled = g_last +
+		std::chrono::milliseconds(SETTLE_MS);
+	const Clock::time_point limit = g_first +
+		std::chrono::milliseconds(MAX_DELAY_MS);
+	if (now < settled && now < limit) {
+		Arm(std::min(settled, limit) - now);
+		return false;
+	}
+
+	paths.assign(g_dirty.begin(), g_dirty.end());
+	g_dirty.clear();
+	return true;
+}
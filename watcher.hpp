@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Watches the library directory with inotify so that files added, changed or
+// removed while juke runs reach the library without a rescan. Every directory
+// in the tree has a watch, and new ones are watched as they appear. Events are
+// coalesced: affected paths collect until the tree has been quiet for a
+// moment, or for a few seconds at most during a long copy, and then come out
+// as one batch. The watcher is served from the main event loop, which reports
+// it as EVENT_LIBRARY.
+
+// Watch the tree at root; paths are root joined with the names below it.
+// Returns false if inotify isn't available, leaving updates to scans.
+bool WatcherGlobalInit(const std::string &root);
+void WatcherGlobalDestroy();
+
+// Read pending events and, once they have settled, set paths to the files and
+// directories that changed. Returns true if it did.
+bool WatcherPoll(std::vector<std::string> &paths);
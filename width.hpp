@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstdint>
+
+// Number of terminal columns a code point occupies: 0 for control characters
+// and combining marks, 2 for East Asian wide and fullwidth characters and 1
+// for everything else. Backed by a lookup table built at compile time.
+int CharWidth(uint32_t ch);